@@ -8,6 +8,9 @@ struct s_config {
 	byte max_const_slots;
 	byte max_zero_page_slots;
 	byte additional_zero_page_slots;
+	bool use_external_sort; // group by sorting runs on disk instead of in memory
+	bool use_large_pages; // for the equivalence table
+	bool use_numa; // equivalence table interleaved over the NUMA nodes
 };
 
 #endif
@@ -59,19 +59,21 @@ bool compare_state(M6502 *state1, M6502 *state2)
 	return true;
 }
 
-void test()
-{
-  M6502    *mpu = M6502_new(0, 0, 0);	/* Make a 6502 */
-  unsigned  pc  = 0x1000;		/* PC for 'assembly' */
+static M6502_Callbacks callbacks;	/* Shared by every instance */
+static M6502_Memory	memory;		/* What each instance starts from */
+static unsigned		program_end;	/* Just past the assembled program */
 
-  /* Install the two callback functions defined above.
-   */
-  M6502_setCallback(mpu, call, WRCH, wrch);	/* Calling FFEE -> wrch() */
-  M6502_setCallback(mpu, call,    0, done);	/* Calling 0 -> done() */
+/* Assemble the program into the baseline memory and make one pool of
+ * 6502s per thread.  Call once, before test().
+ */
+void test_init()
+{
+  M6502_Registers registers= { 0 };
+  unsigned	  pc  = 0x1000;	/* PC for 'assembly' */
 
-  /* A few macros that dump bytes into the 6502's memory.
+  /* A few macros that dump bytes into the baseline memory.
    */
-# define gen1(X)	(mpu->memory[pc++]= (uint8_t)(X))
+# define gen1(X)	(memory[pc++]= (uint8_t)(X))
 # define gen2(X,Y)	gen1(X); gen1(Y)
 # define gen3(X,Y,Z)	gen1(X); gen2(Y,Z)
 
@@ -86,27 +88,45 @@ void test()
   gen2(0xA9, '\n'    );	// LDA #'\n'
   gen3(0x20,0xEE,0xFF);	// JSR FFEE
   gen2(0x00,0x00     ); // BRK
+  program_end= pc;
+
+  /* Point the RESET vector at the first instruction in the assembled
+   * program.
+   */
+  memory[0xFFFC]= 0x00;
+  memory[0xFFFD]= 0x10;
+
+  /* Install the two callback functions defined above.
+   */
+  callbacks.call[WRCH]= wrch;	/* Calling FFEE -> wrch() */
+  callbacks.call[   0]= done;	/* Calling 0 -> done() */
+
+  /* Make the 6502s.  Every instance released back to a pool is reset
+   * to the memory above by copying back only the pages it wrote.
+   */
+  emulator_pool::init_thread_pools(memory, registers, &callbacks, 1);
+}
+
+void test()
+{
+  emulator_pool &pool= emulator_pool::for_thread();
+  M6502	       *mpu= pool.acquire();
 
   /* Just for fun: disassemble the program.
    */
   {
     char     insn[64];
     uint16_t ip= 0x1000;
-    while (ip < pc)
+    while (ip < program_end)
       {
 	ip += M6502_disassemble(mpu, ip, insn);
 	printf("%04X %s\n", ip, insn);
       }
   }
 
-  /* Point the RESET vector at the first instruction in the assembled
-   * program.
-   */
-  M6502_setVector(mpu, RST, 0x1000);
-
   /* Reset the 6502 and run the program.
    */
   M6502_reset(mpu);
   M6502_run(mpu);
-  M6502_delete(mpu);	/* We never reach here, but what the hey. */
+  pool.release(mpu);	/* We never reach here, but what the hey. */
 }
@@ -0,0 +1,129 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <omp.h>
+#include "emulator_pool.hpp"
+
+using namespace std;
+
+#define CACHE_LINE 64
+
+vector <emulator_pool *> emulator_pool::thread_pools;
+
+static void *aligned_block(size_t size, void **allocation)
+{
+	*allocation=calloc(1,size+CACHE_LINE);
+	if (!*allocation)
+		abort();
+	return (void *)(((size_t)*allocation+CACHE_LINE-1) & ~(size_t)(CACHE_LINE-1));
+}
+
+emulator_pool::emulator_pool()
+{
+	baseline_memory=NULL;
+	baseline_allocation=NULL;
+	memset(&baseline_registers,0,sizeof(baseline_registers));
+	callbacks=NULL;
+}
+
+emulator_pool::~emulator_pool()
+{
+	for (size_t i=0;i<slots.size();++i)
+	{
+		M6502_delete(slots[i]->mpu);
+		free(slots[i]->allocation);
+	}
+	free(baseline_allocation);
+}
+
+void emulator_pool::init(const byte *a_baseline_memory, const M6502_Registers &a_baseline_registers, M6502_Callbacks *a_callbacks, size_t instances)
+{
+	baseline_memory=(byte *)aligned_block(sizeof(M6502_Memory),&baseline_allocation);
+	if (a_baseline_memory)
+		memcpy(baseline_memory,a_baseline_memory,sizeof(M6502_Memory));
+	baseline_registers=a_baseline_registers;
+	callbacks=a_callbacks;
+
+	slots.reserve(instances);
+	free_slots.reserve(instances);
+	for (size_t i=0;i<instances;++i)
+		free_slots.push_back(new_slot());
+}
+
+s_emulator_slot *emulator_pool::new_slot()
+{
+	void *allocation;
+	s_emulator_slot *slot=(s_emulator_slot *)aligned_block(sizeof(s_emulator_slot),&allocation);
+	slot->allocation=allocation;
+	memcpy(slot->memory,baseline_memory,sizeof(M6502_Memory));
+	slot->registers=baseline_registers;
+	slot->mpu=M6502_new(&slot->registers,slot->memory,callbacks);
+	slot->mpu->dirty=slot->dirty;
+	slots.push_back(slot);
+	return slot;
+}
+
+// copy back the pages written since the last reset
+void emulator_pool::reset(s_emulator_slot *slot)
+{
+	for (size_t page=0;page<256;++page)
+	{
+		if (slot->dirty[page])
+		{
+			memcpy(slot->memory+page*256,baseline_memory+page*256,256);
+			slot->dirty[page]=0;
+		}
+	}
+	slot->registers=baseline_registers;
+	slot->mpu->ticks=0;
+	slot->mpu->limit=M6502_unlimited;
+}
+
+M6502 *emulator_pool::acquire()
+{
+	if (free_slots.empty())
+		return new_slot()->mpu;
+	s_emulator_slot *slot=free_slots.back();
+	free_slots.pop_back();
+	return slot->mpu;
+}
+
+void emulator_pool::release(M6502 *mpu)
+{
+	s_emulator_slot *slot=(s_emulator_slot *)mpu->memory;
+	assert(slot->mpu==mpu);
+	reset(slot);
+	free_slots.push_back(slot);
+}
+
+void emulator_pool::poke(M6502 *mpu, word address, byte value)
+{
+	mpu->memory[address]=value;
+	mpu->dirty[address>>8]=1;
+}
+
+void emulator_pool::init_thread_pools(const byte *a_baseline_memory, const M6502_Registers &a_baseline_registers, M6502_Callbacks *a_callbacks, size_t instances)
+{
+	free_thread_pools();
+	int threads=omp_get_max_threads();
+	for (int i=0;i<threads;++i)
+	{
+		emulator_pool *pool=new emulator_pool;
+		pool->init(a_baseline_memory,a_baseline_registers,a_callbacks,instances);
+		thread_pools.push_back(pool);
+	}
+}
+
+emulator_pool &emulator_pool::for_thread()
+{
+	size_t thread=omp_get_thread_num();
+	assert(thread<thread_pools.size());
+	return *thread_pools[thread];
+}
+
+void emulator_pool::free_thread_pools()
+{
+	for (size_t i=0;i<thread_pools.size();++i)
+		delete thread_pools[i];
+	thread_pools.clear();
+}
@@ -0,0 +1,57 @@
+#ifndef EMULATOR_POOL_H
+#define EMULATOR_POOL_H
+
+#include <vector>
+#include "types.hpp"
+
+extern "C"{
+#include "lib6502.h"
+};
+
+// One emulator instance of a pool. The memory comes first so that the slot
+// can be found from mpu->memory, and the slot is cache line aligned.
+struct s_emulator_slot {
+	M6502_Memory memory;
+	M6502_Registers registers;
+	byte dirty[256]; // pages written since the last reset, set by lib6502
+	M6502 *mpu;
+	void *allocation; // what to free
+};
+
+// Pre-allocated emulator instances that are reset to a baseline state on
+// release by copying back only the pages they wrote. All instances share
+// one callback table. Not thread safe: use one pool per thread.
+class emulator_pool {
+private:
+	std::vector <s_emulator_slot *> slots;
+	std::vector <s_emulator_slot *> free_slots;
+	byte *baseline_memory;
+	void *baseline_allocation;
+	M6502_Registers baseline_registers;
+	M6502_Callbacks *callbacks;
+
+	static std::vector <emulator_pool *> thread_pools;
+
+	emulator_pool(const emulator_pool &);
+	emulator_pool &operator=(const emulator_pool &);
+
+	void reset(s_emulator_slot *slot);
+	s_emulator_slot *new_slot();
+
+public:
+	emulator_pool();
+	~emulator_pool();
+
+	void init(const byte *a_baseline_memory, const M6502_Registers &a_baseline_registers, M6502_Callbacks *a_callbacks, size_t instances);
+	M6502 *acquire();
+	void release(M6502 *mpu);
+	// write memory from the host side so that reset will undo it
+	void poke(M6502 *mpu, word address, byte value);
+
+	// one pool per OpenMP thread
+	static void init_thread_pools(const byte *a_baseline_memory, const M6502_Registers &a_baseline_registers, M6502_Callbacks *a_callbacks, size_t instances);
+	static emulator_pool &for_thread();
+	static void free_thread_pools();
+};
+
+#endif
@@ -0,0 +1,121 @@
+#include <stdlib.h>
+#include <assert.h>
+#include "equivalence_table.hpp"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#define compare_and_swap(p,old_value,new_value) (_InterlockedCompareExchange64((volatile __int64 *)(p),(__int64)(new_value),(__int64)(old_value))==(__int64)(old_value))
+// _InterlockedIncrement64 is only an intrinsic on x64, the exchange is one on x86 too
+static void atomic_increment(volatile long long *p)
+{
+	long long old_value;
+	do
+		old_value=*p;
+	while (!compare_and_swap(p,old_value,old_value+1));
+}
+#else
+#define compare_and_swap(p,old_value,new_value) __sync_bool_compare_and_swap(p,old_value,new_value)
+#define atomic_increment(p) __sync_add_and_fetch(p,1)
+#endif
+
+equivalence_table::equivalence_table()
+{
+	memory.address=NULL;
+	memory.size=0;
+	entries=NULL;
+	capacity=0;
+	used=0;
+}
+
+equivalence_table::~equivalence_table()
+{
+	free_table_memory(memory);
+}
+
+void equivalence_table::init(size_t a_capacity, unsigned memory_flags)
+{
+	free_table_memory(memory);
+	capacity=1;
+	while (capacity<a_capacity)
+		capacity<<=1;
+	if (!allocate_table_memory(capacity*sizeof(s_equivalence_entry),memory_flags,memory))
+		abort();
+	entries=(s_equivalence_entry *)memory.address;
+	used=0;
+}
+
+e_insert_result equivalence_table::insert(uint64_t fingerprint, word cost, uint64_t payload)
+{
+	assert(fingerprint!=0);
+	assert(payload<((uint64_t)1<<EQUIVALENCE_PAYLOAD_BITS));
+	uint64_t value=((uint64_t)cost<<EQUIVALENCE_PAYLOAD_BITS) | payload;
+	// 0 means not set yet
+	if (value==0)
+		value=1;
+
+	size_t mask=capacity-1;
+	size_t i=(size_t)fingerprint & mask;
+	for (size_t probe=0;probe<capacity;++probe,i=(i+1) & mask)
+	{
+		s_equivalence_entry &entry=entries[i];
+		uint64_t key=entry.fingerprint;
+		if (key==0)
+		{
+			if (compare_and_swap(&entry.fingerprint,(uint64_t)0,fingerprint))
+			{
+				atomic_increment(&used);
+				key=fingerprint;
+			}
+			else
+				key=entry.fingerprint;
+		}
+		if (key!=fingerprint)
+			continue;
+
+		// keep the lower value: the cheaper sequence or, at equal cost, the lower payload
+		for (;;)
+		{
+			uint64_t old_value=entry.representative;
+			if (old_value!=0 && old_value<=value)
+				return E_INSERT_KEPT;
+			if (compare_and_swap(&entry.representative,old_value,value))
+				return old_value==0 ? E_INSERT_NEW : E_INSERT_REPLACED;
+		}
+	}
+	return E_INSERT_FULL;
+}
+
+bool equivalence_table::find(uint64_t fingerprint, word &cost, uint64_t &payload) const
+{
+	size_t mask=capacity-1;
+	size_t i=(size_t)fingerprint & mask;
+	for (size_t probe=0;probe<capacity;++probe,i=(i+1) & mask)
+	{
+		uint64_t key=entries[i].fingerprint;
+		if (key==0)
+			return false;
+		if (key==fingerprint)
+		{
+			uint64_t value=entries[i].representative;
+			if (value==0)
+				return false;
+			cost=(word)(value>>EQUIVALENCE_PAYLOAD_BITS);
+			payload=value & (((uint64_t)1<<EQUIVALENCE_PAYLOAD_BITS)-1);
+			return true;
+		}
+	}
+	return false;
+}
+
+bool equivalence_table::get(size_t i, uint64_t &fingerprint, word &cost, uint64_t &payload) const
+{
+	assert(i<capacity);
+	const s_equivalence_entry &entry=entries[i];
+	uint64_t value=entry.representative;
+	if (entry.fingerprint==0 || value==0)
+		return false;
+	fingerprint=entry.fingerprint;
+	cost=(word)(value>>EQUIVALENCE_PAYLOAD_BITS);
+	payload=value & (((uint64_t)1<<EQUIVALENCE_PAYLOAD_BITS)-1);
+	return true;
+}
@@ -0,0 +1,58 @@
+#ifndef EQUIVALENCE_TABLE_H
+#define EQUIVALENCE_TABLE_H
+
+#include <stdint.h>
+#include "types.hpp"
+#include "table_memory.hpp"
+
+// cycles first, then size
+#define SEQUENCE_COST(cycles,size) ((word)(((cycles)<<8) | (size)))
+
+#define EQUIVALENCE_PAYLOAD_BITS 48
+
+enum e_insert_result {
+	E_INSERT_NEW, // first sequence of its class
+	E_INSERT_REPLACED, // cheaper than the representative, now it is the representative
+	E_INSERT_KEPT, // not cheaper, the table is unchanged
+	E_INSERT_FULL,
+};
+
+struct s_equivalence_entry {
+	volatile uint64_t fingerprint; // 0 when the entry is free
+	volatile uint64_t representative; // cost<<48 | payload, 0 until set
+};
+
+// Fixed capacity open addressing table from output fingerprints to the
+// cheapest sequence seen with that output. Any number of threads can
+// insert at once: entries are claimed and representatives replaced with a
+// compare and swap, no lock is taken. Equal costs are broken by the lower
+// payload, so the result does not depend on the order of the inserts.
+// With TABLE_NUMA the pages are interleaved over all nodes: any thread
+// inserts any fingerprint, so no placement would keep the probes local,
+// but interleaving spreads them over every memory controller.
+class equivalence_table {
+private:
+	s_table_memory memory;
+	s_equivalence_entry *entries;
+	size_t capacity; // power of two
+	volatile long long used;
+
+	equivalence_table(const equivalence_table &);
+	equivalence_table &operator=(const equivalence_table &);
+
+public:
+	equivalence_table();
+	~equivalence_table();
+
+	// memory_flags are TABLE_LARGE_PAGES and TABLE_NUMA
+	void init(size_t a_capacity, unsigned memory_flags=0);
+	e_insert_result insert(uint64_t fingerprint, word cost, uint64_t payload);
+	bool find(uint64_t fingerprint, word &cost, uint64_t &payload) const;
+
+	size_t get_capacity() const { return capacity; }
+	size_t get_classes() const { return (size_t)used; }
+	// entry i, false if it is free
+	bool get(size_t i, uint64_t &fingerprint, word &cost, uint64_t &payload) const;
+};
+
+#endif
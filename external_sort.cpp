@@ -0,0 +1,206 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <algorithm>
+#include <queue>
+#include <functional>
+#include <omp.h>
+#include "external_sort.hpp"
+
+using namespace std;
+
+// records read at a time from every run during the merge
+#define MERGE_READ_RECORDS 65536
+
+void radix_sort(s_fingerprint_record *records, s_fingerprint_record *scratch, size_t count)
+{
+	int chunks=omp_get_max_threads();
+	size_t chunk_size=(count+chunks-1)/chunks;
+	vector <size_t> histogram(chunks*256);
+	s_fingerprint_record *source=records, *destination=scratch;
+
+	for (int shift=0;shift<64;shift+=8)
+	{
+		int c;
+		fill(histogram.begin(),histogram.end(),0);
+		#pragma omp parallel for schedule(static)
+		for (c=0;c<chunks;++c)
+		{
+			size_t *h=&histogram[c*256];
+			size_t end=min(count,(c+1)*chunk_size);
+			for (size_t i=c*chunk_size;i<end;++i)
+				++h[(source[i].fingerprint>>shift) & 0xff];
+		}
+
+		// prefix sums in digit order, then chunk order, keep it stable
+		size_t offset=0;
+		bool one_digit=false;
+		for (size_t d=0;d<256;++d)
+		{
+			size_t digit_start=offset;
+			for (c=0;c<chunks;++c)
+			{
+				size_t n=histogram[c*256+d];
+				histogram[c*256+d]=offset;
+				offset+=n;
+			}
+			if (offset-digit_start==count)
+				one_digit=true;
+		}
+		// every key has the same digit, nothing to do
+		if (one_digit)
+			continue;
+
+		#pragma omp parallel for schedule(static)
+		for (c=0;c<chunks;++c)
+		{
+			size_t *h=&histogram[c*256];
+			size_t end=min(count,(c+1)*chunk_size);
+			for (size_t i=c*chunk_size;i<end;++i)
+				destination[h[(source[i].fingerprint>>shift) & 0xff]++]=source[i];
+		}
+		swap(source,destination);
+	}
+	if (source!=records)
+		memcpy(records,source,count*sizeof(s_fingerprint_record));
+}
+
+fingerprint_sorter::fingerprint_sorter()
+{
+	run_records=0;
+	records=0;
+}
+
+fingerprint_sorter::~fingerprint_sorter()
+{
+	remove_runs();
+}
+
+void fingerprint_sorter::init(const std::string &a_path_prefix, size_t a_run_records)
+{
+	remove_runs();
+	path_prefix=a_path_prefix;
+	run_records=a_run_records;
+	buffer.clear();
+	buffer.reserve(run_records);
+	records=0;
+}
+
+bool fingerprint_sorter::add(uint64_t fingerprint, word cost, uint64_t payload)
+{
+	assert(payload<((uint64_t)1<<EQUIVALENCE_PAYLOAD_BITS));
+	s_fingerprint_record record;
+	record.fingerprint=fingerprint;
+	record.representative=((uint64_t)cost<<EQUIVALENCE_PAYLOAD_BITS) | payload;
+	buffer.push_back(record);
+	++records;
+	if (buffer.size()>=run_records)
+		return write_run();
+	return true;
+}
+
+bool fingerprint_sorter::write_run()
+{
+	if (buffer.empty())
+		return true;
+	scratch.resize(buffer.size());
+	radix_sort(&buffer[0],&scratch[0],buffer.size());
+
+	char number[32];
+	sprintf(number,"%u",(unsigned)runs.size());
+	string path=path_prefix+number+".run";
+	FILE *file=fopen(path.c_str(),"wb");
+	if (!file)
+		return false;
+	runs.push_back(path);
+	bool ok=fwrite(&buffer[0],sizeof(s_fingerprint_record),buffer.size(),file)==buffer.size();
+	ok&=fclose(file)==0;
+	buffer.clear();
+	return ok;
+}
+
+struct s_merge_run {
+	FILE *file;
+	vector <s_fingerprint_record> records;
+	size_t next, count;
+
+	bool fill()
+	{
+		next=0;
+		count=fread(&records[0],sizeof(s_fingerprint_record),records.size(),file);
+		return count!=0;
+	}
+};
+
+// the smallest fingerprint on top
+typedef pair <uint64_t, size_t> merge_head;
+
+bool fingerprint_sorter::merge(fingerprint_group_callback callback, void *context)
+{
+	if (!write_run())
+		return false;
+	scratch.clear();
+
+	vector <s_merge_run> merge_runs(runs.size());
+	priority_queue <merge_head, vector <merge_head>, greater <merge_head> > heads;
+	bool ok=true;
+	for (size_t r=0;r<runs.size();++r)
+	{
+		s_merge_run &run=merge_runs[r];
+		run.records.resize(MERGE_READ_RECORDS);
+		run.file=fopen(runs[r].c_str(),"rb");
+		if (!run.file)
+		{
+			ok=false;
+			continue;
+		}
+		if (run.fill())
+			heads.push(merge_head(run.records[0].fingerprint,r));
+	}
+
+	// only the cheapest record of the group so far and the group size are kept
+	s_fingerprint_record cheapest;
+	unsigned long long group_size=0;
+	while (ok && !heads.empty())
+	{
+		merge_head head=heads.top();
+		heads.pop();
+		s_merge_run &run=merge_runs[head.second];
+
+		if (group_size && cheapest.fingerprint!=head.first)
+		{
+			callback(cheapest,group_size,context);
+			group_size=0;
+		}
+		// take everything with this fingerprint from the run at once
+		while (run.next<run.count && run.records[run.next].fingerprint==head.first)
+		{
+			const s_fingerprint_record &record=run.records[run.next++];
+			if (!group_size++ || record.representative<cheapest.representative)
+				cheapest=record;
+			if (run.next==run.count)
+				run.fill();
+		}
+		if (run.next<run.count)
+			heads.push(merge_head(run.records[run.next].fingerprint,head.second));
+	}
+	if (ok && group_size)
+		callback(cheapest,group_size,context);
+
+	for (size_t r=0;r<merge_runs.size();++r)
+	{
+		if (merge_runs[r].file)
+		{
+			ok&=!ferror(merge_runs[r].file);
+			fclose(merge_runs[r].file);
+		}
+	}
+	return ok;
+}
+
+void fingerprint_sorter::remove_runs()
+{
+	for (size_t r=0;r<runs.size();++r)
+		remove(runs[r].c_str());
+	runs.clear();
+}
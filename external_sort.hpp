@@ -0,0 +1,53 @@
+#ifndef EXTERNAL_SORT_H
+#define EXTERNAL_SORT_H
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "equivalence_table.hpp"
+
+// representative is packed as in equivalence_table: cost<<48 | payload
+struct s_fingerprint_record {
+	uint64_t fingerprint;
+	uint64_t representative;
+};
+
+// called once per fingerprint with the cheapest of its records and how many there were
+typedef void (*fingerprint_group_callback)(const s_fingerprint_record &cheapest, unsigned long long count, void *context);
+
+// Groups sequences by fingerprint when there are too many to keep in
+// memory. Records are collected into a buffer that is radix sorted (by all
+// the threads) and written to disk as a run whenever it fills. merge()
+// then reads the runs back in one sequential pass and reports every group.
+// Memory is the run buffer plus a read buffer per run, however large a
+// group is. add() is not thread safe.
+class fingerprint_sorter {
+private:
+	std::string path_prefix;
+	std::vector <s_fingerprint_record> buffer;
+	std::vector <s_fingerprint_record> scratch;
+	size_t run_records;
+	std::vector <std::string> runs;
+	unsigned long long records;
+
+	fingerprint_sorter(const fingerprint_sorter &);
+	fingerprint_sorter &operator=(const fingerprint_sorter &);
+
+	bool write_run();
+
+public:
+	fingerprint_sorter();
+	~fingerprint_sorter();
+
+	void init(const std::string &a_path_prefix, size_t a_run_records);
+	bool add(uint64_t fingerprint, word cost, uint64_t payload);
+	bool merge(fingerprint_group_callback callback, void *context);
+	void remove_runs();
+
+	unsigned long long get_records() const { return records; }
+	size_t get_runs() const { return runs.size(); }
+};
+
+void radix_sort(s_fingerprint_record *records, s_fingerprint_record *scratch, size_t count);
+
+#endif
@@ -31,6 +31,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "lib6502.h"
 
@@ -64,13 +65,26 @@ enum {
 
 #define NAND(P, Q)	(!((P) & (Q)))
 
-#define tick(n)
-#define tickIf(p)
+#define tick(n)		(ticks += (n))
+#define tickIf(p)	(ticks += ((p) ? 1 : 0))
+
+/* return from M6502_run if the cycle limit has been reached.  polled at
+ * every backward branch, jump, call and return, so that any loop will
+ * eventually pass through here. */
+
+#define poll()					\
+  if (ticks >= mpu->limit)			\
+    {						\
+      externalise();				\
+      return;					\
+    }
 
 /* memory access (indirect if callback installed) -- ARGUMENTS ARE EVALUATED MORE THAN ONCE! */
 
 #define putMemory(ADDR, BYTE)			\
-  ( writeCallback[ADDR]				\
+  ( traced(ADDR, BYTE),				\
+    touched(ADDR),				\
+    writeCallback[ADDR]				\
       ? writeCallback[ADDR](mpu, ADDR, BYTE)	\
       : (memory[ADDR]= BYTE) )
 
@@ -79,9 +93,17 @@ enum {
       ?  readCallback[ADDR](mpu, ADDR, 0)	\
       :  memory[ADDR] )
 
+/* memory writes are logged when tracing */
+
+#define traced(ADDR, BYTE)	(trace ? traceWrite(trace, ADDR, BYTE) : 0)
+
+/* and the pages they touch recorded if asked */
+
+#define touched(ADDR)		(dirty ? dirty[(ADDR) >> 8]= 1 : 0)
+
 /* stack access (always direct) */
 
-#define push(BYTE)		(memory[0x0100 + S--]= (BYTE))
+#define push(BYTE)		(traced(0x0100 + S, BYTE), touched(0x0100), memory[0x0100 + S--]= (BYTE))
 #define pop()			(memory[++S + 0x0100])
 
 /* adressing modes (memory access direct) */
@@ -346,7 +368,7 @@ enum {
     unsigned int i= getMemory(ea) << 1;		\
     putMemory(ea, i);				\
     fetch();					\
-    setNZC(i & 0x80, !i, i >> 8);		\
+    setNZC(i & 0x80, !(i & 0xFF), i >> 8);		\
   }						\
   next();
 
@@ -466,17 +488,43 @@ enum {
 #define sty(ticks, adrmode)	stR(ticks, adrmode, Y)
 #define stz(ticks, adrmode)	stR(ticks, adrmode, 0)
 
+/* a taken backward branch closing a short loop that cannot change memory
+ * or call out (see idleLoop()) and that arrives back at the branch with
+ * the same registers as last time round will spin until something
+ * outside the emulator intervenes: skip straight to the cycle limit. */
+
+#define backward()						\
+  if ((ea & 0x8000) && (mpu->limit != M6502_unlimited))	\
+    {								\
+      if (idle.pc != PC - ea)					\
+	{							\
+	  idle.pc= PC - ea;					\
+	  idle.ok= idleLoop(mpu, PC, idle.pc);			\
+	  idle.a= A;  idle.x= X;  idle.y= Y;  idle.p= P;  idle.s= S;	\
+	}							\
+      else if (idle.ok)						\
+	{							\
+	  if ((idle.a == A) && (idle.x == X) && (idle.y == Y)	\
+	      && (idle.p == P) && (idle.s == S))		\
+	    ticks= mpu->limit;					\
+	  idle.a= A;  idle.x= X;  idle.y= Y;  idle.p= P;  idle.s= S;	\
+	}							\
+    }								\
+  poll();
+
 #define branch(ticks, adrmode, cond)		\
   if (cond)					\
     {						\
       adrmode(ticks);				\
       PC += ea;					\
       tick(1);					\
+      backward();				\
     }						\
   else						\
     {						\
       tick(ticks);				\
       PC++;					\
+      idle.pc= -1;				\
     }						\
   fetch();					\
   next();
@@ -493,8 +541,9 @@ enum {
 #define bra(ticks, adrmode)			\
   adrmode(ticks);				\
   PC += ea;					\
-  fetch();					\
   tick(1);					\
+  backward();					\
+  fetch();					\
   next();
 
 #define jmp(ticks, adrmode)				\
@@ -510,6 +559,7 @@ enum {
 	  PC= addr;					\
 	}						\
     }							\
+  poll();						\
   fetch();						\
   next();
 
@@ -527,11 +577,13 @@ enum {
 	{						\
 	  internalise();				\
 	  PC= addr;					\
+	  poll();					\
 	  fetch();					\
 	  next();					\
 	}						\
     }							\
   PC=ea;						\
+  poll();						\
   fetch();						\
   next();
 
@@ -540,6 +592,7 @@ enum {
   PC  =  pop();					\
   PC |= (pop() << 8);				\
   PC++;						\
+  poll();					\
   fetch();					\
   next();
 
@@ -565,6 +618,7 @@ enum {
       }								\
     PC= hdlr;							\
   }								\
+  poll();							\
   fetch();							\
   next();
 
@@ -573,6 +627,7 @@ enum {
   P=     pop();					\
   PC=    pop();					\
   PC |= (pop() << 8);				\
+  poll();					\
   fetch();					\
   next();
 
@@ -584,8 +639,12 @@ enum {
 #define ill(ticks, adrmode)						\
   fetch();								\
   tick(ticks);								\
-  fflush(stdout);							\
-  fprintf(stderr, "\nundefined instruction %02X\n", memory[PC-1]);	\
+  if (!(mpu->flags & M6502_Quiet))					\
+    {									\
+      fflush(stdout);							\
+      fprintf(stderr, "\nundefined instruction %02X\n", memory[PC-1]);	\
+    }									\
+  externalise();							\
   return;
 
 #define phR(ticks, adrmode, R)			\
@@ -709,6 +768,7 @@ void M6502_irq(M6502 *mpu)
 {
   if (!(mpu->registers->p & flagI))
     {
+      if (mpu->dirty) mpu->dirty[1]= 1;
       mpu->memory[0x0100 + mpu->registers->s--] = (byte)(mpu->registers->pc >> 8);
       mpu->memory[0x0100 + mpu->registers->s--] = (byte)(mpu->registers->pc & 0xff);
       mpu->memory[0x0100 + mpu->registers->s--] = mpu->registers->p;
@@ -721,6 +781,7 @@ void M6502_irq(M6502 *mpu)
 
 void M6502_nmi(M6502 *mpu)
 {
+  if (mpu->dirty) mpu->dirty[1]= 1;
   mpu->memory[0x0100 + mpu->registers->s--] = (byte)(mpu->registers->pc >> 8);
   mpu->memory[0x0100 + mpu->registers->s--] = (byte)(mpu->registers->pc & 0xff);
   mpu->memory[0x0100 + mpu->registers->s--] = mpu->registers->p;
@@ -738,6 +799,201 @@ void M6502_reset(M6502 *mpu)
 }
 
 
+/* idle loop detection: insns that touch nothing but registers and
+ * (callback-free) memory reads, and addressing modes whose effective
+ * address does not depend on the registers. */
+
+#define idle_adc 1
+#define idle_and 1
+#define idle_asla 1
+#define idle_bit 1
+#define idle_clc 1
+#define idle_cld 1
+#define idle_cli 1
+#define idle_clv 1
+#define idle_cmp 1
+#define idle_cpx 1
+#define idle_cpy 1
+#define idle_dea 1
+#define idle_dex 1
+#define idle_dey 1
+#define idle_eor 1
+#define idle_ina 1
+#define idle_inx 1
+#define idle_iny 1
+#define idle_lda 1
+#define idle_ldx 1
+#define idle_ldy 1
+#define idle_lsra 1
+#define idle_nop 1
+#define idle_ora 1
+#define idle_rola 1
+#define idle_rora 1
+#define idle_sbc 1
+#define idle_sec 1
+#define idle_sed 1
+#define idle_sei 1
+#define idle_tax 1
+#define idle_tay 1
+#define idle_tsx 1
+#define idle_txa 1
+#define idle_txs 1
+#define idle_tya 1
+
+#define idle_asl 0
+#define idle_bcc 0
+#define idle_bcs 0
+#define idle_beq 0
+#define idle_bmi 0
+#define idle_bne 0
+#define idle_bpl 0
+#define idle_bra 0
+#define idle_brk 0
+#define idle_bvc 0
+#define idle_bvs 0
+#define idle_dec 0
+#define idle_ill 0
+#define idle_inc 0
+#define idle_jmp 0
+#define idle_jsr 0
+#define idle_lsr 0
+#define idle_pha 0
+#define idle_php 0
+#define idle_phx 0
+#define idle_phy 0
+#define idle_pla 0
+#define idle_plp 0
+#define idle_plx 0
+#define idle_ply 0
+#define idle_rol 0
+#define idle_ror 0
+#define idle_rti 0
+#define idle_rts 0
+#define idle_sta 0
+#define idle_stx 0
+#define idle_sty 0
+#define idle_stz 0
+#define idle_trb 0
+#define idle_tsb 0
+
+#define idle_implied	addr += 1
+#define idle_immediate	addr += 2
+#define idle_zp		if (readCallback[memory[(word)(addr + 1)]]) return 0;  addr += 2
+#define idle_abs	if (readCallback[memory[(word)(addr + 1)] | (memory[(word)(addr + 2)] << 8)]) return 0;  addr += 3
+#define idle_zpx	return 0
+#define idle_zpy	return 0
+#define idle_absx	return 0
+#define idle_absy	return 0
+#define idle_relative	return 0
+#define idle_indirect	return 0
+#define idle_indx	return 0
+#define idle_indy	return 0
+#define idle_indabsx	return 0
+#define idle_indzp	return 0
+
+/* answer whether the straight-line code between addr and the branch
+ * ending at end can neither write memory, call out of the emulator nor
+ * leave the loop other than by falling through the branch. */
+
+static int idleLoop(M6502 *mpu, word addr, word end)
+{
+  byte		 *memory= mpu->memory;
+  M6502_Callback *readCallback= mpu->callbacks->read;
+  int		  n;
+
+  for (n= 0;  addr != (word)(end - 2);  ++n)
+    {
+      if (n == 16) return 0;
+      switch (memory[addr])
+	{
+#	  define idle(num, name, mode, cycles)	case 0x##num: if (!idle_##name) return 0;  idle_##mode;  break
+	  do_insns(idle);
+#	  undef idle
+	}
+    }
+  return 1;
+}
+
+
+/* execution trace.  the file starts with traceMagic, followed by one
+ * record per insn: a tag byte, the opcode, then whatever the tag says
+ * differs from the previous record (initially all zero):
+ *
+ *   tag & 0x1f	one byte for each of A, X, Y, P, S (in that order) that changed
+ *   tag & 0x60	PC minus the previous PC (1-3) or 0 for an explicit LSB, MSB
+ *   tag & 0x80	a count byte and (LSB, MSB, data) for each memory write
+ */
+
+static const char traceMagic[8]= { '6', '5', '0', '2', 'T', 'R', 'C', 1 };
+
+enum {
+  traceA= 0x01,  traceX= 0x02,  traceY= 0x04,  traceP= 0x08,  traceS= 0x10,
+  tracePC= 0x60,  traceWrites= 0x80
+};
+
+struct _M6502_Trace
+{
+  FILE		    *stream;
+  M6502_TraceRecord  last;	/* previous record written */
+  M6502_TraceRecord  next;	/* insn in progress */
+  int		     pending;	/* next is valid */
+};
+
+static void traceFlush(M6502_Trace *t)
+{
+  M6502_TraceRecord *r= &t->next, *l= &t->last;
+  byte  buf[6 + 5 + 1 + 3 * 8], *b= buf + 2;
+  word  delta= r->pc - l->pc;
+  int   i;
+
+  buf[0]= 0;
+  buf[1]= r->op;
+  if ((delta >= 1) && (delta <= 3))	buf[0] |= delta << 5;
+  else				      { *b++= r->pc & 0xff;  *b++= r->pc >> 8; }
+  if (r->a != l->a)		      { buf[0] |= traceA;  *b++= r->a; }
+  if (r->x != l->x)		      { buf[0] |= traceX;  *b++= r->x; }
+  if (r->y != l->y)		      { buf[0] |= traceY;  *b++= r->y; }
+  if (r->p != l->p)		      { buf[0] |= traceP;  *b++= r->p; }
+  if (r->s != l->s)		      { buf[0] |= traceS;  *b++= r->s; }
+  if (r->writes)
+    {
+      buf[0] |= traceWrites;
+      *b++= r->writes;
+      for (i= 0;  i < r->writes;  ++i)
+	{
+	  *b++= r->addr[i] & 0xff;
+	  *b++= r->addr[i] >> 8;
+	  *b++= r->data[i];
+	}
+    }
+  fwrite(buf, 1, b - buf, t->stream);
+  *l= *r;
+  t->pending= 0;
+}
+
+static void traceInsn(M6502_Trace *t, word pc, byte op, byte a, byte x, byte y, byte p, byte s)
+{
+  M6502_TraceRecord *r= &t->next;
+  if (t->pending) traceFlush(t);
+  r->pc= pc;  r->op= op;
+  r->a= a;  r->x= x;  r->y= y;  r->p= p;  r->s= s;
+  r->writes= 0;
+  t->pending= 1;
+}
+
+static int traceWrite(M6502_Trace *t, word addr, byte data)
+{
+  M6502_TraceRecord *r= &t->next;
+  if (r->writes < 8)
+    {
+      r->addr[r->writes]= addr;
+      r->data[r->writes]= data;
+      ++r->writes;
+    }
+  return 0;
+}
+
+
 /* the compiler should elminate all call to this function */
 
 static void oops(void)
@@ -746,7 +1002,7 @@ static void oops(void)
 }
 
 
-void M6502_run(M6502 *mpu)
+static void run(M6502 *mpu)
 {
 #if defined(__GNUC__) && !defined(__STRICT_ANSI__)
 
@@ -767,6 +1023,8 @@ void M6502_run(M6502 *mpu)
 			    &&_e0, &&_e1, &&_e2, &&_e3, &&_e4, &&_e5, &&_e6, &&_e7, &&_e8, &&_e9, &&_ea, &&_eb, &&_ec, &&_ed, &&_ee, &&_ef,
 			    &&_f0, &&_f1, &&_f2, &&_f3, &&_f4, &&_f5, &&_f6, &&_f7, &&_f8, &&_f9, &&_fa, &&_fb, &&_fc, &&_fd, &&_fe, &&_ff };
 
+  static void *htab[256];
+
   register void **itabp= &itab[0];
   register void  *tpc;
 
@@ -775,32 +1033,75 @@ void M6502_run(M6502 *mpu)
 # define next()					goto *tpc
 # define dispatch(num, name, mode, cycles)	_##num: name(cycles, mode) oops();  next()
 # define end()
+# define hooks()				hook: instrument(PC - 1);  goto *itab[memory[(word)(PC - 1)]]
 
 #else /* (!__GNUC__) || (__STRICT_ANSI__) */
 
-# define begin()				for (;;) switch (memory[PC++]) {
+# define begin()				for (;;) { instrument(PC);  switch (memory[PC++]) {
 # define fetch()
 # define next()					break
 # define dispatch(num, name, mode, cycles)	case 0x##num: name(cycles, mode);  next()
-# define end()					}
+# define end()					} }
+# define hooks()
 
 #endif
 
+  /* profile and/or trace the insn at ADDR before it is executed */
+
+# define instrument(ADDR)							\
+  if (mpu->profile) record(ADDR);						\
+  if (trace) traceInsn(trace, (ADDR), memory[(word)(ADDR)], A, X, Y, P, S)
+
+  /* charge the cycles since the last insn started to that insn, and count
+   * the one at ADDR */
+
+# define record(ADDR)							\
+  {									\
+    M6502_Profile *prof= mpu->profile;					\
+    word	   addr= (ADDR);					\
+    byte	   op=   memory[addr];					\
+    if (prof->pc >= 0)							\
+      {									\
+	prof->cycles  [prof->pc] += ticks - prof->ticks;		\
+	prof->opCycles[prof->op] += ticks - prof->ticks;		\
+      }									\
+    prof->count  [addr]++;						\
+    prof->opCount[op  ]++;						\
+    prof->pc=    addr;							\
+    prof->op=    op;							\
+    prof->ticks= ticks;							\
+  }
+
   register byte  *memory= mpu->memory;
   register word   PC;
   word		  ea;
   byte		  A, X, Y, P, S;
   M6502_Callback *readCallback=  mpu->callbacks->read;
   M6502_Callback *writeCallback= mpu->callbacks->write;
+  M6502_Trace	 *trace= mpu->trace;
+  byte		 *dirty= mpu->dirty;
+  uint64_t	  ticks;
+  struct { int pc;  byte a, x, y, p, s, ok; } idle= { -1, 0, 0, 0, 0, 0, 0 };
 
-# define internalise()	A= mpu->registers->a;  X= mpu->registers->x;  Y= mpu->registers->y;  P= mpu->registers->p;  S= mpu->registers->s;  PC= mpu->registers->pc
-# define externalise()	mpu->registers->a= A;  mpu->registers->x= X;  mpu->registers->y= Y;  mpu->registers->p= P;  mpu->registers->s= S;  mpu->registers->pc= PC
+# define internalise()	A= mpu->registers->a;  X= mpu->registers->x;  Y= mpu->registers->y;  P= mpu->registers->p;  S= mpu->registers->s;  PC= mpu->registers->pc;  ticks= mpu->ticks
+# define externalise()	mpu->registers->a= A;  mpu->registers->x= X;  mpu->registers->y= Y;  mpu->registers->p= P;  mpu->registers->s= S;  mpu->registers->pc= PC;  mpu->ticks= ticks
 
   internalise();
 
+#if defined(__GNUC__) && !defined(__STRICT_ANSI__)
+  /* when profiling or tracing every opcode dispatches through the hooks first */
+  if (mpu->profile || trace)
+    {
+      int i;
+      for (i= 0;  i < 256;  ++i) htab[i]= &&hook;
+      itabp= &htab[0];
+    }
+#endif
+
   begin();
   do_insns(dispatch);
   end();
+  hooks();
 
 # undef begin
 # undef internalise
@@ -809,11 +1110,24 @@ void M6502_run(M6502 *mpu)
 # undef next
 # undef dispatch
 # undef end
+# undef hooks
+# undef instrument
+# undef record
 
   (void)oops;
 }
 
 
+/* a limit set by M6502_stop applies to this run only */
+
+void M6502_run(M6502 *mpu)
+{
+  uint64_t limit= mpu->limit;
+  run(mpu);
+  mpu->limit= limit;
+}
+
+
 int M6502_disassemble(M6502 *mpu, word ip, char buffer[64])
 {
   char *s= buffer;
@@ -845,6 +1159,158 @@ int M6502_disassemble(M6502 *mpu, word ip, char buffer[64])
 }
 
 
+/* the same information as do_insns, as static data for the bulk decoder */
+
+static const struct { char name[5];  byte mode; } insnTable[256]= {
+  { "brk",  M6502_Implied },      { "ora",  M6502_IndX },         { "ill",  M6502_Implied },      { "ill",  M6502_Implied },	/* 00 */
+  { "tsb",  M6502_ZP },           { "ora",  M6502_ZP },           { "asl",  M6502_ZP },           { "ill",  M6502_Implied },	/* 04 */
+  { "php",  M6502_Implied },      { "ora",  M6502_Immediate },    { "asla", M6502_Implied },      { "ill",  M6502_Implied },	/* 08 */
+  { "tsb",  M6502_Abs },          { "ora",  M6502_Abs },          { "asl",  M6502_Abs },          { "ill",  M6502_Implied },	/* 0C */
+  { "bpl",  M6502_Relative },     { "ora",  M6502_IndY },         { "ora",  M6502_IndZP },        { "ill",  M6502_Implied },	/* 10 */
+  { "trb",  M6502_ZP },           { "ora",  M6502_ZPX },          { "asl",  M6502_ZPX },          { "ill",  M6502_Implied },	/* 14 */
+  { "clc",  M6502_Implied },      { "ora",  M6502_AbsY },         { "ina",  M6502_Implied },      { "ill",  M6502_Implied },	/* 18 */
+  { "trb",  M6502_Abs },          { "ora",  M6502_AbsX },         { "asl",  M6502_AbsX },         { "ill",  M6502_Implied },	/* 1C */
+  { "jsr",  M6502_Abs },          { "and",  M6502_IndX },         { "ill",  M6502_Implied },      { "ill",  M6502_Implied },	/* 20 */
+  { "bit",  M6502_ZP },           { "and",  M6502_ZP },           { "rol",  M6502_ZP },           { "ill",  M6502_Implied },	/* 24 */
+  { "plp",  M6502_Implied },      { "and",  M6502_Immediate },    { "rola", M6502_Implied },      { "ill",  M6502_Implied },	/* 28 */
+  { "bit",  M6502_Abs },          { "and",  M6502_Abs },          { "rol",  M6502_Abs },          { "ill",  M6502_Implied },	/* 2C */
+  { "bmi",  M6502_Relative },     { "and",  M6502_IndY },         { "and",  M6502_IndZP },        { "ill",  M6502_Implied },	/* 30 */
+  { "bit",  M6502_ZPX },          { "and",  M6502_ZPX },          { "rol",  M6502_ZPX },          { "ill",  M6502_Implied },	/* 34 */
+  { "sec",  M6502_Implied },      { "and",  M6502_AbsY },         { "dea",  M6502_Implied },      { "ill",  M6502_Implied },	/* 38 */
+  { "bit",  M6502_AbsX },         { "and",  M6502_AbsX },         { "rol",  M6502_AbsX },         { "ill",  M6502_Implied },	/* 3C */
+  { "rti",  M6502_Implied },      { "eor",  M6502_IndX },         { "ill",  M6502_Implied },      { "ill",  M6502_Implied },	/* 40 */
+  { "ill",  M6502_Implied },      { "eor",  M6502_ZP },           { "lsr",  M6502_ZP },           { "ill",  M6502_Implied },	/* 44 */
+  { "pha",  M6502_Implied },      { "eor",  M6502_Immediate },    { "lsra", M6502_Implied },      { "ill",  M6502_Implied },	/* 48 */
+  { "jmp",  M6502_Abs },          { "eor",  M6502_Abs },          { "lsr",  M6502_Abs },          { "ill",  M6502_Implied },	/* 4C */
+  { "bvc",  M6502_Relative },     { "eor",  M6502_IndY },         { "eor",  M6502_IndZP },        { "ill",  M6502_Implied },	/* 50 */
+  { "ill",  M6502_Implied },      { "eor",  M6502_ZPX },          { "lsr",  M6502_ZPX },          { "ill",  M6502_Implied },	/* 54 */
+  { "cli",  M6502_Implied },      { "eor",  M6502_AbsY },         { "phy",  M6502_Implied },      { "ill",  M6502_Implied },	/* 58 */
+  { "ill",  M6502_Implied },      { "eor",  M6502_AbsX },         { "lsr",  M6502_AbsX },         { "ill",  M6502_Implied },	/* 5C */
+  { "rts",  M6502_Implied },      { "adc",  M6502_IndX },         { "ill",  M6502_Implied },      { "ill",  M6502_Implied },	/* 60 */
+  { "stz",  M6502_ZP },           { "adc",  M6502_ZP },           { "ror",  M6502_ZP },           { "ill",  M6502_Implied },	/* 64 */
+  { "pla",  M6502_Implied },      { "adc",  M6502_Immediate },    { "rora", M6502_Implied },      { "ill",  M6502_Implied },	/* 68 */
+  { "jmp",  M6502_Indirect },     { "adc",  M6502_Abs },          { "ror",  M6502_Abs },          { "ill",  M6502_Implied },	/* 6C */
+  { "bvs",  M6502_Relative },     { "adc",  M6502_IndY },         { "adc",  M6502_IndZP },        { "ill",  M6502_Implied },	/* 70 */
+  { "stz",  M6502_ZPX },          { "adc",  M6502_ZPX },          { "ror",  M6502_ZPX },          { "ill",  M6502_Implied },	/* 74 */
+  { "sei",  M6502_Implied },      { "adc",  M6502_AbsY },         { "ply",  M6502_Implied },      { "ill",  M6502_Implied },	/* 78 */
+  { "jmp",  M6502_IndAbsX },      { "adc",  M6502_AbsX },         { "ror",  M6502_AbsX },         { "ill",  M6502_Implied },	/* 7C */
+  { "bra",  M6502_Relative },     { "sta",  M6502_IndX },         { "ill",  M6502_Implied },      { "ill",  M6502_Implied },	/* 80 */
+  { "sty",  M6502_ZP },           { "sta",  M6502_ZP },           { "stx",  M6502_ZP },           { "ill",  M6502_Implied },	/* 84 */
+  { "dey",  M6502_Implied },      { "bit",  M6502_Immediate },    { "txa",  M6502_Implied },      { "ill",  M6502_Implied },	/* 88 */
+  { "sty",  M6502_Abs },          { "sta",  M6502_Abs },          { "stx",  M6502_Abs },          { "ill",  M6502_Implied },	/* 8C */
+  { "bcc",  M6502_Relative },     { "sta",  M6502_IndY },         { "sta",  M6502_IndZP },        { "ill",  M6502_Implied },	/* 90 */
+  { "sty",  M6502_ZPX },          { "sta",  M6502_ZPX },          { "stx",  M6502_ZPY },          { "ill",  M6502_Implied },	/* 94 */
+  { "tya",  M6502_Implied },      { "sta",  M6502_AbsY },         { "txs",  M6502_Implied },      { "ill",  M6502_Implied },	/* 98 */
+  { "stz",  M6502_Abs },          { "sta",  M6502_AbsX },         { "stz",  M6502_AbsX },         { "ill",  M6502_Implied },	/* 9C */
+  { "ldy",  M6502_Immediate },    { "lda",  M6502_IndX },         { "ldx",  M6502_Immediate },    { "ill",  M6502_Implied },	/* A0 */
+  { "ldy",  M6502_ZP },           { "lda",  M6502_ZP },           { "ldx",  M6502_ZP },           { "ill",  M6502_Implied },	/* A4 */
+  { "tay",  M6502_Implied },      { "lda",  M6502_Immediate },    { "tax",  M6502_Implied },      { "ill",  M6502_Implied },	/* A8 */
+  { "ldy",  M6502_Abs },          { "lda",  M6502_Abs },          { "ldx",  M6502_Abs },          { "ill",  M6502_Implied },	/* AC */
+  { "bcs",  M6502_Relative },     { "lda",  M6502_IndY },         { "lda",  M6502_IndZP },        { "ill",  M6502_Implied },	/* B0 */
+  { "ldy",  M6502_ZPX },          { "lda",  M6502_ZPX },          { "ldx",  M6502_ZPY },          { "ill",  M6502_Implied },	/* B4 */
+  { "clv",  M6502_Implied },      { "lda",  M6502_AbsY },         { "tsx",  M6502_Implied },      { "ill",  M6502_Implied },	/* B8 */
+  { "ldy",  M6502_AbsX },         { "lda",  M6502_AbsX },         { "ldx",  M6502_AbsY },         { "ill",  M6502_Implied },	/* BC */
+  { "cpy",  M6502_Immediate },    { "cmp",  M6502_IndX },         { "ill",  M6502_Implied },      { "ill",  M6502_Implied },	/* C0 */
+  { "cpy",  M6502_ZP },           { "cmp",  M6502_ZP },           { "dec",  M6502_ZP },           { "ill",  M6502_Implied },	/* C4 */
+  { "iny",  M6502_Implied },      { "cmp",  M6502_Immediate },    { "dex",  M6502_Implied },      { "ill",  M6502_Implied },	/* C8 */
+  { "cpy",  M6502_Abs },          { "cmp",  M6502_Abs },          { "dec",  M6502_Abs },          { "ill",  M6502_Implied },	/* CC */
+  { "bne",  M6502_Relative },     { "cmp",  M6502_IndY },         { "cmp",  M6502_IndZP },        { "ill",  M6502_Implied },	/* D0 */
+  { "ill",  M6502_Implied },      { "cmp",  M6502_ZPX },          { "dec",  M6502_ZPX },          { "ill",  M6502_Implied },	/* D4 */
+  { "cld",  M6502_Implied },      { "cmp",  M6502_AbsY },         { "phx",  M6502_Implied },      { "ill",  M6502_Implied },	/* D8 */
+  { "ill",  M6502_Implied },      { "cmp",  M6502_AbsX },         { "dec",  M6502_AbsX },         { "ill",  M6502_Implied },	/* DC */
+  { "cpx",  M6502_Immediate },    { "sbc",  M6502_IndX },         { "ill",  M6502_Implied },      { "ill",  M6502_Implied },	/* E0 */
+  { "cpx",  M6502_ZP },           { "sbc",  M6502_ZP },           { "inc",  M6502_ZP },           { "ill",  M6502_Implied },	/* E4 */
+  { "inx",  M6502_Implied },      { "sbc",  M6502_Immediate },    { "nop",  M6502_Implied },      { "ill",  M6502_Implied },	/* E8 */
+  { "cpx",  M6502_Abs },          { "sbc",  M6502_Abs },          { "inc",  M6502_Abs },          { "ill",  M6502_Implied },	/* EC */
+  { "beq",  M6502_Relative },     { "sbc",  M6502_IndY },         { "sbc",  M6502_IndZP },        { "ill",  M6502_Implied },	/* F0 */
+  { "ill",  M6502_Implied },      { "sbc",  M6502_ZPX },          { "inc",  M6502_ZPX },          { "ill",  M6502_Implied },	/* F4 */
+  { "sed",  M6502_Implied },      { "sbc",  M6502_AbsY },         { "plx",  M6502_Implied },      { "ill",  M6502_Implied },	/* F8 */
+  { "ill",  M6502_Implied },      { "sbc",  M6502_AbsX },         { "inc",  M6502_AbsX },         { "ill",  M6502_Implied },	/* FC */
+};
+
+static const byte modeSize[]= { 1, 2, 2, 2, 2, 3, 3, 3, 2, 3, 2, 2, 2, 3 };
+
+
+const char *M6502_mnemonic(uint8_t op)
+{
+  return insnTable[op].name;
+}
+
+
+/* decode the insns in the size bytes starting at addr into insns (which must
+ * have room for size entries) without formatting them.  answer the number
+ * of insns decoded.  the last may extend beyond addr + size. */
+
+int M6502_decode(M6502 *mpu, word addr, unsigned size, M6502_Insn *insns)
+{
+  byte	     *memory= mpu->memory;
+  M6502_Insn *insn= insns;
+  unsigned    offset= 0;
+
+  while (offset < size)
+    {
+      word ip= addr + offset;
+      byte op= memory[ip];
+      byte mode= insnTable[op].mode;
+      insn->addr= ip;
+      insn->op=   op;
+      insn->mode= mode;
+      insn->size= modeSize[mode];
+      switch (insn->size)
+	{
+	case 1:  insn->operand= 0;  break;
+	case 2:  insn->operand= memory[(word)(ip + 1)];  break;
+	case 3:  insn->operand= memory[(word)(ip + 1)] | (memory[(word)(ip + 2)] << 8);  break;
+	}
+      if (M6502_Relative == mode)
+	insn->operand= ip + 2 + (int8_t)insn->operand;
+      offset += insn->size;
+      ++insn;
+    }
+  return insn - insns;
+}
+
+
+/* format insn exactly as M6502_disassemble would, answering the length */
+
+static const char hexDigits[]= "0123456789ABCDEF";
+
+#define hex2(B)	(*s++= hexDigits[((B) >> 4) & 15], *s++= hexDigits[(B) & 15])
+#define hex4(W)	(hex2((W) >> 8), hex2(W))
+
+int M6502_format(M6502_Insn *insn, char buffer[64])
+{
+  char	     *s= buffer;
+  const char *n= insnTable[insn->op].name;
+  word	      w= insn->operand;
+
+  while (*n) *s++= *n++;
+  *s++= ' ';
+  switch (insn->mode)
+    {
+    case M6502_Implied:								break;
+    case M6502_Immediate:	*s++= '#';  hex2(w);				break;
+    case M6502_ZP:		hex2(w);					break;
+    case M6502_ZPX:		hex2(w);  *s++= ',';  *s++= 'X';		break;
+    case M6502_ZPY:		hex2(w);  *s++= ',';  *s++= 'Y';		break;
+    case M6502_Abs:		hex4(w);					break;
+    case M6502_AbsX:		hex4(w);  *s++= ',';  *s++= 'X';		break;
+    case M6502_AbsY:		hex4(w);  *s++= ',';  *s++= 'Y';		break;
+    case M6502_Relative:	hex4(w);					break;
+    case M6502_Indirect:	*s++= '(';  hex4(w);  *s++= ')';		break;
+    case M6502_IndZP:		*s++= '(';  hex2(w);  *s++= ')';		break;
+    case M6502_IndX:		*s++= '(';  hex2(w);  *s++= ',';  *s++= 'X';  *s++= ')';	break;
+    case M6502_IndY:		*s++= '(';  hex2(w);  *s++= ')';  *s++= ',';  *s++= 'Y';	break;
+    case M6502_IndAbsX:		*s++= '(';  hex4(w);  *s++= ',';  *s++= 'X';  *s++= ')';	break;
+    }
+  *s= '\0';
+  return s - buffer;
+}
+
+#undef hex2
+#undef hex4
+
+
 void M6502_dump(M6502 *mpu, char buffer[64])
 {
   M6502_Registers *r= mpu->registers;
@@ -866,6 +1332,174 @@ static void outOfMemory(void)
 }
 
 
+void M6502_profile(M6502 *mpu, int enable)
+{
+  if (enable && !mpu->profile)
+    {
+      if (!(mpu->profile= (M6502_Profile *)calloc(1, sizeof(M6502_Profile)))) outOfMemory();
+      mpu->profile->pc= -1;
+    }
+  else if (!enable && mpu->profile)
+    {
+      free(mpu->profile);
+      mpu->profile= 0;
+    }
+}
+
+
+typedef struct { uint64_t cycles, count;  int key; } hotspot;
+
+static int hotter(const void *a, const void *b)
+{
+  const hotspot *p= (const hotspot *)a, *q= (const hotspot *)b;
+  if (p->cycles != q->cycles) return (p->cycles < q->cycles) ? 1 : -1;
+  if (p->count  != q->count ) return (p->count  < q->count ) ? 1 : -1;
+  return p->key - q->key;
+}
+
+static const char *opName(byte op)
+{
+  switch (op)
+    {
+#     define opname(num, name, mode, cycles)	case 0x##num: return #name " " #mode
+      do_insns(opname);
+#     undef opname
+    }
+  return "?";
+}
+
+/* print the count hottest addresses and opcodes, by cycles spent */
+
+void M6502_report(M6502 *mpu, FILE *stream, int count)
+{
+  M6502_Profile *prof= mpu->profile;
+  hotspot	*spots;
+  uint64_t	 total= 0;
+  int		 i, n;
+  char		 insn[64];
+
+  if (!prof) return;
+  if (!(spots= (hotspot *)malloc(sizeof(hotspot) * 0x10000))) outOfMemory();
+
+  /* charge the insn still in progress up to now */
+  if (prof->pc >= 0)
+    {
+      prof->cycles  [prof->pc] += mpu->ticks - prof->ticks;
+      prof->opCycles[prof->op] += mpu->ticks - prof->ticks;
+      prof->ticks= mpu->ticks;
+    }
+
+  for (i= 0;  i < 0x100;  ++i)
+    total += prof->opCycles[i];
+  if (!total) total= 1;
+
+  for (n= 0, i= 0;  i < 0x10000;  ++i)
+    if (prof->count[i])
+      {
+	spots[n].cycles= prof->cycles[i];
+	spots[n].count=  prof->count[i];
+	spots[n].key=    i;
+	++n;
+      }
+  qsort(spots, n, sizeof(hotspot), hotter);
+  fprintf(stream, "%14s %6s %14s  addr  insn\n", "cycles", "%", "count");
+  for (i= 0;  (i < n) && (i < count);  ++i)
+    {
+      M6502_disassemble(mpu, spots[i].key, insn);
+      fprintf(stream, "%14llu %6.2f %14llu  %04X  %s\n",
+	      (unsigned long long)spots[i].cycles, 100.0 * spots[i].cycles / total,
+	      (unsigned long long)spots[i].count, spots[i].key, insn);
+    }
+
+  for (n= 0, i= 0;  i < 0x100;  ++i)
+    if (prof->opCount[i])
+      {
+	spots[n].cycles= prof->opCycles[i];
+	spots[n].count=  prof->opCount[i];
+	spots[n].key=    i;
+	++n;
+      }
+  qsort(spots, n, sizeof(hotspot), hotter);
+  fprintf(stream, "\n%14s %6s %14s  op    insn\n", "cycles", "%", "count");
+  for (i= 0;  (i < n) && (i < count);  ++i)
+    fprintf(stream, "%14llu %6.2f %14llu  %02X    %s\n",
+	    (unsigned long long)spots[i].cycles, 100.0 * spots[i].cycles / total,
+	    (unsigned long long)spots[i].count, spots[i].key, opName((byte)spots[i].key));
+
+  free(spots);
+}
+
+
+/* start writing an execution trace to stream, or stop if stream is 0.  the
+ * stream is not closed. */
+
+void M6502_trace(M6502 *mpu, FILE *stream)
+{
+  if (mpu->trace)
+    {
+      if (mpu->trace->pending) traceFlush(mpu->trace);
+      fflush(mpu->trace->stream);
+      free(mpu->trace);
+      mpu->trace= 0;
+    }
+  if (stream)
+    {
+      if (!(mpu->trace= (M6502_Trace *)calloc(1, sizeof(M6502_Trace)))) outOfMemory();
+      mpu->trace->stream= stream;
+      fwrite(traceMagic, 1, sizeof(traceMagic), stream);
+    }
+}
+
+
+/* check the header of a trace and clear record ready for the first call to
+ * M6502_traceRead.  answer 0 if stream does not contain a trace. */
+
+int M6502_traceBegin(FILE *stream, M6502_TraceRecord *record)
+{
+  char magic[sizeof(traceMagic)];
+  memset(record, 0, sizeof(*record));
+  return (sizeof(magic) == fread(magic, 1, sizeof(magic), stream))
+    &&   !memcmp(magic, traceMagic, sizeof(magic));
+}
+
+
+/* update record to the next insn in the trace.  answer 1 on success, 0 at
+ * the end of the trace and -1 if it is truncated or corrupt. */
+
+int M6502_traceRead(FILE *stream, M6502_TraceRecord *record)
+{
+  int tag, op, i, c;
+
+# define get(V)	if ((c= getc(stream)) == EOF) return -1;  V= c
+
+  if ((tag= getc(stream)) == EOF) return 0;
+  get(op);
+  record->op= op;
+  if (tag & tracePC)	record->pc += (tag & tracePC) >> 5;
+  else		      { get(record->pc);  get(i);  record->pc |= i << 8; }
+  if (tag & traceA)	{ get(record->a); }
+  if (tag & traceX)	{ get(record->x); }
+  if (tag & traceY)	{ get(record->y); }
+  if (tag & traceP)	{ get(record->p); }
+  if (tag & traceS)	{ get(record->s); }
+  record->writes= 0;
+  if (tag & traceWrites)
+    {
+      get(record->writes);
+      if (record->writes > 8) return -1;
+      for (i= 0;  i < record->writes;  ++i)
+	{
+	  get(record->addr[i]);
+	  get(c);  record->addr[i] |= c << 8;
+	  get(record->data[i]);
+	}
+    }
+  return 1;
+
+# undef get
+}
+
+
 M6502 *M6502_new(M6502_Registers *registers, M6502_Memory memory, M6502_Callbacks *callbacks)
 {
   M6502 *mpu= calloc(1, sizeof(M6502));
@@ -880,13 +1514,26 @@ M6502 *M6502_new(M6502_Registers *registers, M6502_Memory memory, M6502_Callback
   mpu->registers = registers;
   mpu->memory    = memory;
   mpu->callbacks = callbacks;
+  mpu->limit     = M6502_unlimited;
 
   return mpu;
 }
 
 
+uint64_t M6502_runFor(M6502 *mpu, uint64_t cycles)
+{
+  uint64_t start= mpu->ticks;
+  mpu->limit= start + cycles;
+  M6502_run(mpu);
+  mpu->limit= M6502_unlimited;
+  return mpu->ticks - start;
+}
+
+
 void M6502_delete(M6502 *mpu)
 {
+  M6502_profile(mpu, 0);
+  M6502_trace(mpu, 0);
   if (mpu->flags & M6502_CallbacksAllocated) free(mpu->callbacks);
   if (mpu->flags & M6502_MemoryAllocated   ) free(mpu->memory);
   if (mpu->flags & M6502_RegistersAllocated) free(mpu->registers);
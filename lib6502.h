@@ -8,6 +8,10 @@
 typedef struct _M6502		M6502;
 typedef struct _M6502_Registers	M6502_Registers;
 typedef struct _M6502_Callbacks	M6502_Callbacks;
+typedef struct _M6502_Profile	M6502_Profile;
+typedef struct _M6502_Trace	M6502_Trace;
+typedef struct _M6502_TraceRecord M6502_TraceRecord;
+typedef struct _M6502_Insn	M6502_Insn;
 
 typedef int   (*M6502_Callback)(M6502 *mpu, uint16_t address, uint8_t data);
 
@@ -37,18 +41,68 @@ struct _M6502_Callbacks
   M6502_CallbackTable call;
 };
 
+struct _M6502_Profile
+{
+  uint64_t count[0x10000];	/* insns executed at each address */
+  uint64_t cycles[0x10000];	/* clock cycles spent at each address */
+  uint64_t opCount[0x100];	/* insns executed with each opcode */
+  uint64_t opCycles[0x100];	/* clock cycles spent in each opcode */
+  int32_t  pc;			/* address of the insn being timed, or -1 */
+  uint8_t  op;			/* its opcode */
+  uint64_t ticks;		/* and the cycle count when it started */
+};
+
+/* one insn of an execution trace: the registers as it starts and the
+ * memory it writes (stack included) */
+
+struct _M6502_TraceRecord
+{
+  uint16_t pc;
+  uint8_t  op;
+  uint8_t  a, x, y, p, s;
+  uint8_t  writes;		/* number of entries in addr[] and data[] */
+  uint16_t addr[8];
+  uint8_t  data[8];
+};
+
+/* addressing modes */
+
+enum {
+  M6502_Implied,  M6502_Immediate,  M6502_ZP,  M6502_ZPX,  M6502_ZPY,
+  M6502_Abs,  M6502_AbsX,  M6502_AbsY,  M6502_Relative,  M6502_Indirect,
+  M6502_IndZP,  M6502_IndX,  M6502_IndY,  M6502_IndAbsX
+};
+
+/* one decoded insn */
+
+struct _M6502_Insn
+{
+  uint16_t addr;
+  uint8_t  op;
+  uint8_t  mode;	/* M6502_Implied ... M6502_IndAbsX */
+  uint8_t  size;	/* in bytes, 1 to 3 */
+  uint16_t operand;	/* immediate or zero page byte, absolute address, or branch target */
+};
+
 struct _M6502
 {
   M6502_Registers *registers;
   uint8_t	  *memory;
   M6502_Callbacks *callbacks;
   unsigned int	   flags;
+  uint64_t	   ticks;	/* clock cycles executed so far */
+  uint64_t	   limit;	/* M6502_run returns once ticks reaches this */
+  M6502_Profile	  *profile;	/* execution counts, if profiling */
+  M6502_Trace	  *trace;	/* execution trace, if tracing */
+  void		  *context;	/* for use by the client's callbacks */
+  uint8_t	  *dirty;	/* if set, every write sets dirty[addr >> 8] */
 };
 
 enum {
   M6502_RegistersAllocated = 1 << 0,
   M6502_MemoryAllocated    = 1 << 1,
-  M6502_CallbacksAllocated = 1 << 2
+  M6502_CallbacksAllocated = 1 << 2,
+  M6502_Quiet              = 1 << 3	/* undefined insns stop without a message */
 };
 
 extern M6502 *M6502_new(M6502_Registers *registers, M6502_Memory memory, M6502_Callbacks *callbacks);
@@ -56,8 +110,17 @@ extern void   M6502_reset(M6502 *mpu);
 extern void   M6502_nmi(M6502 *mpu);
 extern void   M6502_irq(M6502 *mpu);
 extern void   M6502_run(M6502 *mpu);
+extern uint64_t M6502_runFor(M6502 *mpu, uint64_t cycles);
 extern int    M6502_disassemble(M6502 *mpu, uint16_t addr, char buffer[64]);
+extern int    M6502_decode(M6502 *mpu, uint16_t addr, unsigned size, M6502_Insn *insns);
+extern int    M6502_format(M6502_Insn *insn, char buffer[64]);
+extern const char *M6502_mnemonic(uint8_t op);
 extern void   M6502_dump(M6502 *mpu, char buffer[64]);
+extern void   M6502_profile(M6502 *mpu, int enable);
+extern void   M6502_report(M6502 *mpu, FILE *stream, int count);
+extern void   M6502_trace(M6502 *mpu, FILE *stream);
+extern int    M6502_traceBegin(FILE *stream, M6502_TraceRecord *record);
+extern int    M6502_traceRead(FILE *stream, M6502_TraceRecord *record);
 extern void   M6502_delete(M6502 *mpu);
 
 #define M6502_getVector(MPU, VEC)			\
@@ -68,6 +131,9 @@ extern void   M6502_delete(M6502 *mpu);
   ( ( ((MPU)->memory[M6502_##VEC##VectorLSB]= ((uint8_t)(ADDR)) & 0xff) )	\
     , ((MPU)->memory[M6502_##VEC##VectorMSB]= (uint8_t)((ADDR) >> 8)) )
 
+#define M6502_stop(MPU)				((MPU)->limit= 0)
+#define M6502_unlimited				(~(uint64_t)0)
+
 #define M6502_getCallback(MPU, TYPE, ADDR)	((MPU)->callbacks->TYPE[ADDR])
 #define M6502_setCallback(MPU, TYPE, ADDR, FN)	((MPU)->callbacks->TYPE[ADDR]= (FN))
 
@@ -0,0 +1,395 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "lockstep_emulator.hpp"
+
+using namespace std;
+
+extern struct OpcodeDef opcode_def[256];
+
+#define FLAG_N 0x80
+#define FLAG_V 0x40
+#define FLAG_D 0x08
+#define FLAG_I 0x04
+#define FLAG_Z 0x02
+#define FLAG_C 0x01
+
+enum e_lockstep_operation {
+	E_OP_NONE, // can't be run in lockstep
+	E_OP_NOP,
+	E_OP_LDA, E_OP_LDX, E_OP_LDY,
+	E_OP_STA, E_OP_STX, E_OP_STY,
+	E_OP_TAX, E_OP_TAY, E_OP_TXA, E_OP_TYA, E_OP_TSX, E_OP_TXS,
+	E_OP_INX, E_OP_INY, E_OP_DEX, E_OP_DEY, E_OP_INC, E_OP_DEC,
+	E_OP_AND, E_OP_ORA, E_OP_EOR, E_OP_ADC, E_OP_SBC,
+	E_OP_CMP, E_OP_CPX, E_OP_CPY, E_OP_BIT,
+	E_OP_ASL, E_OP_LSR, E_OP_ROL, E_OP_ROR,
+	E_OP_CLC, E_OP_SEC, E_OP_CLV, E_OP_CLD, E_OP_SED, E_OP_CLI, E_OP_SEI,
+	E_OP_MAX
+};
+
+static const char *operation_name[E_OP_MAX]={
+	"", "NOP",
+	"LDA", "LDX", "LDY",
+	"STA", "STX", "STY",
+	"TAX", "TAY", "TXA", "TYA", "TSX", "TXS",
+	"INX", "INY", "DEX", "DEY", "INC", "DEC",
+	"AND", "ORA", "EOR", "ADC", "SBC",
+	"CMP", "CPX", "CPY", "BIT",
+	"ASL", "LSR", "ROL", "ROR",
+	"CLC", "SEC", "CLV", "CLD", "SED", "CLI", "SEI",
+};
+
+s_lockstep_state::s_lockstep_state()
+{
+	count=0;
+	stride=0;
+	memset(reg,0,sizeof(reg));
+	broadcast=NULL;
+	allocation=NULL;
+	arrays=0;
+}
+
+s_lockstep_state::~s_lockstep_state()
+{
+	free(allocation);
+}
+
+void s_lockstep_state::init(size_t a_count, size_t a_const_slots, size_t a_mem_slots, size_t a_zp_slots)
+{
+	free(allocation);
+	count=a_count;
+	stride=(a_count+LOCKSTEP_ALIGN-1) & ~(size_t)(LOCKSTEP_ALIGN-1);
+
+	// one block for all the arrays, the last one is the operand broadcast buffer
+	arrays=E_REG_MAX+a_const_slots+a_mem_slots+a_zp_slots+1;
+	allocation=calloc(1,arrays*stride+LOCKSTEP_ALIGN);
+	if (!allocation)
+		abort();
+	byte *next=(byte *)(((size_t)allocation+LOCKSTEP_ALIGN-1) & ~(size_t)(LOCKSTEP_ALIGN-1));
+
+	for (size_t i=0;i<E_REG_MAX;++i,next+=stride)
+		reg[i]=next;
+	const_slots.resize(a_const_slots);
+	for (size_t i=0;i<a_const_slots;++i,next+=stride)
+		const_slots[i]=next;
+	mem_slots.resize(a_mem_slots);
+	for (size_t i=0;i<a_mem_slots;++i,next+=stride)
+		mem_slots[i]=next;
+	zp_slots.resize(a_zp_slots);
+	for (size_t i=0;i<a_zp_slots;++i,next+=stride)
+		zp_slots[i]=next;
+	broadcast=next;
+}
+
+void s_lockstep_state::set_registers(size_t instance, const M6502_Registers &registers)
+{
+	assert(instance<count);
+	reg[E_REG_A][instance]=registers.a;
+	reg[E_REG_X][instance]=registers.x;
+	reg[E_REG_Y][instance]=registers.y;
+	reg[E_REG_S][instance]=registers.s;
+	reg[E_REG_P][instance]=registers.p;
+}
+
+void s_lockstep_state::get_registers(size_t instance, M6502_Registers &registers) const
+{
+	assert(instance<count);
+	registers.a=reg[E_REG_A][instance];
+	registers.x=reg[E_REG_X][instance];
+	registers.y=reg[E_REG_Y][instance];
+	registers.s=reg[E_REG_S][instance];
+	registers.p=reg[E_REG_P][instance];
+}
+
+void s_lockstep_state::copy_from(const s_lockstep_state &other)
+{
+	assert(other.stride==stride && other.arrays==arrays);
+	// everything but the broadcast buffer
+	memcpy(reg[0],other.reg[0],(arrays-1)*stride);
+}
+
+uint64_t s_lockstep_state::fingerprint(byte_flags registers) const
+{
+	// FNV-1a over the arrays but the broadcast buffer, padding excluded
+	uint64_t hash=14695981039346656037ULL;
+	for (size_t j=0;j<arrays-1;++j)
+	{
+		// D_A..D_P are in e_register order
+		if (j<E_REG_MAX && !(registers & (1<<j)))
+			continue;
+		const byte *array=reg[0]+j*stride;
+		for (size_t i=0;i<count;++i)
+		{
+			hash^=array[i];
+			hash*=1099511628211ULL;
+		}
+	}
+	return hash ? hash : 1;
+}
+
+lockstep_emulator::lockstep_emulator()
+{
+	memset(operation,E_OP_NONE,sizeof(operation));
+	memset(opcode_addressing,ERR,sizeof(opcode_addressing));
+	initialized=false;
+}
+
+void lockstep_emulator::init()
+{
+	for (size_t i=0;i<256;++i)
+	{
+		const OpcodeDef &def=opcode_def[i];
+		if (def.name[0]==0)
+			continue;
+		opcode_addressing[def.opcode]=def.addressing;
+		if (def.usable!=LEGAL)
+			continue;
+		switch (def.addressing)
+		{
+			case IMP:
+			case ACC:
+			case IMM:
+			case ABS:
+			case ZPG:
+				break;
+			default:
+				continue;
+		}
+		for (size_t op=E_OP_NOP;op<E_OP_MAX;++op)
+		{
+			if (strcmp(def.name,operation_name[op])==0)
+			{
+				operation[def.opcode]=(byte)op;
+				break;
+			}
+		}
+	}
+	initialized=true;
+}
+
+// the lane array of an instruction's operand, NULL if it has none
+static byte *get_operand(const s_canonized_param &param, s_lockstep_state &state)
+{
+	switch (param.type)
+	{
+		case E_PARAM_CONST_SLOT:
+			return param.value<state.const_slots.size() ? state.const_slots[param.value] : NULL;
+		case E_PARAM_MEM_SLOT:
+			return param.value<state.mem_slots.size() ? state.mem_slots[param.value] : NULL;
+		case E_PARAM_ZP_SLOT:
+			return param.value<state.zp_slots.size() ? state.zp_slots[param.value] : NULL;
+		default:
+			return NULL;
+	}
+}
+
+bool lockstep_emulator::can_run(const std::vector <s_instruction> &sequence) const
+{
+	assert(initialized);
+	for (size_t i=0;i<sequence.size();++i)
+	{
+		byte op=operation[sequence[i].opcode];
+		if (op==E_OP_NONE)
+			return false;
+		// the operand is a slot or nothing
+		byte addressing=opcode_addressing[sequence[i].opcode];
+		bool needs_operand=(addressing==IMM || addressing==ABS || addressing==ZPG);
+		bool has_operand=(sequence[i].canonized_param.type==E_PARAM_CONST_SLOT
+			|| sequence[i].canonized_param.type==E_PARAM_MEM_SLOT
+			|| sequence[i].canonized_param.type==E_PARAM_ZP_SLOT
+			|| sequence[i].canonized_param.type==E_PARAM_CONST_VALUE);
+		if (needs_operand!=has_operand)
+			return false;
+		// only constants can be immediate
+		if (addressing==IMM && sequence[i].canonized_param.type!=E_PARAM_CONST_SLOT && sequence[i].canonized_param.type!=E_PARAM_CONST_VALUE)
+			return false;
+		if (addressing!=IMM && (sequence[i].canonized_param.type==E_PARAM_CONST_SLOT || sequence[i].canonized_param.type==E_PARAM_CONST_VALUE))
+			return false;
+	}
+	return true;
+}
+
+// N and Z for a result
+#define NZ(v) (((v) & FLAG_N) | ((v)==0 ? FLAG_Z : 0))
+
+bool lockstep_emulator::run(const std::vector <s_instruction> &sequence, s_lockstep_state &state) const
+{
+	if (!can_run(sequence))
+		return false;
+
+	const size_t n=state.stride;
+	byte *a=state.reg[E_REG_A];
+	byte *x=state.reg[E_REG_X];
+	byte *y=state.reg[E_REG_Y];
+	byte *s=state.reg[E_REG_S];
+	byte *p=state.reg[E_REG_P];
+
+	// decimal arithmetic is left to lib6502
+	bool arithmetic=false, sets_decimal=false;
+	for (size_t i=0;i<sequence.size();++i)
+	{
+		byte op=operation[sequence[i].opcode];
+		arithmetic|=(op==E_OP_ADC || op==E_OP_SBC);
+		sets_decimal|=(op==E_OP_SED);
+	}
+	if (arithmetic)
+	{
+		if (sets_decimal)
+			return false;
+		byte decimal=0;
+		for (size_t i=0;i<state.count;++i)
+			decimal|=p[i];
+		if (decimal & FLAG_D)
+			return false;
+	}
+
+	for (size_t k=0;k<sequence.size();++k)
+	{
+		const s_instruction &insn=sequence[k];
+		byte *m=get_operand(insn.canonized_param,state);
+		if (insn.canonized_param.type==E_PARAM_CONST_VALUE)
+		{
+			memset(state.broadcast,insn.canonized_param.value,n);
+			m=state.broadcast;
+		}
+		// accumulator mode shifts work on A
+		if (!m)
+			m=a;
+
+		size_t i;
+		switch (operation[insn.opcode])
+		{
+			case E_OP_NOP:
+				break;
+			case E_OP_LDA:
+				for (i=0;i<n;++i) { a[i]=m[i]; p[i]=(p[i] & ~(FLAG_N|FLAG_Z)) | NZ(a[i]); }
+				break;
+			case E_OP_LDX:
+				for (i=0;i<n;++i) { x[i]=m[i]; p[i]=(p[i] & ~(FLAG_N|FLAG_Z)) | NZ(x[i]); }
+				break;
+			case E_OP_LDY:
+				for (i=0;i<n;++i) { y[i]=m[i]; p[i]=(p[i] & ~(FLAG_N|FLAG_Z)) | NZ(y[i]); }
+				break;
+			case E_OP_STA:
+				memcpy(m,a,n);
+				break;
+			case E_OP_STX:
+				memcpy(m,x,n);
+				break;
+			case E_OP_STY:
+				memcpy(m,y,n);
+				break;
+			case E_OP_TAX:
+				for (i=0;i<n;++i) { x[i]=a[i]; p[i]=(p[i] & ~(FLAG_N|FLAG_Z)) | NZ(x[i]); }
+				break;
+			case E_OP_TAY:
+				for (i=0;i<n;++i) { y[i]=a[i]; p[i]=(p[i] & ~(FLAG_N|FLAG_Z)) | NZ(y[i]); }
+				break;
+			case E_OP_TXA:
+				for (i=0;i<n;++i) { a[i]=x[i]; p[i]=(p[i] & ~(FLAG_N|FLAG_Z)) | NZ(a[i]); }
+				break;
+			case E_OP_TYA:
+				for (i=0;i<n;++i) { a[i]=y[i]; p[i]=(p[i] & ~(FLAG_N|FLAG_Z)) | NZ(a[i]); }
+				break;
+			case E_OP_TSX:
+				for (i=0;i<n;++i) { x[i]=s[i]; p[i]=(p[i] & ~(FLAG_N|FLAG_Z)) | NZ(x[i]); }
+				break;
+			case E_OP_TXS:
+				memcpy(s,x,n);
+				break;
+			case E_OP_INX:
+				for (i=0;i<n;++i) { ++x[i]; p[i]=(p[i] & ~(FLAG_N|FLAG_Z)) | NZ(x[i]); }
+				break;
+			case E_OP_INY:
+				for (i=0;i<n;++i) { ++y[i]; p[i]=(p[i] & ~(FLAG_N|FLAG_Z)) | NZ(y[i]); }
+				break;
+			case E_OP_DEX:
+				for (i=0;i<n;++i) { --x[i]; p[i]=(p[i] & ~(FLAG_N|FLAG_Z)) | NZ(x[i]); }
+				break;
+			case E_OP_DEY:
+				for (i=0;i<n;++i) { --y[i]; p[i]=(p[i] & ~(FLAG_N|FLAG_Z)) | NZ(y[i]); }
+				break;
+			case E_OP_INC:
+				for (i=0;i<n;++i) { ++m[i]; p[i]=(p[i] & ~(FLAG_N|FLAG_Z)) | NZ(m[i]); }
+				break;
+			case E_OP_DEC:
+				for (i=0;i<n;++i) { --m[i]; p[i]=(p[i] & ~(FLAG_N|FLAG_Z)) | NZ(m[i]); }
+				break;
+			case E_OP_AND:
+				for (i=0;i<n;++i) { a[i]&=m[i]; p[i]=(p[i] & ~(FLAG_N|FLAG_Z)) | NZ(a[i]); }
+				break;
+			case E_OP_ORA:
+				for (i=0;i<n;++i) { a[i]|=m[i]; p[i]=(p[i] & ~(FLAG_N|FLAG_Z)) | NZ(a[i]); }
+				break;
+			case E_OP_EOR:
+				for (i=0;i<n;++i) { a[i]^=m[i]; p[i]=(p[i] & ~(FLAG_N|FLAG_Z)) | NZ(a[i]); }
+				break;
+			case E_OP_ADC:
+			case E_OP_SBC:
+				{
+					// subtraction is addition of the complement
+					byte complement=(operation[insn.opcode]==E_OP_SBC) ? 0xff : 0;
+					for (i=0;i<n;++i)
+					{
+						byte v=m[i]^complement;
+						unsigned t=a[i]+v+(p[i] & FLAG_C);
+						byte r=(byte)t;
+						byte overflow=((a[i]^r) & (v^r) & 0x80)>>1;
+						a[i]=r;
+						p[i]=(p[i] & ~(FLAG_N|FLAG_V|FLAG_Z|FLAG_C)) | NZ(r) | overflow | (byte)(t>>8);
+					}
+				}
+				break;
+			case E_OP_CMP:
+				for (i=0;i<n;++i) { byte r=a[i]-m[i]; p[i]=(p[i] & ~(FLAG_N|FLAG_Z|FLAG_C)) | NZ(r) | (a[i]>=m[i] ? FLAG_C : 0); }
+				break;
+			case E_OP_CPX:
+				for (i=0;i<n;++i) { byte r=x[i]-m[i]; p[i]=(p[i] & ~(FLAG_N|FLAG_Z|FLAG_C)) | NZ(r) | (x[i]>=m[i] ? FLAG_C : 0); }
+				break;
+			case E_OP_CPY:
+				for (i=0;i<n;++i) { byte r=y[i]-m[i]; p[i]=(p[i] & ~(FLAG_N|FLAG_Z|FLAG_C)) | NZ(r) | (y[i]>=m[i] ? FLAG_C : 0); }
+				break;
+			case E_OP_BIT:
+				for (i=0;i<n;++i) { p[i]=(p[i] & ~(FLAG_N|FLAG_V|FLAG_Z)) | (m[i] & (FLAG_N|FLAG_V)) | ((a[i] & m[i])==0 ? FLAG_Z : 0); }
+				break;
+			case E_OP_ASL:
+				for (i=0;i<n;++i) { byte c=m[i]>>7; m[i]<<=1; p[i]=(p[i] & ~(FLAG_N|FLAG_Z|FLAG_C)) | NZ(m[i]) | c; }
+				break;
+			case E_OP_LSR:
+				for (i=0;i<n;++i) { byte c=m[i] & 1; m[i]>>=1; p[i]=(p[i] & ~(FLAG_N|FLAG_Z|FLAG_C)) | NZ(m[i]) | c; }
+				break;
+			case E_OP_ROL:
+				for (i=0;i<n;++i) { byte c=m[i]>>7; m[i]=(m[i]<<1) | (p[i] & FLAG_C); p[i]=(p[i] & ~(FLAG_N|FLAG_Z|FLAG_C)) | NZ(m[i]) | c; }
+				break;
+			case E_OP_ROR:
+				for (i=0;i<n;++i) { byte c=m[i] & 1; m[i]=(m[i]>>1) | ((p[i] & FLAG_C)<<7); p[i]=(p[i] & ~(FLAG_N|FLAG_Z|FLAG_C)) | NZ(m[i]) | c; }
+				break;
+			case E_OP_CLC:
+				for (i=0;i<n;++i) p[i]&=~FLAG_C;
+				break;
+			case E_OP_SEC:
+				for (i=0;i<n;++i) p[i]|=FLAG_C;
+				break;
+			case E_OP_CLV:
+				for (i=0;i<n;++i) p[i]&=~FLAG_V;
+				break;
+			case E_OP_CLD:
+				for (i=0;i<n;++i) p[i]&=~FLAG_D;
+				break;
+			case E_OP_SED:
+				for (i=0;i<n;++i) p[i]|=FLAG_D;
+				break;
+			case E_OP_CLI:
+				for (i=0;i<n;++i) p[i]&=~FLAG_I;
+				break;
+			case E_OP_SEI:
+				for (i=0;i<n;++i) p[i]|=FLAG_I;
+				break;
+			default:
+				assert(false);
+				return false;
+		}
+	}
+	return true;
+}
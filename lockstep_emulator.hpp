@@ -0,0 +1,63 @@
+#ifndef LOCKSTEP_EMULATOR_H
+#define LOCKSTEP_EMULATOR_H
+
+#include <vector>
+#include "types.hpp"
+
+extern "C"{
+#include "lib6502.h"
+};
+
+#define LOCKSTEP_ALIGN 64
+
+// State of many instances in structure-of-arrays form: reg[E_REG_A][i] is
+// the accumulator of instance i. Memory is kept as slots (the canonized
+// parameters of s_instruction), slot k of instance i being slot[k][i].
+// Every array is LOCKSTEP_ALIGN aligned and padded to a multiple of it.
+struct s_lockstep_state {
+	size_t count; // instances
+	size_t stride; // count rounded up to LOCKSTEP_ALIGN
+	byte *reg[E_REG_MAX];
+	std::vector <byte *> const_slots;
+	std::vector <byte *> mem_slots;
+	std::vector <byte *> zp_slots;
+	byte *broadcast; // scratch for E_PARAM_CONST_VALUE operands
+	void *allocation;
+	size_t arrays;
+
+	s_lockstep_state();
+	~s_lockstep_state();
+	void init(size_t a_count, size_t a_const_slots, size_t a_mem_slots, size_t a_zp_slots);
+
+	void set_registers(size_t instance, const M6502_Registers &registers);
+	void get_registers(size_t instance, M6502_Registers &registers) const;
+
+	// copy the registers and slots of a state of the same dimensions
+	void copy_from(const s_lockstep_state &other);
+	// hash of the given registers (D_A..D_P) and the slots of every instance
+	uint64_t fingerprint(byte_flags registers=D_A|D_X|D_Y|D_S|D_P) const;
+
+private:
+	s_lockstep_state(const s_lockstep_state &);
+	s_lockstep_state &operator=(const s_lockstep_state &);
+};
+
+// Executes a sequence on every instance of a s_lockstep_state at once, one
+// instruction for all the instances at a time. Only straight-line code
+// whose operands are registers or slots can be run in lockstep; run()
+// returns false for anything else (branches, stack, indexed addressing,
+// decimal mode) so that the caller can use lib6502 instead.
+class lockstep_emulator {
+private:
+	byte operation[256];
+	byte opcode_addressing[256];
+	bool initialized;
+
+public:
+	lockstep_emulator();
+	void init();
+	bool can_run(const std::vector <s_instruction> &sequence) const;
+	bool run(const std::vector <s_instruction> &sequence, s_lockstep_state &state) const;
+};
+
+#endif
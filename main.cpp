@@ -20,12 +20,17 @@ Phase 2.
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <assert.h>
 #include <string>
 #include <vector>
 #include <omp.h>
 #include "types.hpp"
 #include "seq_gen.hpp"
 #include "config.hpp"
+#include "lockstep_emulator.hpp"
+#include "equivalence_table.hpp"
+#include "external_sort.hpp"
+#include "sequence_archive.hpp"
 
 extern "C"{ 
 #include "lib6502.h" 
@@ -35,6 +40,68 @@ using namespace std;
 
 s_config global_configuration;
 
+extern struct OpcodeDef opcode_def[256];
+
+#define TEST_INPUTS 64
+
+// the same pseudo random inputs for every thread
+void set_test_inputs(s_lockstep_state &state)
+{
+	state.init(TEST_INPUTS,global_configuration.max_const_slots,global_configuration.max_memory_slots,global_configuration.max_zero_page_slots);
+	unsigned seed=6502;
+	for (size_t i=0;i<state.arrays-1;++i)
+	{
+		for (size_t j=0;j<state.count;++j)
+		{
+			seed=seed*1103515245+12345;
+			state.reg[0][i*state.stride+j]=(byte)(seed>>16);
+		}
+	}
+	// binary mode, the decimal flag is left to lib6502
+	for (size_t j=0;j<state.count;++j)
+		state.reg[E_REG_P][j]&=~0x08;
+}
+
+word get_sequence_cost(const vector <s_instruction> &instructions, OpcodeDef *const *opcode_by_value)
+{
+	unsigned cycles=0,size=0;
+	for (size_t i=0;i<instructions.size();++i)
+	{
+		cycles+=opcode_by_value[instructions[i].opcode]->cycles;
+		size+=opcode_by_value[instructions[i].opcode]->size;
+	}
+	return SEQUENCE_COST(cycles>255 ? 255 : cycles,size>255 ? 255 : size);
+}
+
+#define EXTERNAL_SORT_RUN_RECORDS (1<<24)
+
+// sequences enumerated in phase 1, at most one output class each
+#define PHASE1_SEQUENCES 1000000
+
+// A class representative is stored as its instruction count and rank, so
+// at equal cost the shorter and then lower ranked sequence wins, whichever
+// thread found it. get_sequence turns it back into the sequence.
+#define REPRESENTATIVE_RANK_BITS 40
+
+uint64_t get_representative_payload(size_t instructions, uint64_t rank)
+{
+	assert(rank<((uint64_t)1<<REPRESENTATIVE_RANK_BITS));
+	assert(instructions<((size_t)1<<(EQUIVALENCE_PAYLOAD_BITS-REPRESENTATIVE_RANK_BITS)));
+	return ((uint64_t)instructions<<REPRESENTATIVE_RANK_BITS) | rank;
+}
+
+struct s_group_statistics {
+	unsigned long long groups;
+	unsigned long long sequences;
+};
+
+void count_group(const s_fingerprint_record &, unsigned long long count, void *context)
+{
+	s_group_statistics *statistics=(s_group_statistics *)context;
+	++statistics->groups;
+	statistics->sequences+=count;
+}
+
 // This function iterates through all the programs and stores their output information
 // The output information can be used to quickly compare two programs
 void create_sequence_information()
@@ -44,12 +111,47 @@ void create_sequence_information()
 	sequence_generator seq_gen;
 	seq_gen.init();
 
+	lockstep_emulator emulator;
+	emulator.init();
+
+	// only the cheapest sequence of every output is kept
+	equivalence_table classes;
+	fingerprint_sorter sorter;
+	sequence_archive_writer archive;
+	unsigned long long archived_instructions=0;
+	unsigned long long dropped=0;
+	if (global_configuration.use_external_sort)
+	{
+		sorter.init("fingerprints",EXTERNAL_SORT_RUN_RECORDS);
+		if (!archive.open("sequences.arc",seq_gen.get_digits()))
+			printf_s("cannot create the sequence archive\n");
+	}
+	else
+		classes.init(2*PHASE1_SEQUENCES,(global_configuration.use_large_pages ? TABLE_LARGE_PAGES : 0) | (global_configuration.use_numa ? TABLE_NUMA : 0));
+
+	// opcode_def is not indexed by the opcode
+	OpcodeDef *opcode_by_value[256]={0};
+	for (size_t j=0;j<256;++j)
+		if (opcode_def[j].name[0])
+			opcode_by_value[opcode_def[j].opcode]=&opcode_def[j];
+
+	// per thread inputs and outputs
+	int threads=omp_get_max_threads();
+	vector <s_lockstep_state *> inputs(threads), outputs(threads);
+	for (int t=0;t<threads;++t)
+	{
+		inputs[t]=new s_lockstep_state;
+		outputs[t]=new s_lockstep_state;
+		set_test_inputs(*inputs[t]);
+		set_test_inputs(*outputs[t]);
+	}
+
 	int i;
 
 //	#pragma omp parallel 
 	{
 		#pragma omp for 
-		for (i=0;i<1000000;++i)
+		for (i=0;i<PHASE1_SEQUENCES;++i)
 		{
 			vector <byte> sequence;
 			vector <s_instruction> instructions;
@@ -58,10 +160,60 @@ void create_sequence_information()
 			{
 				// the instructions are correct
 				seq_gen.print_sequence(instructions);
+
+				int t=omp_get_thread_num();
+				outputs[t]->copy_from(*inputs[t]);
+				if (!emulator.run(instructions,*outputs[t]))
+					continue;
+				if (global_configuration.use_external_sort)
+				{
+					// every candidate is kept, the payload is its record in the archive
+					uint64_t fingerprint=outputs[t]->fingerprint();
+					word cost=get_sequence_cost(instructions,opcode_by_value);
+					uint64_t rank=seq_gen.get_rank(sequence);
+					#pragma omp critical (fingerprint_sorter)
+					{
+						sorter.add(fingerprint,cost,archive.get_records());
+						archive.add(instructions.size(),rank);
+						archived_instructions+=instructions.size();
+					}
+				}
+				else
+				{
+					// the table holds the whole representative, nothing is kept beside it
+					uint64_t payload=get_representative_payload(instructions.size(),seq_gen.get_rank(sequence));
+					if (classes.insert(outputs[t]->fingerprint(),get_sequence_cost(instructions,opcode_by_value),payload)==E_INSERT_FULL)
+					{
+						#pragma omp atomic
+						++dropped;
+					}
+				}
 			}
 		}
 	}
 
+	if (global_configuration.use_external_sort)
+	{
+		s_group_statistics statistics={0,0};
+		if (!archive.close())
+			printf_s("sequence archive failed\n");
+		printf_s("%llu sequences archived in %llu bytes, %llu as instructions\n",(unsigned long long)archive.get_records(),(unsigned long long)archive.get_size(),archived_instructions*sizeof(s_instruction));
+		if (!sorter.merge(count_group,&statistics))
+			printf_s("external sort failed\n");
+		printf_s("%llu output classes of %llu sequences in %u runs\n",statistics.groups,statistics.sequences,(unsigned)sorter.get_runs());
+	}
+	else
+	{
+		printf_s("%u output classes\n",(unsigned)classes.get_classes());
+		if (dropped)
+			printf_s("the table is full: %llu sequences dropped, the class count is too low\n",dropped);
+	}
+	for (int t=0;t<threads;++t)
+	{
+		delete inputs[t];
+		delete outputs[t];
+	}
+
 	double end = omp_get_wtime( );
 	double wtick = omp_get_wtick( );
 
@@ -81,6 +233,9 @@ int main(void)
 	global_configuration.max_memory_slots=2;
 	global_configuration.max_zero_page_slots=2;
 	global_configuration.additional_zero_page_slots=0;
+	global_configuration.use_external_sort=false;
+	global_configuration.use_large_pages=false;
+	global_configuration.use_numa=false;
 
 	create_sequence_information();
 	return 0;
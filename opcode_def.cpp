@@ -53,7 +53,7 @@ The following opcodes are to be checked:
 235 (0xeb) inconsistent mem read
 */
 
-struct OpcodeDef opcode_def[]={
+struct OpcodeDef opcode_def[256]={
 	{0x00,"BRK",1,7,D_NONE,D_P,MEM_NONE,IMP,LEGAL|UNUSABLE},
 	{0x01,"ORA",2,6,D_A,D_P,MEM_R,INX,LEGAL},
 	{0x03,"SLO",2,8,D_A,D_P,MEM_R|MEM_W,INX,ILLEGAL},
@@ -0,0 +1,548 @@
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <algorithm>
+#include "rule_database.hpp"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+using namespace std;
+
+// vertices per rule, above the 1.222 threshold for peeling a 3-hypergraph
+#define VERTEX_RATIO 1.23
+#define RANK_BLOCK 64
+#define MAX_SEEDS 100
+
+void encode_sequence(const std::vector <s_instruction> &sequence, std::vector <byte> &encoded)
+{
+	encoded.clear();
+	for (size_t i=0;i<sequence.size();++i)
+	{
+		encoded.push_back(sequence[i].opcode);
+		encoded.push_back(sequence[i].canonized_param.type);
+		encoded.push_back(sequence[i].canonized_param.type==E_PARAM_NONE ? 0 : sequence[i].canonized_param.value);
+	}
+}
+
+void decode_sequence(const byte *encoded, size_t size, std::vector <s_instruction> &sequence)
+{
+	sequence.clear();
+	for (size_t i=0;i+2<size;i+=3)
+	{
+		s_instruction instruction;
+		instruction.opcode=encoded[i];
+		instruction.canonized_param.type=(e_param_type)encoded[i+1];
+		instruction.canonized_param.value=encoded[i+2];
+		sequence.push_back(instruction);
+	}
+}
+
+static uint64_t mix(uint64_t h)
+{
+	h^=h>>33;
+	h*=0xff51afd7ed558ccdULL;
+	h^=h>>33;
+	h*=0xc4ceb9fe1a85ec53ULL;
+	h^=h>>33;
+	return h;
+}
+
+// the vertex of the key in each of the three parts
+static void get_vertices(const byte *key, size_t size, uint32_t seed, uint32_t part_size, uint32_t vertices[3])
+{
+	uint64_t h=14695981039346656037ULL ^ mix(seed);
+	for (size_t i=0;i<size;++i)
+	{
+		h^=key[i];
+		h*=1099511628211ULL;
+	}
+	for (uint32_t i=0;i<3;++i)
+		vertices[i]=i*part_size+(uint32_t)(mix(h+i*0x9e3779b97f4a7c15ULL) % part_size);
+}
+
+// the filter block of the key and the bits in it, FILTER_PROBES of 9 bits
+static void get_filter_probes(const byte *key, size_t size, uint32_t blocks, uint32_t &block, uint64_t &bits)
+{
+	uint64_t h=14695981039346656037ULL;
+	for (size_t i=0;i<size;++i)
+	{
+		h^=key[i];
+		h*=1099511628211ULL;
+	}
+	h=mix(h);
+	block=(uint32_t)(((h>>32)*blocks)>>32);
+	bits=mix(h+0x9e3779b97f4a7c15ULL);
+}
+
+static inline byte get_g(const byte *g, uint32_t vertex)
+{
+	return (g[vertex>>2]>>((vertex & 3)*2)) & 3;
+}
+
+// vertices in use (g!=3) among the first count of a g byte
+static inline uint32_t used_in_byte(byte b, uint32_t count)
+{
+	uint32_t used=0;
+	for (uint32_t i=0;i<count;++i,b>>=2)
+		used+=(b & 3)!=3;
+	return used;
+}
+
+void rule_database_builder::add(const std::vector <s_instruction> &target, const std::vector <s_instruction> &replacement, word cost, byte_flags preserved)
+{
+	vector <byte> encoded_target;
+	s_rule_candidate candidate;
+	encode_sequence(target,encoded_target);
+	encode_sequence(replacement,candidate.replacement);
+	assert(encoded_target.size()<256 && candidate.replacement.size()<256);
+	candidate.cost=cost;
+	candidate.preserved=preserved & ALL_LIVE;
+	targets[encoded_target].push_back(candidate);
+}
+
+const s_objective OBJECTIVE_CYCLES={1,0};
+const s_objective OBJECTIVE_SIZE={0,1};
+
+unsigned get_objective_score(word cost, const s_objective &objective)
+{
+	unsigned cycles=cost>>8, size=cost & 0xff;
+	return ((cycles*objective.cycles_weight+size*objective.size_weight)<<9)+cycles+size;
+}
+
+static unsigned count_flags(byte_flags flags)
+{
+	unsigned count=0;
+	for (;flags;flags&=flags-1)
+		++count;
+	return count;
+}
+
+// a is no worse than b in cycles and size
+static bool dominates(word a, word b)
+{
+	return (a>>8)<=(b>>8) && (a & 0xff)<=(b & 0xff);
+}
+
+// the Pareto front of the candidates for every live mask; of equal costs
+// the one that preserves more is kept
+static void choose_fronts(const vector <s_rule_candidate> &candidates, byte live_table[LIVE_MASKS], vector < vector <byte> > &fronts, vector <size_t> &variants)
+{
+	fronts.clear();
+	variants.clear();
+	for (size_t live=0;live<LIVE_MASKS;++live)
+	{
+		vector <size_t> front;
+		for (size_t c=0;c<candidates.size();++c)
+		{
+			const s_rule_candidate &candidate=candidates[c];
+			if ((candidate.preserved & live)!=live)
+				continue;
+			bool beaten=false;
+			for (size_t o=0;o<candidates.size() && !beaten;++o)
+			{
+				const s_rule_candidate &other=candidates[o];
+				if (o==c || (other.preserved & live)!=live || !dominates(other.cost,candidate.cost))
+					continue;
+				if (other.cost!=candidate.cost)
+					beaten=true;
+				else
+				{
+					// the same cost: keep the one that preserves the most, then the first
+					unsigned other_count=count_flags(other.preserved), count=count_flags(candidate.preserved);
+					beaten=other_count>count || (other_count==count && o<c);
+				}
+			}
+			if (!beaten)
+				front.push_back(c);
+		}
+		if (front.empty())
+		{
+			live_table[live]=NO_VARIANT;
+			continue;
+		}
+
+		vector <byte> front_variants;
+		for (size_t f=0;f<front.size();++f)
+		{
+			size_t v=find(variants.begin(),variants.end(),front[f])-variants.begin();
+			if (v==variants.size())
+				variants.push_back(front[f]);
+			front_variants.push_back((byte)v);
+		}
+		size_t index=find(fronts.begin(),fronts.end(),front_variants)-fronts.begin();
+		if (index==fronts.size())
+			fronts.push_back(front_variants);
+		live_table[live]=(byte)index;
+	}
+}
+
+bool rule_database_builder::finalize(const std::string &path) const
+{
+	// the records of the targets
+	vector <byte> data;
+	vector <s_rule_entry> entries;
+	for (map < vector <byte>, vector <s_rule_candidate> >::const_iterator it=targets.begin();it!=targets.end();++it)
+	{
+		const vector <s_rule_candidate> &candidates=it->second;
+		byte live_table[LIVE_MASKS];
+		vector < vector <byte> > fronts;
+		vector <size_t> variants;
+		choose_fronts(candidates,live_table,fronts,variants);
+
+		s_rule_entry entry;
+		entry.offset=(uint32_t)data.size();
+		entry.target_size=(byte)it->first.size();
+		entry.variants=(byte)variants.size();
+		entry.cost=0xffff;
+		if (live_table[ALL_LIVE]!=NO_VARIANT)
+		{
+			const vector <byte> &front=fronts[live_table[ALL_LIVE]];
+			for (size_t f=0;f<front.size();++f)
+				if (get_objective_score(candidates[variants[front[f]]].cost,OBJECTIVE_CYCLES)<get_objective_score(entry.cost,OBJECTIVE_CYCLES))
+					entry.cost=candidates[variants[front[f]]].cost;
+		}
+		data.insert(data.end(),it->first.begin(),it->first.end());
+		data.insert(data.end(),live_table,live_table+LIVE_MASKS);
+		data.push_back((byte)fronts.size());
+		for (size_t f=0;f<fronts.size();++f)
+		{
+			data.push_back((byte)fronts[f].size());
+			data.insert(data.end(),fronts[f].begin(),fronts[f].end());
+		}
+		for (size_t v=0;v<variants.size();++v)
+		{
+			const s_rule_candidate &candidate=candidates[variants[v]];
+			data.push_back((byte)(candidate.cost>>8));
+			data.push_back((byte)candidate.cost);
+			data.push_back((byte)candidate.replacement.size());
+			data.insert(data.end(),candidate.replacement.begin(),candidate.replacement.end());
+		}
+		entries.push_back(entry);
+	}
+
+	uint32_t rules=(uint32_t)entries.size();
+	uint32_t part_size=(uint32_t)(rules*VERTEX_RATIO/3)+2;
+	uint32_t vertex_count=3*part_size;
+	const byte *key_data=data.empty() ? NULL : &data[0];
+
+	// find a seed whose hypergraph peels completely
+	vector <uint32_t> edges(rules*3);
+	vector <uint32_t> degree(vertex_count), edge_xor(vertex_count);
+	vector <uint32_t> queue, order_edge, order_vertex;
+	uint32_t seed;
+	for (seed=1;seed<=MAX_SEEDS;++seed)
+	{
+		fill(degree.begin(),degree.end(),0);
+		fill(edge_xor.begin(),edge_xor.end(),0);
+		for (uint32_t e=0;e<rules;++e)
+		{
+			get_vertices(key_data+entries[e].offset,entries[e].target_size,seed,part_size,&edges[e*3]);
+			for (uint32_t i=0;i<3;++i)
+			{
+				++degree[edges[e*3+i]];
+				edge_xor[edges[e*3+i]]^=e;
+			}
+		}
+
+		queue.clear();
+		order_edge.clear();
+		order_vertex.clear();
+		for (uint32_t v=0;v<vertex_count;++v)
+			if (degree[v]==1)
+				queue.push_back(v);
+		while (!queue.empty())
+		{
+			uint32_t v=queue.back();
+			queue.pop_back();
+			if (degree[v]!=1)
+				continue;
+			uint32_t e=edge_xor[v];
+			order_edge.push_back(e);
+			order_vertex.push_back(v);
+			for (uint32_t i=0;i<3;++i)
+			{
+				uint32_t u=edges[e*3+i];
+				--degree[u];
+				edge_xor[u]^=e;
+				if (degree[u]==1)
+					queue.push_back(u);
+			}
+		}
+		if (order_edge.size()==rules)
+			break;
+	}
+	if (seed>MAX_SEEDS)
+		return false;
+
+	// in reverse peeling order each edge picks its vertex by the sum of its g values
+	vector <byte> g_values(vertex_count,3);
+	for (size_t j=rules;j-->0;)
+	{
+		uint32_t e=order_edge[j], v=order_vertex[j];
+		uint32_t k=0, sum=0;
+		for (uint32_t i=0;i<3;++i)
+		{
+			uint32_t u=edges[e*3+i];
+			if (u==v)
+				k=i;
+			else
+				sum+=g_values[u]==3 ? 0 : g_values[u];
+		}
+		g_values[v]=(byte)((k+6-sum)%3);
+	}
+
+	uint32_t blocks=(vertex_count+RANK_BLOCK-1)/RANK_BLOCK;
+	vector <uint32_t> rank(blocks);
+	vector <byte> g((vertex_count+4*4-1)/(4*4)*4,0xff); // padded to 4 bytes
+	uint32_t used=0;
+	for (uint32_t v=0;v<vertex_count;++v)
+	{
+		if (v%RANK_BLOCK==0)
+			rank[v/RANK_BLOCK]=used;
+		g[v>>2]=(byte)((g[v>>2] & ~(3<<((v & 3)*2))) | (g_values[v]<<((v & 3)*2)));
+		used+=g_values[v]!=3;
+	}
+	assert(used==rules);
+
+	// entries in hash order
+	vector <s_rule_entry> ordered(rules);
+	for (uint32_t j=0;j<rules;++j)
+	{
+		uint32_t v=order_vertex[j];
+		uint32_t index=rank[v/RANK_BLOCK];
+		for (uint32_t u=v-v%RANK_BLOCK;u<v;++u)
+			index+=g_values[u]!=3;
+		ordered[index]=entries[order_edge[j]];
+	}
+
+	uint32_t filter_blocks=(rules*FILTER_BITS_PER_KEY+FILTER_BLOCK_BYTES*8-1)/(FILTER_BLOCK_BYTES*8);
+	if (!filter_blocks)
+		filter_blocks=1;
+	vector <byte> filter(filter_blocks*FILTER_BLOCK_BYTES,0);
+	for (uint32_t e=0;e<rules;++e)
+	{
+		uint32_t block;
+		uint64_t bits;
+		get_filter_probes(key_data+entries[e].offset,entries[e].target_size,filter_blocks,block,bits);
+		for (uint32_t p=0;p<FILTER_PROBES;++p,bits>>=9)
+			filter[block*FILTER_BLOCK_BYTES+(bits>>3 & 63)]|=(byte)(1<<(bits & 7));
+	}
+
+	s_rule_database_header header;
+	memset(&header,0,sizeof(header));
+	memcpy(header.magic,RULE_DATABASE_MAGIC,sizeof(header.magic));
+	header.rules=rules;
+	header.part_size=part_size;
+	header.seed=seed;
+	header.filter_offset=(sizeof(header)+FILTER_BLOCK_BYTES-1)/FILTER_BLOCK_BYTES*FILTER_BLOCK_BYTES;
+	header.filter_blocks=filter_blocks;
+	header.rank_offset=header.filter_offset+(uint32_t)filter.size();
+	header.g_offset=header.rank_offset+blocks*sizeof(uint32_t);
+	header.entries_offset=header.g_offset+(uint32_t)g.size();
+	header.data_offset=header.entries_offset+rules*sizeof(s_rule_entry);
+	header.file_size=header.data_offset+(uint32_t)data.size();
+
+	FILE *f=fopen(path.c_str(),"wb");
+	if (!f)
+		return false;
+	bool ok=fwrite(&header,sizeof(header),1,f)==1;
+	byte padding[FILTER_BLOCK_BYTES]={0};
+	ok&=fwrite(padding,1,header.filter_offset-sizeof(header),f)==header.filter_offset-sizeof(header);
+	ok&=fwrite(&filter[0],1,filter.size(),f)==filter.size();
+	if (blocks)
+		ok&=fwrite(&rank[0],sizeof(uint32_t),blocks,f)==blocks;
+	ok&=fwrite(&g[0],1,g.size(),f)==g.size();
+	if (rules)
+		ok&=fwrite(&ordered[0],sizeof(s_rule_entry),rules,f)==rules;
+	if (!data.empty())
+		ok&=fwrite(&data[0],1,data.size(),f)==data.size();
+	ok&=fclose(f)==0;
+	return ok;
+}
+
+rule_database::rule_database()
+{
+	file=NULL;
+	file_size=0;
+	header=NULL;
+	filter=NULL;
+	rank=NULL;
+	g=NULL;
+	entries=NULL;
+	data=NULL;
+#ifdef _WIN32
+	file_handle=INVALID_HANDLE_VALUE;
+	mapping_handle=NULL;
+#endif
+}
+
+rule_database::~rule_database()
+{
+	close();
+}
+
+bool rule_database::open(const std::string &path)
+{
+	close();
+#ifdef _WIN32
+	file_handle=CreateFileA(path.c_str(),GENERIC_READ,FILE_SHARE_READ,NULL,OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,NULL);
+	if (file_handle==INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file_handle,&size) || size.QuadPart<(LONGLONG)sizeof(s_rule_database_header)
+		|| !(mapping_handle=CreateFileMappingA(file_handle,NULL,PAGE_READONLY,0,0,NULL))
+		|| !(file=(const byte *)MapViewOfFile(mapping_handle,FILE_MAP_READ,0,0,0)))
+	{
+		close();
+		return false;
+	}
+	file_size=(size_t)size.QuadPart;
+#else
+	int fd=::open(path.c_str(),O_RDONLY);
+	if (fd<0)
+		return false;
+	struct stat st;
+	if (fstat(fd,&st)!=0 || st.st_size<(off_t)sizeof(s_rule_database_header))
+	{
+		::close(fd);
+		return false;
+	}
+	void *mapping=mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+	::close(fd);
+	if (mapping==MAP_FAILED)
+		return false;
+	file=(const byte *)mapping;
+	file_size=st.st_size;
+#endif
+
+	header=(const s_rule_database_header *)file;
+	if (memcmp(header->magic,RULE_DATABASE_MAGIC,sizeof(header->magic))!=0
+		|| header->file_size!=file_size
+		|| header->filter_offset%FILTER_BLOCK_BYTES!=0 || header->filter_blocks==0
+		|| header->filter_offset+(uint64_t)header->filter_blocks*FILTER_BLOCK_BYTES>header->rank_offset
+		|| header->rank_offset>header->g_offset || header->g_offset>header->entries_offset
+		|| header->entries_offset>header->data_offset || header->data_offset>file_size
+		|| header->part_size==0)
+	{
+		close();
+		return false;
+	}
+	filter=file+header->filter_offset;
+	rank=(const uint32_t *)(file+header->rank_offset);
+	g=file+header->g_offset;
+	entries=(const s_rule_entry *)(file+header->entries_offset);
+	data=file+header->data_offset;
+	return true;
+}
+
+void rule_database::close()
+{
+#ifdef _WIN32
+	if (file)
+		UnmapViewOfFile(file);
+	if (mapping_handle)
+		CloseHandle(mapping_handle);
+	if (file_handle!=INVALID_HANDLE_VALUE)
+		CloseHandle(file_handle);
+	file_handle=INVALID_HANDLE_VALUE;
+	mapping_handle=NULL;
+#else
+	if (file)
+		munmap((void *)file,file_size);
+#endif
+	file=NULL;
+	file_size=0;
+	header=NULL;
+}
+
+bool rule_database::may_contain(const byte *target, size_t target_size) const
+{
+	if (!header || header->rules==0)
+		return false;
+	uint32_t block;
+	uint64_t bits;
+	get_filter_probes(target,target_size,header->filter_blocks,block,bits);
+	const byte *line=filter+block*FILTER_BLOCK_BYTES;
+	for (uint32_t p=0;p<FILTER_PROBES;++p,bits>>=9)
+		if (!(line[bits>>3 & 63] & (1<<(bits & 7))))
+			return false;
+	return true;
+}
+
+const s_rule_entry *rule_database::find(const byte *target, size_t target_size) const
+{
+	if (!may_contain(target,target_size))
+		return NULL;
+	uint32_t vertices[3];
+	get_vertices(target,target_size,header->seed,header->part_size,vertices);
+	uint32_t v=vertices[(get_g(g,vertices[0])+get_g(g,vertices[1])+get_g(g,vertices[2]))%3];
+	if (get_g(g,v)==3)
+		return NULL;
+
+	uint32_t index=rank[v/RANK_BLOCK];
+	for (uint32_t b=(v-v%RANK_BLOCK)>>2;b<(v>>2);++b)
+		index+=used_in_byte(g[b],4);
+	index+=used_in_byte(g[v>>2],v & 3);
+
+	// the hash maps any key somewhere, check that it is this one
+	const s_rule_entry *entry=&entries[index];
+	if (entry->target_size!=target_size || memcmp(data+entry->offset,target,target_size)!=0)
+		return NULL;
+	return entry;
+}
+
+const byte *rule_database::get_replacement(const s_rule_entry *entry, byte_flags live, const s_objective &objective, word &cost, size_t &size) const
+{
+	const byte *record=data+entry->offset+entry->target_size;
+	byte front_index=record[live & ALL_LIVE];
+	if (front_index==NO_VARIANT)
+		return NULL;
+	const byte *fronts=record+LIVE_MASKS;
+	const byte *front=fronts+1;
+	for (byte f=0;f<front_index;++f)
+		front+=1+front[0];
+	const byte *variants=fronts+1;
+	for (byte f=0;f<fronts[0];++f)
+		variants+=1+variants[0];
+
+	// the variants are few, walk them for the best of the front
+	const byte *best=NULL;
+	unsigned best_score=0;
+	for (byte f=0;f<front[0];++f)
+	{
+		const byte *variant=variants;
+		for (byte v=0;v<front[1+f];++v)
+			variant+=3+variant[2];
+		unsigned score=get_objective_score((word)((variant[0]<<8) | variant[1]),objective);
+		if (!best || score<best_score)
+		{
+			best=variant;
+			best_score=score;
+		}
+	}
+	cost=(word)((best[0]<<8) | best[1]);
+	size=best[2];
+	return best+3;
+}
+
+bool rule_database::lookup(const std::vector <s_instruction> &target, byte_flags live, const s_objective &objective, std::vector <s_instruction> &replacement, word &cost) const
+{
+	vector <byte> encoded;
+	encode_sequence(target,encoded);
+	const s_rule_entry *entry=find(encoded.empty() ? NULL : &encoded[0],encoded.size());
+	if (!entry)
+		return false;
+	size_t size;
+	const byte *bytes=get_replacement(entry,live,objective,cost,size);
+	if (!bytes)
+		return false;
+	decode_sequence(bytes,size,replacement);
+	return true;
+}
@@ -0,0 +1,135 @@
+#ifndef RULE_DATABASE_H
+#define RULE_DATABASE_H
+
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "types.hpp"
+
+// A rule replaces a target sequence by a cheaper equivalent one. Sequences
+// are stored canonized, three bytes per instruction: opcode, parameter
+// type and parameter value.
+void encode_sequence(const std::vector <s_instruction> &sequence, std::vector <byte> &encoded);
+void decode_sequence(const byte *encoded, size_t size, std::vector <s_instruction> &sequence);
+
+#define RULE_DATABASE_MAGIC "6502MPH\4"
+
+// outputs a replacement may leave different from the target: any of the
+// registers D_A, D_X, D_Y, D_S and D_P that are not live after it
+#define ALL_LIVE (D_A|D_X|D_Y|D_S|D_P)
+#define LIVE_MASKS (ALL_LIVE+1)
+#define NO_VARIANT 0xff
+
+// what a replacement is chosen for: the lowest cycles*cycles_weight +
+// size*size_weight, ties to the lowest cycles+size
+struct s_objective {
+	word cycles_weight;
+	word size_weight;
+};
+
+extern const s_objective OBJECTIVE_CYCLES;
+extern const s_objective OBJECTIVE_SIZE;
+
+unsigned get_objective_score(word cost, const s_objective &objective);
+
+// blocked Bloom filter in front of the index: a key sets FILTER_PROBES
+// bits of one cache line, so a miss is mostly rejected by reading it alone
+#define FILTER_BLOCK_BYTES 64
+#define FILTER_BITS_PER_KEY 12
+#define FILTER_PROBES 7
+
+// File layout, all offsets from the start of the file:
+//   header
+//   filter[]	FILTER_BLOCK_BYTES per block, at a multiple of it
+//   rank[]	uint32_t per 64 vertices: vertices in use before the block
+//   g[]	2 bits per vertex, 3 = not in use
+//   entries[]	s_rule_entry per rule, in hash order
+//   data	per entry: the target bytes, then the front index for each
+//		live mask (NO_VARIANT if no replacement is valid), the number
+//		of fronts, the fronts, each as a count and variant indices,
+//		then the variants, each as cost (2 bytes, big endian), size,
+//		bytes
+struct s_rule_database_header {
+	char magic[8];
+	uint32_t rules;
+	uint32_t part_size; // vertices in each of the three parts
+	uint32_t seed;
+	uint32_t filter_offset;
+	uint32_t filter_blocks;
+	uint32_t rank_offset;
+	uint32_t g_offset;
+	uint32_t entries_offset;
+	uint32_t data_offset;
+	uint32_t file_size;
+};
+
+struct s_rule_entry {
+	uint32_t offset; // of the target, the live table and variants follow it
+	byte target_size;
+	byte variants;
+	word cost; // of the fastest replacement when everything is live, 0xffff if none
+};
+
+struct s_rule_candidate {
+	std::vector <byte> replacement;
+	word cost;
+	byte_flags preserved; // outputs equal to the target's
+};
+
+// Collects rules and writes them as a database file. A target may be added
+// with several replacements that differ in cost and in the outputs they
+// preserve. For every live mask the replacements that preserve it and are
+// not beaten in both cycles and size by another are kept (the Pareto
+// front), so that the objective can be chosen at lookup. Each replacement
+// and each front is stored once however many masks it serves.
+class rule_database_builder {
+private:
+	std::map < std::vector <byte>, std::vector <s_rule_candidate> > targets;
+
+public:
+	void add(const std::vector <s_instruction> &target, const std::vector <s_instruction> &replacement, word cost, byte_flags preserved=ALL_LIVE);
+	size_t get_rules() const { return targets.size(); }
+	bool finalize(const std::string &path) const;
+};
+
+// A finalized database mapped read only. The index is a minimal perfect
+// hash (3-hypergraph, about 3.1 bits per target), so a lookup reads three
+// g values, one rank word and the one entry it leads to, whose live table
+// picks the replacement.
+class rule_database {
+private:
+	const byte *file;
+	size_t file_size;
+	const s_rule_database_header *header;
+	const byte *filter;
+	const uint32_t *rank;
+	const byte *g;
+	const s_rule_entry *entries;
+	const byte *data;
+#ifdef _WIN32
+	void *file_handle, *mapping_handle;
+#endif
+
+	rule_database(const rule_database &);
+	rule_database &operator=(const rule_database &);
+
+public:
+	rule_database();
+	~rule_database();
+
+	bool open(const std::string &path);
+	void close();
+
+	size_t get_rules() const { return header ? header->rules : 0; }
+	const s_rule_entry *get_entry(size_t index) const { return &entries[index]; }
+	const byte *get_target(const s_rule_entry *entry) const { return data+entry->offset; }
+	// the best replacement for the objective when only the live outputs must be preserved, NULL if none
+	const byte *get_replacement(const s_rule_entry *entry, byte_flags live, const s_objective &objective, word &cost, size_t &size) const;
+	// false only if the target is not in the database, without touching the index
+	bool may_contain(const byte *target, size_t target_size) const;
+	const s_rule_entry *find(const byte *target, size_t target_size) const;
+	bool lookup(const std::vector <s_instruction> &target, byte_flags live, const s_objective &objective, std::vector <s_instruction> &replacement, word &cost) const;
+};
+
+#endif
@@ -0,0 +1,227 @@
+#include <string.h>
+#include <assert.h>
+#include <algorithm>
+#include <map>
+#include <set>
+#include "rule_generalizer.hpp"
+#include "rule_database.hpp"
+
+using namespace std;
+
+#define VERIFY_INPUTS 256
+#define NO_CONSTANT 0x100
+
+static int slot_kind(e_param_type type)
+{
+	switch (type)
+	{
+		case E_PARAM_CONST_SLOT:
+			return 0;
+		case E_PARAM_MEM_SLOT:
+			return 1;
+		case E_PARAM_ZP_SLOT:
+			return 2;
+		default:
+			return -1;
+	}
+}
+
+void normalize_slots(s_rule &rule)
+{
+	int renumber[3][256];
+	int next[3]={0,0,0};
+	memset(renumber,-1,sizeof(renumber));
+	vector <s_instruction> *sequences[2]={&rule.target,&rule.replacement};
+	for (size_t s=0;s<2;++s)
+	{
+		vector <s_instruction> &sequence=*sequences[s];
+		for (size_t i=0;i<sequence.size();++i)
+		{
+			s_canonized_param &param=sequence[i].canonized_param;
+			int kind=slot_kind(param.type);
+			if (kind<0)
+				continue;
+			if (renumber[kind][param.value]<0)
+				renumber[kind][param.value]=next[kind]++;
+			param.value=(byte)renumber[kind][param.value];
+		}
+	}
+}
+
+// the one constant of a rule, NO_CONSTANT if none or more than one
+static unsigned get_constant(const s_rule &rule)
+{
+	unsigned constant=NO_CONSTANT;
+	const vector <s_instruction> *sequences[2]={&rule.target,&rule.replacement};
+	for (size_t s=0;s<2;++s)
+	{
+		for (size_t i=0;i<sequences[s]->size();++i)
+		{
+			const s_canonized_param &param=(*sequences[s])[i].canonized_param;
+			if (param.type!=E_PARAM_CONST_VALUE)
+				continue;
+			if (constant!=NO_CONSTANT && constant!=param.value)
+				return NO_CONSTANT;
+			constant=param.value;
+		}
+	}
+	return constant;
+}
+
+// the constant replaced by a new slot, or by 0 for the shape of its family
+static void lift_constant(s_rule &rule, bool to_slot)
+{
+	int next=0;
+	vector <s_instruction> *sequences[2]={&rule.target,&rule.replacement};
+	for (size_t s=0;s<2;++s)
+		for (size_t i=0;i<sequences[s]->size();++i)
+			if ((*sequences[s])[i].canonized_param.type==E_PARAM_CONST_SLOT)
+				next=max(next,(*sequences[s])[i].canonized_param.value+1);
+	for (size_t s=0;s<2;++s)
+	{
+		for (size_t i=0;i<sequences[s]->size();++i)
+		{
+			s_canonized_param &param=(*sequences[s])[i].canonized_param;
+			if (param.type!=E_PARAM_CONST_VALUE)
+				continue;
+			if (to_slot)
+			{
+				param.type=E_PARAM_CONST_SLOT;
+				param.value=(byte)next;
+			}
+			else
+				param.value=0;
+		}
+	}
+}
+
+static void get_key(const s_rule &rule, vector <byte> &key)
+{
+	vector <byte> replacement;
+	encode_sequence(rule.target,key);
+	encode_sequence(rule.replacement,replacement);
+	key.push_back(0xff); // no encoded instruction starts with a 0xff opcode and 0xff type
+	key.push_back(0xff);
+	key.insert(key.end(),replacement.begin(),replacement.end());
+	key.push_back((byte)(rule.cost>>8));
+	key.push_back((byte)rule.cost);
+	key.push_back(rule.preserved);
+}
+
+rule_generalizer::rule_generalizer()
+{
+	renumbered=0;
+	lifted=0;
+	rejected=0;
+}
+
+void rule_generalizer::init()
+{
+	emulator.init();
+}
+
+bool rule_generalizer::verify(const s_rule &rule) const
+{
+	const vector <s_instruction> *sequences[2]={&rule.target,&rule.replacement};
+	for (size_t s=0;s<2;++s)
+		for (size_t i=0;i<sequences[s]->size();++i)
+			if (slot_kind((*sequences[s])[i].canonized_param.type)>=0 && (*sequences[s])[i].canonized_param.value>=GENERALIZER_SLOTS)
+				return false;
+	if (!emulator.can_run(rule.target) || !emulator.can_run(rule.replacement))
+		return false;
+
+	s_lockstep_state before, after;
+	before.init(VERIFY_INPUTS,GENERALIZER_SLOTS,GENERALIZER_SLOTS,GENERALIZER_SLOTS);
+	after.init(VERIFY_INPUTS,GENERALIZER_SLOTS,GENERALIZER_SLOTS,GENERALIZER_SLOTS);
+	unsigned seed=6502;
+	for (size_t i=0;i<before.arrays-1;++i)
+	{
+		for (size_t j=0;j<before.count;++j)
+		{
+			seed=seed*1103515245+12345;
+			before.reg[0][i*before.stride+j]=(byte)(seed>>16);
+		}
+	}
+	// binary mode only, like the lockstep emulator
+	for (size_t j=0;j<before.count;++j)
+		before.reg[E_REG_P][j]&=~0x08;
+	after.copy_from(before);
+
+	if (!emulator.run(rule.target,before) || !emulator.run(rule.replacement,after))
+		return false;
+	return before.fingerprint(rule.preserved)==after.fingerprint(rule.preserved);
+}
+
+void rule_generalizer::generalize(const std::vector <s_rule> &rules, std::vector <s_rule> &general)
+{
+	renumbered=0;
+	lifted=0;
+	rejected=0;
+	general.clear();
+
+	// 1. renumber slots and drop the duplicates
+	vector <s_rule> unique;
+	set < vector <byte> > seen;
+	vector <byte> key;
+	for (size_t r=0;r<rules.size();++r)
+	{
+		s_rule rule=rules[r];
+		normalize_slots(rule);
+		get_key(rule,key);
+		if (!seen.insert(key).second)
+		{
+			++renumbered;
+			continue;
+		}
+		unique.push_back(rule);
+	}
+
+	// 2. families of rules differing in one constant
+	map < vector <byte>, vector <size_t> > families;
+	for (size_t r=0;r<unique.size();++r)
+	{
+		if (get_constant(unique[r])==NO_CONSTANT)
+			continue;
+		s_rule shape=unique[r];
+		lift_constant(shape,false);
+		get_key(shape,key);
+		families[key].push_back(r);
+	}
+
+	// 3. lift the complete families that still verify
+	vector <bool> replaced(unique.size(),false);
+	for (map < vector <byte>, vector <size_t> >::iterator it=families.begin();it!=families.end();++it)
+	{
+		vector <size_t> &members=it->second;
+		bool values[256]={false};
+		size_t distinct=0;
+		for (size_t m=0;m<members.size();++m)
+		{
+			unsigned constant=get_constant(unique[members[m]]);
+			if (!values[constant])
+			{
+				values[constant]=true;
+				++distinct;
+			}
+		}
+		if (distinct!=256)
+			continue;
+
+		s_rule lifted_rule=unique[members[0]];
+		lift_constant(lifted_rule,true);
+		normalize_slots(lifted_rule);
+		if (!verify(lifted_rule))
+		{
+			++rejected;
+			continue;
+		}
+		for (size_t m=0;m<members.size();++m)
+			replaced[members[m]]=true;
+		general.push_back(lifted_rule);
+		++lifted;
+	}
+
+	for (size_t r=0;r<unique.size();++r)
+		if (!replaced[r])
+			general.push_back(unique[r]);
+}
@@ -0,0 +1,47 @@
+#ifndef RULE_GENERALIZER_H
+#define RULE_GENERALIZER_H
+
+#include <vector>
+#include "types.hpp"
+#include "lockstep_emulator.hpp"
+
+struct s_rule {
+	std::vector <s_instruction> target;
+	std::vector <s_instruction> replacement;
+	word cost; // of the replacement
+	byte_flags preserved; // registers (D_A..D_P) left as the target leaves them
+};
+
+// slots a verification state provides per kind
+#define GENERALIZER_SLOTS 8
+
+// Shrinks a set of concrete rules before they go into a rule_database:
+// 1. slots are renumbered in order of first use, so rules that differ only
+//    in slot numbers become one rule,
+// 2. a family of rules that differ only in one constant, with a member for
+//    each of the 256 values, becomes one rule with a new constant slot,
+// 3. every lifted rule is run on random inputs with the lockstep emulator
+//    and kept only if target and replacement still give the same outputs,
+//    otherwise the family is kept as it was.
+// Lifted rules inherit the matcher's side condition that different slots
+// of a kind are different operands.
+class rule_generalizer {
+private:
+	lockstep_emulator emulator;
+	size_t renumbered, lifted, rejected;
+
+public:
+	rule_generalizer();
+	void init();
+
+	void generalize(const std::vector <s_rule> &rules, std::vector <s_rule> &general);
+	bool verify(const s_rule &rule) const;
+
+	size_t get_renumbered() const { return renumbered; }
+	size_t get_lifted() const { return lifted; }
+	size_t get_rejected() const { return rejected; }
+};
+
+void normalize_slots(s_rule &rule);
+
+#endif
@@ -0,0 +1,226 @@
+#include <string.h>
+#include <assert.h>
+#include <algorithm>
+#include "rule_matcher.hpp"
+#include "equivalence_table.hpp"
+
+using namespace std;
+
+extern struct OpcodeDef opcode_def[256];
+
+// parameter bytes of a canonized instruction, see encode_sequence
+#define ENCODED_SIZE 3
+
+rule_matcher::rule_matcher()
+{
+	database=NULL;
+	memset(opcode_cost,0,sizeof(opcode_cost));
+	objective=OBJECTIVE_CYCLES;
+}
+
+unsigned rule_matcher::get_next(unsigned state, byte opcode) const
+{
+	const vector < pair <byte, unsigned> > &next=states[state].next;
+	vector < pair <byte, unsigned> >::const_iterator it=lower_bound(next.begin(),next.end(),pair <byte, unsigned> (opcode,0));
+	if (it!=next.end() && it->first==opcode)
+		return it->second;
+	return 0;
+}
+
+void rule_matcher::init(const rule_database &a_database, const s_objective &a_objective)
+{
+	database=&a_database;
+	objective=a_objective;
+	for (size_t i=0;i<256;++i)
+		if (opcode_def[i].name[0])
+			opcode_cost[opcode_def[i].opcode]=SEQUENCE_COST(opcode_def[i].cycles,opcode_def[i].size);
+
+	// the trie of the targets
+	states.clear();
+	states.push_back(s_matcher_state());
+	states[0].failure=0;
+	states[0].dictionary=0;
+	states[0].depth=0;
+	for (size_t r=0;r<database->get_rules();++r)
+	{
+		const s_rule_entry *entry=database->get_entry(r);
+		const byte *target=database->get_target(entry);
+		unsigned state=0;
+		for (size_t i=0;i<entry->target_size;i+=ENCODED_SIZE)
+		{
+			byte opcode=target[i];
+			unsigned next=get_next(state,opcode);
+			if (!next)
+			{
+				next=(unsigned)states.size();
+				s_matcher_state new_state;
+				new_state.failure=0;
+				new_state.dictionary=0;
+				new_state.depth=states[state].depth+1;
+				states.push_back(new_state);
+				vector < pair <byte, unsigned> > &edges=states[state].next;
+				edges.insert(lower_bound(edges.begin(),edges.end(),pair <byte, unsigned> (opcode,0)),pair <byte, unsigned> (opcode,next));
+			}
+			state=next;
+		}
+		if (state)
+			states[state].outputs.push_back((unsigned)r);
+	}
+
+	// failure and dictionary links, breadth first
+	vector <unsigned> queue;
+	for (size_t i=0;i<states[0].next.size();++i)
+		queue.push_back(states[0].next[i].second);
+	for (size_t q=0;q<queue.size();++q)
+	{
+		unsigned u=queue[q];
+		for (size_t i=0;i<states[u].next.size();++i)
+		{
+			byte opcode=states[u].next[i].first;
+			unsigned v=states[u].next[i].second;
+			unsigned f=states[u].failure;
+			while (f && !get_next(f,opcode))
+				f=states[f].failure;
+			unsigned failure=get_next(f,opcode);
+			states[v].failure=(failure!=v) ? failure : 0;
+			states[v].dictionary=states[states[v].failure].outputs.empty() ? states[states[v].failure].dictionary : states[v].failure;
+			queue.push_back(v);
+		}
+	}
+}
+
+bool rule_matcher::operands_fit(const byte *target, size_t instructions, const s_program_instruction *window) const
+{
+	// operand bound to each slot, per kind
+	int bound[3][256];
+	byte used[3][256];
+	size_t used_count[3]={0,0,0};
+
+	for (size_t i=0;i<instructions;++i,target+=ENCODED_SIZE)
+	{
+		e_param_type type=(e_param_type)target[1];
+		byte value=target[2];
+		int kind;
+		switch (type)
+		{
+			case E_PARAM_NONE:
+				continue;
+			case E_PARAM_CONST_VALUE:
+				if (window[i].operand!=value)
+					return false;
+				continue;
+			case E_PARAM_CONST_SLOT:
+				kind=0;
+				break;
+			case E_PARAM_MEM_SLOT:
+				kind=1;
+				break;
+			case E_PARAM_ZP_SLOT:
+				kind=2;
+				break;
+			default:
+				return false;
+		}
+		size_t j;
+		for (j=0;j<used_count[kind];++j)
+		{
+			byte slot=used[kind][j];
+			if (slot==value)
+			{
+				if (bound[kind][slot]!=window[i].operand)
+					return false;
+				break;
+			}
+			// two slots of a kind are two different operands
+			if (bound[kind][slot]==window[i].operand)
+				return false;
+		}
+		if (j==used_count[kind])
+		{
+			used[kind][used_count[kind]++]=value;
+			bound[kind][value]=window[i].operand;
+		}
+	}
+	return true;
+}
+
+void rule_matcher::match(const std::vector <s_program_instruction> &program, const std::vector <byte_flags> &live, std::vector <s_rule_match> &matches) const
+{
+	matches.clear();
+	if (states.size()<2)
+		return;
+	unsigned state=0;
+	for (size_t i=0;i<program.size();++i)
+	{
+		byte opcode=program[i].opcode;
+		unsigned next;
+		while (!(next=get_next(state,opcode)) && state)
+			state=states[state].failure;
+		state=next;
+
+		for (unsigned s=states[state].outputs.empty() ? states[state].dictionary : state;s;s=states[s].dictionary)
+		{
+			size_t length=states[s].depth;
+			size_t start=i+1-length;
+			unsigned target_cost=0;
+			for (size_t k=start;k<=i;++k)
+				target_cost+=opcode_cost[program[k].opcode];
+			int target_score=get_objective_score(target_cost>0xffff ? 0xffff : (word)target_cost,objective);
+			byte_flags live_after=live.empty() ? ALL_LIVE : live[i];
+			for (size_t o=0;o<states[s].outputs.size();++o)
+			{
+				unsigned rule=states[s].outputs[o];
+				const s_rule_entry *entry=database->get_entry(rule);
+				word cost;
+				size_t size;
+				if (!database->get_replacement(entry,live_after,objective,cost,size))
+					continue;
+				if (!operands_fit(database->get_target(entry),length,&program[start]))
+					continue;
+				s_rule_match found;
+				found.start=start;
+				found.length=length;
+				found.rule=rule;
+				found.saving=target_score-(int)get_objective_score(cost,objective);
+				found.live=live_after;
+				matches.push_back(found);
+			}
+		}
+	}
+}
+
+void rule_matcher::choose(const std::vector <s_rule_match> &matches, size_t program_size, std::vector <s_rule_match> &chosen) const
+{
+	// best[i] is the highest saving in the first i instructions, taken[i] the match ending there
+	vector <long long> best(program_size+1,0);
+	vector <int> taken(program_size+1,-1);
+	size_t m=0;
+	for (size_t i=0;i<program_size;++i)
+	{
+		best[i+1]=best[i];
+		for (;m<matches.size() && matches[m].start+matches[m].length==i+1;++m)
+		{
+			if (matches[m].saving<=0)
+				continue;
+			long long with=best[matches[m].start]+matches[m].saving;
+			if (with>best[i+1])
+			{
+				best[i+1]=with;
+				taken[i+1]=(int)m;
+			}
+		}
+	}
+
+	chosen.clear();
+	for (size_t i=program_size;i>0;)
+	{
+		if (taken[i]<0)
+		{
+			--i;
+			continue;
+		}
+		chosen.push_back(matches[taken[i]]);
+		i=matches[taken[i]].start;
+	}
+	reverse(chosen.begin(),chosen.end());
+}
@@ -0,0 +1,56 @@
+#ifndef RULE_MATCHER_H
+#define RULE_MATCHER_H
+
+#include <vector>
+#include "types.hpp"
+#include "rule_database.hpp"
+
+// an instruction of a real program, the operand as it is in the code
+struct s_program_instruction {
+	byte opcode;
+	word operand;
+};
+
+struct s_rule_match {
+	size_t start; // instruction index in the program
+	size_t length; // instructions
+	size_t rule; // entry index in the database
+	int saving; // objective score of the target minus that of the replacement
+	byte_flags live; // outputs live after the window, selects the replacement
+};
+
+struct s_matcher_state {
+	std::vector < std::pair <byte, unsigned> > next; // sorted by opcode
+	unsigned failure;
+	std::vector <unsigned> outputs; // rules whose target ends here
+	unsigned dictionary; // nearest state by failure links with an output, 0 if none
+	byte depth;
+};
+
+// The targets of a rule database compiled into an Aho-Corasick automaton
+// over opcodes, so that one pass over a program finds every window that
+// some rule could replace. A window only matches if its operands fit the
+// rule's parameters: equal constants, and every slot bound to one operand
+// and no two slots of a kind to the same one.
+class rule_matcher {
+private:
+	const rule_database *database;
+	std::vector <s_matcher_state> states;
+	word opcode_cost[256];
+	s_objective objective;
+
+	unsigned get_next(unsigned state, byte opcode) const;
+	bool operands_fit(const byte *target, size_t instructions, const s_program_instruction *window) const;
+
+public:
+	rule_matcher();
+	void init(const rule_database &a_database, const s_objective &a_objective=OBJECTIVE_CYCLES);
+
+	// every window a rule fits, in order of their end; live[i] are the
+	// outputs live after instruction i, everything is live if it is empty
+	void match(const std::vector <s_program_instruction> &program, const std::vector <byte_flags> &live, std::vector <s_rule_match> &matches) const;
+	// the non overlapping matches with the highest total saving, in program order
+	void choose(const std::vector <s_rule_match> &matches, size_t program_size, std::vector <s_rule_match> &chosen) const;
+};
+
+#endif
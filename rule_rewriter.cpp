@@ -0,0 +1,128 @@
+#include <string.h>
+#include <vector>
+#include "rule_rewriter.h"
+#include "rule_database.hpp"
+#include "rule_matcher.hpp"
+
+using namespace std;
+
+struct _rule_rewriter {
+	rule_database database;
+	rule_matcher matcher;
+	s_objective objective;
+};
+
+static int slot_kind(e_param_type type)
+{
+	switch (type)
+	{
+		case E_PARAM_CONST_SLOT:
+			return 0;
+		case E_PARAM_MEM_SLOT:
+			return 1;
+		case E_PARAM_ZP_SLOT:
+			return 2;
+		default:
+			return -1;
+	}
+}
+
+rule_rewriter *rule_rewriter_open(const char *path, int objective)
+{
+	rule_rewriter *rewriter=new rule_rewriter;
+	if (!rewriter->database.open(path))
+	{
+		delete rewriter;
+		return NULL;
+	}
+	rewriter->objective=objective==REWRITER_SIZE ? OBJECTIVE_SIZE : OBJECTIVE_CYCLES;
+	rewriter->matcher.init(rewriter->database,rewriter->objective);
+	return rewriter;
+}
+
+void rule_rewriter_close(rule_rewriter *rewriter)
+{
+	delete rewriter;
+}
+
+int rule_rewriter_apply(rule_rewriter *rewriter, const rule_rewriter_instruction *program, const unsigned char *live, int count,
+	rule_rewriter_instruction *rewritten, int rewritten_max, rule_rewriter_span *spans, int *span_count)
+{
+	if (!rewriter || count<=0)
+		return -1;
+	vector <s_program_instruction> instructions(count);
+	vector <byte_flags> live_after(live,live+count);
+	for (int i=0;i<count;++i)
+	{
+		instructions[i].opcode=program[i].opcode;
+		instructions[i].operand=program[i].operand;
+	}
+	vector <s_rule_match> matches, chosen;
+	rewriter->matcher.match(instructions,live_after,matches);
+	rewriter->matcher.choose(matches,instructions.size(),chosen);
+	if (chosen.empty())
+		return -1;
+
+	int length=0;
+	size_t next=0;
+	vector <s_instruction> replacement;
+	for (size_t c=0;c<=chosen.size();++c)
+	{
+		// the instructions before the match are kept
+		size_t start=c<chosen.size() ? chosen[c].start : instructions.size();
+		for (;next<start;++next)
+		{
+			if (length==rewritten_max)
+				return -1;
+			rewritten[length++]=program[next];
+		}
+		if (c==chosen.size())
+			break;
+
+		const s_rule_match &match=chosen[c];
+		const s_rule_entry *entry=rewriter->database.get_entry(match.rule);
+		word cost;
+		size_t size;
+		const byte *bytes=rewriter->database.get_replacement(entry,match.live,rewriter->objective,cost,size);
+		if (!bytes)
+			return -1;
+		decode_sequence(bytes,size,replacement);
+		rule_rewriter_span &span=spans[c];
+		span.start=(int)match.start;
+		span.length=(int)match.length;
+		span.at=length;
+		span.count=(int)replacement.size();
+
+		// the operand of every slot of the target, then the replacement with them
+		int bound[3][256];
+		memset(bound,-1,sizeof(bound));
+		const byte *target=rewriter->database.get_target(entry);
+		for (size_t i=0;i<match.length;++i)
+		{
+			int kind=slot_kind((e_param_type)target[i*3+1]);
+			if (kind>=0)
+				bound[kind][target[i*3+2]]=program[match.start+i].operand;
+		}
+		for (size_t i=0;i<replacement.size();++i)
+		{
+			if (length==rewritten_max)
+				return -1;
+			const s_canonized_param &param=replacement[i].canonized_param;
+			rule_rewriter_instruction &instruction=rewritten[length++];
+			instruction.opcode=replacement[i].opcode;
+			instruction.operand=0;
+			int kind=slot_kind(param.type);
+			if (kind>=0)
+			{
+				if (bound[kind][param.value]<0)
+					return -1;
+				instruction.operand=(unsigned short)bound[kind][param.value];
+			}
+			else if (param.type==E_PARAM_CONST_VALUE)
+				instruction.operand=param.value;
+		}
+		next=match.start+match.length;
+	}
+	*span_count=(int)chosen.size();
+	return length;
+}
@@ -0,0 +1,56 @@
+#ifndef RULE_REWRITER_H
+#define RULE_REWRITER_H
+
+/* A C interface to the rule database for peephole optimizers written in C
+ * (txts/opt65.c).  A block of code is passed as opcodes and operand ids:
+ * equal ids are the same operand and different ids different ones.  An
+ * immediate operand whose value is known is passed as the value itself
+ * (0..255), every other operand as an id of 0x100 or more, so that rules
+ * with constants only match known values.
+ *
+ * live[i] are the outputs live after instruction i, D_A, D_X, D_Y, D_S
+ * and D_P as in types.hpp.  Memory is always taken as live.
+ *
+ * The rules are only valid in binary mode, like the emulator that found
+ * them.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+	unsigned char opcode;
+	unsigned short operand;
+} rule_rewriter_instruction;
+
+/* a run of the program replaced by a rule: length instructions from start,
+ * by count instructions of the rewritten program from at */
+typedef struct {
+	int start, length;
+	int at, count;
+} rule_rewriter_span;
+
+#define REWRITER_CYCLES 0
+#define REWRITER_SIZE 1
+
+typedef struct _rule_rewriter rule_rewriter;
+
+extern rule_rewriter *rule_rewriter_open(const char *path, int objective);
+extern void rule_rewriter_close(rule_rewriter *rewriter);
+
+/* Rewrites the program with the best set of non overlapping rules.
+ * Returns the length of the rewritten program, or -1 if no rule saves
+ * anything or it is longer than rewritten_max.  A replacement's operands
+ * are those its target was matched with, or the value of a constant.
+ * The runs replaced are put in spans, in program order, and their number
+ * in span_count; spans needs room for count of them.  Everything outside
+ * the spans is copied from the program unchanged. */
+extern int rule_rewriter_apply(rule_rewriter *rewriter, const rule_rewriter_instruction *program, const unsigned char *live, int count,
+	rule_rewriter_instruction *rewritten, int rewritten_max, rule_rewriter_span *spans, int *span_count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -25,6 +25,19 @@
 #include <stdarg.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* image loading and snapshots use mmap(2) and batch mode uses POSIX
+ * threads, so unlike lib6502 itself this shell needs a POSIX system */
+
+#if defined(_WIN32) && !defined(__CYGWIN__)
+# error "run6502 requires mmap(2) and POSIX threads"
+#endif
 
 #include "config.h"
 #include "lib6502.h"
@@ -247,22 +260,30 @@ static void usage(int status)
   fprintf(stream, "usage: %s [option ...]\n", program);
   fprintf(stream, "       %s [option ...] -B [image ...]\n", program);
   fprintf(stream, "  -B                -- minimal Acorn 'BBC Model B' compatibility\n");
+  fprintf(stream, "  -b manifest       -- run every program in manifest in parallel, then exit\n");
+  fprintf(stream, "  -c cycles         -- terminate emulation after cycles (decimal) clock cycles\n");
   fprintf(stream, "  -d addr last      -- dump memory between addr and last\n");
   fprintf(stream, "  -G addr           -- emulate getchar(3) at addr\n");
   fprintf(stream, "  -h                -- help (print this message)\n");
   fprintf(stream, "  -I addr           -- set IRQ vector\n");
+  fprintf(stream, "  -j count          -- number of threads for -b (default: one per cpu)\n");
   fprintf(stream, "  -l addr file      -- load file at addr\n");
   fprintf(stream, "  -M addr           -- emulate memory-mapped stdio at addr\n");
   fprintf(stream, "  -N addr           -- set NMI vector\n");
+  fprintf(stream, "  -p count          -- profile, reporting the count hottest insns on exit\n");
   fprintf(stream, "  -P addr           -- emulate putchar(3) at addr\n");
+  fprintf(stream, "  -r file           -- restore registers and memory from snapshot file\n");
   fprintf(stream, "  -R addr           -- set RST vector\n");
   fprintf(stream, "  -s addr last file -- save memory from addr to last in file\n");
+  fprintf(stream, "  -S file           -- save a snapshot of registers and memory in file on exit\n");
+  fprintf(stream, "  -t file           -- write an execution trace to file\n");
   fprintf(stream, "  -v                -- print version number then exit\n");
   fprintf(stream, "  -X addr           -- terminate emulation if PC reaches addr\n");
   fprintf(stream, "  -x                -- exit wihout further ado\n");
   fprintf(stream, "  image             -- '-l 8000 image' in available ROM slot\n");
   fprintf(stream, "\n");
   fprintf(stream, "'last' can be an address (non-inclusive) or '+size' (in bytes)\n");
+  fprintf(stream, "-r must precede the options that write memory (-i, -l, -I, -N, -R, image)\n");
   exit(status);
 }
 
@@ -329,11 +350,45 @@ static int save(M6502 *mpu, word address, unsigned length, const char *path)
 }
 
 
+/* map the regular file at path privately (copy-on-write), answering its
+ * address and setting size, or 0 with errno set.  an empty file maps to
+ * the address of a static dummy. */
+
+static void *mapFile(const char *path, size_t *size, int prot)
+{
+  static byte  empty;
+  struct stat  st;
+  void	      *map;
+  int	       fd= open(path, O_RDONLY);
+  if (fd < 0)
+    return 0;
+  if ((fstat(fd, &st) < 0) || !S_ISREG(st.st_mode))
+    {
+      close(fd);
+      errno= EINVAL;
+      return 0;
+    }
+  *size= st.st_size;
+  map= *size ? mmap(0, *size, prot, MAP_PRIVATE, fd, 0) : &empty;
+  close(fd);
+  return (MAP_FAILED == map) ? 0 : map;
+}
+
+
 static int load(M6502 *mpu, word address, const char *path)
 {
   FILE  *file= 0;
   int    count= 0;
   size_t max= 0x10000 - address;
+  size_t size= 0;
+  byte  *map= mapFile(path, &size, PROT_READ);
+  if (map)
+    {
+      memcpy(mpu->memory + address, map, (size < max) ? size : max);
+      if (size) munmap(map, size);
+      return 1;
+    }
+  /* not a regular file: read it */
   if (!(file= fopen(path, "r")))
     return 0;
   while ((count= fread(mpu->memory + address, 1, max, file)) > 0)
@@ -346,10 +401,102 @@ static int load(M6502 *mpu, word address, const char *path)
 }
 
 
+/* a snapshot is a header (magic, registers, cycle count) padded to 64K
+ * followed by the 64K of memory, so that the memory can be mapped in place
+ * on any page size.  restoring a snapshot maps it copy-on-write: processes
+ * forked from the same snapshot share every page they do not write. */
+
+static const char snapshotMagic[8]= { '6', '5', '0', '2', 'S', 'N', 'P', 1 };
+
+enum { snapshotHeader= 0x10000,  snapshotSize= 0x20000 };
+
+/* the snapshot is written beside path and renamed over it, since memory
+ * may be a mapping of the very file being replaced */
+
+static int saveSnapshot(M6502 *mpu, const char *path)
+{
+  M6502_Registers *r= mpu->registers;
+  byte		   header[32];
+  FILE		  *file= 0;
+  char		  *temp= 0;
+  int		   i, ok;
+
+  memset(header, 0, sizeof(header));
+  memcpy(header, snapshotMagic, sizeof(snapshotMagic));
+  header[ 8]= r->a;
+  header[ 9]= r->x;
+  header[10]= r->y;
+  header[11]= r->p;
+  header[12]= r->s;
+  header[13]= r->pc & 0xff;
+  header[14]= r->pc >> 8;
+  for (i= 0;  i < 8;  ++i)
+    header[16 + i]= (byte)(mpu->ticks >> (8 * i));
+
+  if (!(temp= malloc(strlen(path) + 5)))
+    return 0;
+  sprintf(temp, "%s.new", path);
+  if (!(file= fopen(temp, "wb")))
+    {
+      free(temp);
+      return 0;
+    }
+  ok= (1 == fwrite(header, sizeof(header), 1, file))
+    && !fseek(file, snapshotHeader, SEEK_SET)
+    && (1 == fwrite(mpu->memory, 0x10000, 1, file));
+  ok= (0 == fclose(file)) && ok && (0 == rename(temp, path));
+  if (!ok) unlink(temp);
+  free(temp);
+  return ok;
+}
+
+
+static int restoreSnapshot(M6502 *mpu, const char *path)
+{
+  M6502_Registers *r= mpu->registers;
+  byte		  *map;
+  size_t	   size= 0;
+  int		   i;
+
+  if (!(map= mapFile(path, &size, PROT_READ | PROT_WRITE)))
+    return 0;
+  if ((size != snapshotSize) || memcmp(map, snapshotMagic, sizeof(snapshotMagic)))
+    {
+      if (size) munmap(map, size);
+      fail("%s: not a snapshot", path);
+    }
+  r->a=  map[ 8];
+  r->x=  map[ 9];
+  r->y=  map[10];
+  r->p=  map[11];
+  r->s=  map[12];
+  r->pc= map[13] | (map[14] << 8);
+  mpu->ticks= 0;
+  for (i= 0;  i < 8;  ++i)
+    mpu->ticks |= (uint64_t)map[16 + i] << (8 * i);
+
+  /* the header page is never touched again */
+  munmap(map, snapshotHeader);
+  if (mpu->flags & M6502_MemoryAllocated)
+    {
+      free(mpu->memory);
+      mpu->flags &= ~M6502_MemoryAllocated;
+    }
+  mpu->memory= map + snapshotHeader;
+  return 1;
+}
+
+
+/* -r replaces memory wholesale, so it must come before anything that
+ * writes to memory */
+
+static int memoryChanged= 0;
+
 static int doLoadInterpreter(int argc, char **argv, M6502 *mpu)
 {
   if (argc < 3) usage(1);
   if (!loadInterpreter(mpu, htol(argv[1]), argv[2])) pfail(argv[2]);
+  memoryChanged= 1;
   return 2;
 }
 
@@ -358,6 +505,7 @@ static int doLoad(int argc, char **argv, M6502 *mpu)	/* -l addr file */
 {
   if (argc < 3) usage(1);
   if (!load(mpu, htol(argv[1]), argv[2])) pfail(argv[2]);
+  memoryChanged= 1;
   return 2;
 }
 
@@ -370,6 +518,38 @@ static int doSave(int argc, char **argv, M6502 *mpu)	/* -l addr size file */
 }
 
 
+static int restored= 0;
+
+static int doRestore(int argc, char **argv, M6502 *mpu)	/* -r file */
+{
+  if (argc < 2) usage(1);
+  if (memoryChanged) fail("-r must come before -i, -l, -I, -N, -R and images");
+  if (!restoreSnapshot(mpu, argv[1])) pfail(argv[1]);
+  restored= 1;
+  return 1;
+}
+
+
+static M6502 *snapshot= 0;
+static char  *snapshotPath= 0;
+
+static void endSnapshot(void)
+{
+  if (!snapshot) return;
+  if (!saveSnapshot(snapshot, snapshotPath)) pfail(snapshotPath);
+  snapshot= 0;
+}
+
+static int doSnapshot(int argc, char **argv, M6502 *mpu)	/* -S file */
+{
+  if (argc < 2) usage(1);
+  if (!snapshot) atexit(endSnapshot);
+  snapshot= mpu;
+  snapshotPath= argv[1];
+  return 1;
+}
+
+
 #define doVEC(VEC)					\
   static int do##VEC(int argc, char **argv, M6502 *mpu)	\
     {							\
@@ -377,6 +557,7 @@ static int doSave(int argc, char **argv, M6502 *mpu)	/* -l addr size file */
       if (argc < 2) usage(1);				\
       addr= htol(argv[1]);				\
       M6502_setVector(mpu, VEC, addr);			\
+      memoryChanged= 1;					\
       return 1;						\
     }
 
@@ -435,6 +616,286 @@ static int doXtrap(int argc, char **argv, M6502 *mpu)
 }
 
 
+static M6502 *profiled= 0;
+static int    hotspots= 0;
+
+static void report(void)
+{
+  if (!profiled) return;
+  fflush(stdout);
+  M6502_report(profiled, stderr, hotspots);
+  profiled= 0;
+}
+
+static int doProfile(int argc, char **argv, M6502 *mpu)
+{
+  if (argc < 2) usage(1);
+  hotspots= strtol(argv[1], 0, 10);
+  M6502_profile(mpu, 1);
+  atexit(report);
+  profiled= mpu;
+  return 1;
+}
+
+
+static M6502 *traced= 0;
+
+static void endTrace(void)
+{
+  if (!traced) return;
+  M6502_trace(traced, 0);
+  traced= 0;
+}
+
+static int doTrace(int argc, char **argv, M6502 *mpu)
+{
+  FILE *stream;
+  if (argc < 2) usage(1);
+  if (!(stream= fopen(argv[1], "wb"))) pfail(argv[1]);
+  M6502_trace(mpu, stream);
+  atexit(endTrace);
+  traced= mpu;
+  return 1;
+}
+
+
+static uint64_t cycles= M6502_unlimited;
+
+static int doCycles(int argc, char **argv, M6502 *mpu)
+{
+  char *end;
+  if (argc < 2) usage(1);
+  cycles= strtoull(argv[1], &end, 10);
+  if (*end) fail("bad cycle count: %s", argv[1]);
+  return 1;
+}
+
+
+/* batch mode: run every program in a manifest on a pool of threads, one
+ * emulator instance per thread, and print a table of results.  each
+ * manifest line is
+ *
+ *   image load-addr entry cycles expected [trap ...]
+ *
+ * where expected is a file holding the output the program should
+ * produce (or '-' to accept any) and each trap is P=addr (putchar),
+ * G=addr (getchar, always EOF), M=addr (memory-mapped stdio) or X=addr
+ * (terminate).  blank lines and lines starting with '#' are ignored. */
+
+typedef struct
+{
+  char	   *image, *expected;
+  unsigned  load, entry;
+  uint64_t  cycles;
+  unsigned  traps[4][8];		/* addresses of P, G, M and X traps */
+  int	    ntraps[4];
+  /* results */
+  char	   *output;
+  size_t    size, capacity;
+  int	    exited, illegal, failed;
+  uint64_t  ticks;
+  char	    dump[64];
+} job;
+
+enum { trapP, trapG, trapM, trapX };
+
+static job		*jobs= 0;
+static int		 njobs= 0;
+static int		 nextJob= 0;
+static pthread_mutex_t	 jobLock= PTHREAD_MUTEX_INITIALIZER;
+static int		 threads= 0;
+
+
+static int jobPutchar(job *j, int c)
+{
+  if (j->size == j->capacity)
+    {
+      j->capacity= j->capacity ? 2 * j->capacity : 256;
+      if (!(j->output= realloc(j->output, j->capacity))) fail("out of memory");
+    }
+  j->output[j->size++]= c;
+  return c;
+}
+
+static int bgTrap(M6502 *mpu, word addr, byte data)	{ mpu->registers->a= 0xff;  rts; }
+static int bpTrap(M6502 *mpu, word addr, byte data)	{ jobPutchar(mpu->context, mpu->registers->a);  rts; }
+static int bmTrapRead(M6502 *mpu, word addr, byte data)	{ return 0xff; }
+static int bmTrapWrite(M6502 *mpu, word addr, byte data) { return jobPutchar(mpu->context, data); }
+
+static int bxTrap(M6502 *mpu, word addr, byte data)
+{
+  ((job *)mpu->context)->exited= 1;
+  M6502_stop(mpu);
+  return 0;
+}
+
+
+static void setTraps(M6502 *mpu, job *j, int on)
+{
+  int i;
+  for (i= 0;  i < j->ntraps[trapP];  ++i)  M6502_setCallback(mpu, call,  j->traps[trapP][i], on ? bpTrap : 0);
+  for (i= 0;  i < j->ntraps[trapG];  ++i)  M6502_setCallback(mpu, call,  j->traps[trapG][i], on ? bgTrap : 0);
+  for (i= 0;  i < j->ntraps[trapX];  ++i)  M6502_setCallback(mpu, call,  j->traps[trapX][i], on ? bxTrap : 0);
+  for (i= 0;  i < j->ntraps[trapM];  ++i)
+    {
+      M6502_setCallback(mpu, read,  j->traps[trapM][i], on ? bmTrapRead  : 0);
+      M6502_setCallback(mpu, write, j->traps[trapM][i], on ? bmTrapWrite : 0);
+    }
+}
+
+
+/* the instance is reused: callbacks are removed after each job */
+
+static void runJob(M6502 *mpu, job *j)
+{
+  memset(mpu->registers, 0, sizeof(M6502_Registers));
+  memset(mpu->memory,    0, sizeof(M6502_Memory));
+  mpu->ticks=   0;
+  mpu->context= j;
+
+  if (!load(mpu, j->load, j->image))
+    {
+      snprintf(j->dump, sizeof(j->dump), "%s", strerror(errno));
+      j->failed= 1;
+      return;
+    }
+  setTraps(mpu, j, 1);
+  M6502_setVector(mpu, RST, j->entry);
+  M6502_reset(mpu);
+
+  j->ticks= M6502_runFor(mpu, j->cycles);
+  M6502_dump(mpu, j->dump);
+  /* the only other way to stop short of the limit */
+  if (!j->exited && (j->ticks < j->cycles))
+    j->illegal= j->failed= 1;
+  setTraps(mpu, j, 0);
+}
+
+
+static void checkJob(job *j)
+{
+  byte	*map;
+  size_t size= 0;
+
+  if (j->failed || !strcmp(j->expected, "-"))
+    return;
+  if (!(map= mapFile(j->expected, &size, PROT_READ)))
+    {
+      j->failed= 1;
+      return;
+    }
+  j->failed= (size != j->size) || memcmp(map, j->output, size);
+  if (size) munmap(map, size);
+}
+
+
+static void *worker(void *arg)
+{
+  M6502 *mpu= M6502_new(0, 0, 0);
+  mpu->flags |= M6502_Quiet;	/* illegal insns are reported in the table */
+  for (;;)
+    {
+      job *j;
+      pthread_mutex_lock(&jobLock);
+      j= (nextJob < njobs) ? &jobs[nextJob++] : 0;
+      pthread_mutex_unlock(&jobLock);
+      if (!j) break;
+      runJob(mpu, j);
+      checkJob(j);
+    }
+  M6502_delete(mpu);
+  return 0;
+}
+
+
+static void parseManifest(const char *path)
+{
+  static const char fields[]= "PGMX";	/* in trap order */
+  FILE *file= fopen(path, "r");
+  char  line[1024];
+  int   lineno= 0;
+
+  if (!file) pfail(path);
+  while (fgets(line, sizeof(line), file))
+    {
+      char *field[6 + 32];
+      int   n= 0, i;
+      job  *j;
+      ++lineno;
+      for (field[n]= strtok(line, " \t\r\n");  field[n] && (n < 6 + 31);  field[++n]= strtok(0, " \t\r\n"))
+	;
+      if (!n || ('#' == *field[0]))
+	continue;
+      if (n < 5) fail("%s:%d: expected: image load-addr entry cycles expected [trap ...]", path, lineno);
+      if (!(jobs= realloc(jobs, sizeof(job) * (njobs + 1)))) fail("out of memory");
+      j= memset(&jobs[njobs++], 0, sizeof(job));
+      j->image=    strdup(field[0]);
+      j->load=     htol(field[1]);
+      j->entry=    htol(field[2]);
+      j->cycles=   strtoull(field[3], 0, 10);
+      j->expected= strdup(field[4]);
+      for (i= 5;  i < n;  ++i)
+	{
+	  const char *p= strchr(fields, field[i][0]);
+	  int	      t= p ? p - fields : -1;
+	  if ((t < 0) || ('=' != field[i][1]) || (j->ntraps[t] == 8))
+	    fail("%s:%d: bad trap: %s", path, lineno, field[i]);
+	  j->traps[t][j->ntraps[t]++]= htol(field[i] + 2);
+	}
+    }
+  fclose(file);
+}
+
+
+static int doThreads(int argc, char **argv, M6502 *mpu)	/* -j count */
+{
+  if (argc < 2) usage(1);
+  threads= strtol(argv[1], 0, 10);
+  return 1;
+}
+
+
+/* the batch runs once every option has been parsed, so that -j may come
+ * after -b */
+
+static char *manifest= 0;
+
+static int doBatch(int argc, char **argv, M6502 *mpu)	/* -b manifest */
+{
+  if (argc < 2) usage(1);
+  manifest= argv[1];
+  return 1;
+}
+
+
+static void runBatch(const char *path)
+{
+  pthread_t *tids;
+  int	     i, nthreads= threads, failures= 0;
+
+  parseManifest(path);
+  if (nthreads <= 0) nthreads= sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads > njobs) nthreads= njobs;
+  if (nthreads < 1) nthreads= 1;
+  if (!(tids= calloc(nthreads, sizeof(pthread_t)))) fail("out of memory");
+  for (i= 0;  i < nthreads;  ++i)
+    if (pthread_create(&tids[i], 0, worker, 0)) fail("cannot create thread");
+  for (i= 0;  i < nthreads;  ++i)
+    pthread_join(tids[i], 0);
+
+  for (i= 0;  i < njobs;  ++i)
+    {
+      job *j= &jobs[i];
+      printf("%-4s %-7s %14llu  %s  %s\n",
+	     j->failed ? "FAIL" : "ok", j->exited ? "exit" : j->illegal ? "illegal" : "timeout",
+	     (unsigned long long)j->ticks, j->image, j->dump);
+      failures += j->failed;
+    }
+  printf("%d of %d failed\n", failures, njobs);
+  exit(failures ? 1 : 0);
+}
+
+
 static int doDisassemble(int argc, char **argv, M6502 *mpu)
 {
   unsigned addr= 0, last= 0;
@@ -477,17 +938,24 @@ int main(int argc, char **argv)
       {
 	int n= 0;
 	if      (!strcmp(*argv, "-B"))  bTraps= 1;
+	else if (!strcmp(*argv, "-b"))	n= doBatch(argc, argv, mpu);
+	else if (!strcmp(*argv, "-c"))	n= doCycles(argc, argv, mpu);
 	else if (!strcmp(*argv, "-d"))	n= doDisassemble(argc, argv, mpu);
 	else if (!strcmp(*argv, "-G"))	n= doGtrap(argc, argv, mpu);
 	else if (!strcmp(*argv, "-h"))	n= doHelp(argc, argv, mpu);
 	else if (!strcmp(*argv, "-i"))	n= doLoadInterpreter(argc, argv, mpu);
 	else if (!strcmp(*argv, "-I"))	n= doIRQ(argc, argv, mpu);
+	else if (!strcmp(*argv, "-j"))	n= doThreads(argc, argv, mpu);
 	else if (!strcmp(*argv, "-l"))	n= doLoad(argc, argv, mpu);
 	else if (!strcmp(*argv, "-M"))	n= doMtrap(argc, argv, mpu);
 	else if (!strcmp(*argv, "-N"))	n= doNMI(argc, argv, mpu);
+	else if (!strcmp(*argv, "-p"))	n= doProfile(argc, argv, mpu);
 	else if (!strcmp(*argv, "-P"))	n= doPtrap(argc, argv, mpu);
+	else if (!strcmp(*argv, "-r"))	n= doRestore(argc, argv, mpu);
 	else if (!strcmp(*argv, "-R"))	n= doRST(argc, argv, mpu);
 	else if (!strcmp(*argv, "-s"))	n= doSave(argc, argv, mpu);
+	else if (!strcmp(*argv, "-S"))	n= doSnapshot(argc, argv, mpu);
+	else if (!strcmp(*argv, "-t"))	n= doTrace(argc, argv, mpu);
 	else if (!strcmp(*argv, "-v"))	n= doVersion(argc, argv, mpu);
 	else if (!strcmp(*argv, "-X"))	n= doXtrap(argc, argv, mpu);
 	else if (!strcmp(*argv, "-x"))	exit(0);
@@ -500,6 +968,7 @@ int main(int argc, char **argv)
 	    if (!bTraps)			usage(1);
 	    if (bankSel < 0)			fail("too many images");
 	    if (!load(mpu, 0x8000, argv[0]))	pfail(argv[0]);
+	    memoryChanged= 1;
 	    memcpy(bank[bankSel--],
 		   0x8000 + mpu->memory,
 		   0x4000);
@@ -509,11 +978,20 @@ int main(int argc, char **argv)
 	argv += n;
       }
 
+  if (manifest)
+    runBatch(manifest);
+
   if (bTraps)
     doBtraps(0, 0, mpu);
 
-  M6502_reset(mpu);
+  if (!restored)
+    M6502_reset(mpu);
+  if (cycles != M6502_unlimited)
+    mpu->limit= mpu->ticks + cycles;
   M6502_run(mpu);
+  report();
+  endTrace();
+  endSnapshot();
   M6502_delete(mpu);
 
   return 0;
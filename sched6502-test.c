@@ -0,0 +1,150 @@
+/* sched6502-test.c -- check the cooperative scheduler	-*- C -*- */
+
+/* A ring of 1000 mpus passes a token (incremented at every hop) from each
+ * to the next, and one more mpu does nothing but send, as fast as it can,
+ * into a queue that never fills.  Build and run with
+ *
+ *   cc -o sched6502-test sched6502-test.c sched6502.c lib6502.c -lpthread
+ *   ./sched6502-test
+ *
+ * which prints "ok" and exits 0, or says what went wrong and exits 1.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lib6502.h"
+#include "sched6502.h"
+
+typedef uint8_t  byte;
+typedef uint16_t word;
+
+enum {
+  ringSize= 1000,  threads= 4,  slice= 1000,  slices= 100,
+  inPort= 0xf000,  outPort= 0xf002,  counter= 0x0010,  start= 0x1000
+};
+
+/* wait for the token, count it, pass it on incremented */
+
+static const byte ringCode[]= {
+  0x2c, 0x01, 0xf0,	/* wait:	bit inPort+1	*/
+  0x10, 0xfb,		/*		bpl wait	*/
+  0xad, 0x00, 0xf0,	/*		lda inPort	*/
+  0xee, 0x10, 0x00,	/*		inc counter	*/
+  0x18,			/*		clc		*/
+  0x69, 0x01,		/*		adc #1		*/
+  0x2c, 0x03, 0xf0,	/* send:	bit outPort+1	*/
+  0x50, 0xfb,		/*		bvc send	*/
+  0x8d, 0x02, 0xf0,	/*		sta outPort	*/
+  0x4c, 0x00, 0x10	/*		jmp wait	*/
+};
+
+/* send 0, 1, 2, ... whenever there is room */
+
+static const byte sendCode[]= {
+  0x2c, 0x03, 0xf0,	/* send:	bit outPort+1	*/
+  0x50, 0xfb,		/*		bvc send	*/
+  0x8e, 0x02, 0xf0,	/*		stx outPort	*/
+  0xe8,			/*		inx		*/
+  0x4c, 0x00, 0x10	/*		jmp send	*/
+};
+
+static int failures= 0;
+
+static void check(int ok, const char *what)
+{
+  if (!ok)
+    {
+      fprintf(stderr, "sched6502-test: %s\n", what);
+      ++failures;
+    }
+}
+
+
+static M6502 *newMPU(M6502_Callbacks *callbacks, const byte *code, size_t size)
+{
+  M6502 *mpu= M6502_new(0, 0, callbacks);
+  memcpy(mpu->memory + start, code, size);
+  mpu->registers->pc= start;
+  mpu->registers->s=  0xff;
+  return mpu;
+}
+
+
+int main(void)
+{
+  static M6502_Callbacks  callbacks;	/* every mpu maps the same addresses */
+  M6502_Scheduler	 *sched= M6502_schedulerNew(threads, slice);
+  M6502			 *ring[ringSize], *sender;
+  M6502_Queue		 *queues[ringSize], *sink;
+  unsigned		  hops= 0, queued= 0, sent;
+  int			  token= -1, c, i;
+
+  for (i= 0;  i < ringSize;  ++i)
+    {
+      queues[i]= M6502_queueNew(16);
+      ring[i]= newMPU(&callbacks, ringCode, sizeof(ringCode));
+      M6502_schedulerAdd(sched, ring[i]);
+    }
+  for (i= 0;  i < ringSize;  ++i)
+    {
+      M6502_schedulerMap(sched, ring[i], inPort,  queues[i], 0);
+      M6502_schedulerMap(sched, ring[i], outPort, 0, queues[(i + 1) % ringSize]);
+    }
+  sink= M6502_queueNew(1 << 20);
+  sender= newMPU(&callbacks, sendCode, sizeof(sendCode));
+  M6502_schedulerAdd(sched, sender);
+  M6502_schedulerMap(sched, sender, outPort, 0, sink);
+
+  M6502_queuePut(queues[0], 0);
+  check(M6502_schedulerRun(sched, (uint64_t)slice * slices) == (uint64_t)slice * slices, "run ended early");
+
+  /* the token has been round in order, at least one hop per slice, and is
+   * in exactly one queue with the value of the number of hops so far */
+
+  for (i= 0;  i < ringSize;  ++i)
+    {
+      byte count= ring[i]->memory[counter];
+      check(!M6502_schedulerHalted(sched, ring[i]), "ring mpu halted");
+      check((i == 0) || (count <= ring[i - 1]->memory[counter]), "token passed out of order");
+      check(count + 1 >= ring[0]->memory[counter], "token lapped an mpu");
+      hops += count;
+      while ((c= M6502_queueGet(queues[i])) >= 0)
+	{
+	  token= c;
+	  ++queued;
+	}
+    }
+  check(queued == 1, "not exactly one token in the ring");
+  check(hops >= slices, "token moved less than one hop per slice");
+  check(token == (byte)hops, "token value does not match hop count");
+
+  /* an output-only port never makes the sender wait while there is room,
+   * so it sends once every 15 cycles or so, not once a slice */
+
+  sent= M6502_queueCount(sink);
+  check(sent >= (unsigned)slice * slices / 20, "sender yielded with room to send");
+  for (i= 0;  (unsigned)i < sent;  ++i)
+    if (M6502_queueGet(sink) != (i & 0xff))
+      {
+	check(0, "sender output out of order");
+	break;
+      }
+
+  printf("%u hops, %u bytes sent\n", hops, sent);
+
+  M6502_schedulerDelete(sched);
+  for (i= 0;  i < ringSize;  ++i)
+    {
+      M6502_delete(ring[i]);
+      M6502_queueDelete(queues[i]);
+    }
+  M6502_delete(sender);
+  M6502_queueDelete(sink);
+
+  if (failures)
+    return 1;
+  printf("ok\n");
+  return 0;
+}
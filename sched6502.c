@@ -0,0 +1,332 @@
+/* sched6502.c -- cooperative scheduling of many 6502s	-*- C -*- */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "sched6502.h"
+
+typedef uint8_t  byte;
+typedef uint16_t word;
+
+struct _M6502_Queue
+{
+  pthread_mutex_t lock;
+  byte		 *data;
+  unsigned	  capacity, head, count;
+};
+
+typedef struct
+{
+  word	       addr;
+  M6502_Queue *in, *out;
+} port;
+
+typedef struct
+{
+  M6502	 *mpu;
+  port	 *ports;
+  int	  nports;
+  int	  waiting;		/* yielded the rest of its slice */
+  int	  halted;
+} node;
+
+struct _M6502_Scheduler
+{
+  node		  *nodes;
+  int		   nnodes;
+  uint64_t	   slice;
+  uint64_t	   now;		/* end of the current slice */
+  int		   nthreads;
+  pthread_t	  *threads;
+  pthread_mutex_t  lock;
+  pthread_cond_t   start, finish;
+  int		   next;	/* next node to run this round */
+  int		   done;	/* nodes finished this round */
+  int		   round;	/* incremented to start a round */
+  int		   quit;
+};
+
+
+static void outOfMemory(void)
+{
+  fflush(stdout);
+  fprintf(stderr, "\nout of memory\n");
+  abort();
+}
+
+
+M6502_Queue *M6502_queueNew(unsigned capacity)
+{
+  M6502_Queue *queue= calloc(1, sizeof(M6502_Queue));
+  if (!queue || !(queue->data= malloc(capacity))) outOfMemory();
+  queue->capacity= capacity;
+  pthread_mutex_init(&queue->lock, 0);
+  return queue;
+}
+
+
+/* answer 0 if the queue is full */
+
+int M6502_queuePut(M6502_Queue *queue, uint8_t data)
+{
+  int ok;
+  pthread_mutex_lock(&queue->lock);
+  if ((ok= (queue->count < queue->capacity)))
+    queue->data[(queue->head + queue->count++) % queue->capacity]= data;
+  pthread_mutex_unlock(&queue->lock);
+  return ok;
+}
+
+
+/* answer -1 if the queue is empty */
+
+int M6502_queueGet(M6502_Queue *queue)
+{
+  int data= -1;
+  pthread_mutex_lock(&queue->lock);
+  if (queue->count)
+    {
+      data= queue->data[queue->head];
+      queue->head= (queue->head + 1) % queue->capacity;
+      --queue->count;
+    }
+  pthread_mutex_unlock(&queue->lock);
+  return data;
+}
+
+
+unsigned M6502_queueCount(M6502_Queue *queue)
+{
+  unsigned count;
+  pthread_mutex_lock(&queue->lock);
+  count= queue->count;
+  pthread_mutex_unlock(&queue->lock);
+  return count;
+}
+
+
+void M6502_queueDelete(M6502_Queue *queue)
+{
+  pthread_mutex_destroy(&queue->lock);
+  free(queue->data);
+  free(queue);
+}
+
+
+/* mapped queue registers */
+
+static port *findPort(M6502 *mpu, word addr)
+{
+  node *n= mpu->context;
+  int	i;
+  for (i= 0;  i < n->nports;  ++i)
+    if ((n->ports[i].addr == addr) || (n->ports[i].addr + 1 == addr))
+      return &n->ports[i];
+  return 0;
+}
+
+/* a status read yields when the port cannot do what it is there for: an
+ * output queue is full, or an input queue is empty with no room to send
+ * either.  a port with both queues that is polling for input while it
+ * can still send cannot be told from one about to send, so it keeps
+ * running. */
+
+static int portRead(M6502 *mpu, word addr, byte data)
+{
+  port *p= findPort(mpu, addr);
+  int	c, status= 0;
+  (void)data;
+  if (addr == p->addr)
+    return ((c= p->in ? M6502_queueGet(p->in) : -1) < 0) ? 0 : c;
+  if (p->in  && M6502_queueCount(p->in))			    status |= 0x80;
+  if (p->out && (M6502_queueCount(p->out) < p->out->capacity)) status |= 0x40;
+  if ((p->in && !(status & 0xc0)) || (p->out && !(status & 0x40)))
+    {
+      /* waiting: give up the rest of the slice */
+      ((node *)mpu->context)->waiting= 1;
+      M6502_stop(mpu);
+    }
+  return status;
+}
+
+static int portWrite(M6502 *mpu, word addr, byte data)
+{
+  port *p= findPort(mpu, addr);
+  if ((addr == p->addr) && p->out)
+    M6502_queuePut(p->out, data);
+  return 0;
+}
+
+
+/* run every node that is not halted for one slice */
+
+static void runNode(M6502_Scheduler *sched, node *n)
+{
+  if (n->halted)
+    return;
+  n->waiting= 0;
+  if (n->mpu->ticks < sched->now)
+    M6502_runFor(n->mpu, sched->now - n->mpu->ticks);
+  if (n->mpu->ticks >= sched->now)
+    return;
+  if (n->waiting)
+    n->mpu->ticks= sched->now;	/* idle until the next slice */
+  else
+    n->halted= 1;
+}
+
+static void *worker(void *arg)
+{
+  M6502_Scheduler *sched= arg;
+  int		   round= 0;
+
+  pthread_mutex_lock(&sched->lock);
+  for (;;)
+    {
+      while (!sched->quit && (sched->round == round))
+	pthread_cond_wait(&sched->start, &sched->lock);
+      if (sched->quit)
+	break;
+      round= sched->round;
+      while (sched->next < sched->nnodes)
+	{
+	  node *n= &sched->nodes[sched->next++];
+	  pthread_mutex_unlock(&sched->lock);
+	  runNode(sched, n);
+	  pthread_mutex_lock(&sched->lock);
+	  if (++sched->done == sched->nnodes)
+	    pthread_cond_signal(&sched->finish);
+	}
+    }
+  pthread_mutex_unlock(&sched->lock);
+  return 0;
+}
+
+
+M6502_Scheduler *M6502_schedulerNew(int threads, uint64_t slice)
+{
+  M6502_Scheduler *sched= calloc(1, sizeof(M6502_Scheduler));
+  int		   i;
+
+  if (!sched) outOfMemory();
+  if (threads < 1) threads= 1;
+  sched->slice= slice;
+  sched->nthreads= threads;
+  pthread_mutex_init(&sched->lock, 0);
+  pthread_cond_init(&sched->start, 0);
+  pthread_cond_init(&sched->finish, 0);
+  if (!(sched->threads= calloc(threads, sizeof(pthread_t)))) outOfMemory();
+  for (i= 0;  i < threads;  ++i)
+    if (pthread_create(&sched->threads[i], 0, worker, sched))
+      {
+	fprintf(stderr, "\ncannot create thread\n");
+	abort();
+      }
+  return sched;
+}
+
+
+void M6502_schedulerAdd(M6502_Scheduler *sched, M6502 *mpu)
+{
+  node *n;
+  int	i;
+
+  if (!(sched->nodes= realloc(sched->nodes, sizeof(node) * (sched->nnodes + 1)))) outOfMemory();
+  n= &sched->nodes[sched->nnodes++];
+  memset(n, 0, sizeof(node));
+  n->mpu= mpu;
+  /* nodes may have moved */
+  for (i= 0;  i < sched->nnodes;  ++i)
+    sched->nodes[i].mpu->context= &sched->nodes[i];
+  if (mpu->ticks < sched->now)
+    mpu->ticks= sched->now;
+}
+
+
+static node *findNode(M6502_Scheduler *sched, M6502 *mpu)
+{
+  int i;
+  for (i= 0;  i < sched->nnodes;  ++i)
+    if (sched->nodes[i].mpu == mpu)
+      return &sched->nodes[i];
+  return 0;
+}
+
+
+void M6502_schedulerMap(M6502_Scheduler *sched, M6502 *mpu, uint16_t addr, M6502_Queue *in, M6502_Queue *out)
+{
+  node *n= findNode(sched, mpu);
+  port *p;
+
+  if (!n) return;
+  if (!(n->ports= realloc(n->ports, sizeof(port) * (n->nports + 1)))) outOfMemory();
+  p= &n->ports[n->nports++];
+  p->addr= addr;
+  p->in=   in;
+  p->out=  out;
+  M6502_setCallback(mpu, read,  addr,	  portRead);
+  M6502_setCallback(mpu, write, addr,	  portWrite);
+  M6502_setCallback(mpu, read,  addr + 1, portRead);
+  M6502_setCallback(mpu, write, addr + 1, portWrite);
+}
+
+
+/* run in slices until every mpu has halted or cycles have elapsed,
+ * answering the number of cycles elapsed */
+
+uint64_t M6502_schedulerRun(M6502_Scheduler *sched, uint64_t cycles)
+{
+  uint64_t start= sched->now, end= start + cycles;
+  int	   i, running= 1;
+
+  while (running && (sched->now < end))
+    {
+      sched->now= (end - sched->now < sched->slice) ? end : sched->now + sched->slice;
+      pthread_mutex_lock(&sched->lock);
+      sched->next= 0;
+      sched->done= 0;
+      ++sched->round;
+      pthread_cond_broadcast(&sched->start);
+      while (sched->done < sched->nnodes)
+	pthread_cond_wait(&sched->finish, &sched->lock);
+      pthread_mutex_unlock(&sched->lock);
+      for (running= 0, i= 0;  i < sched->nnodes;  ++i)
+	running |= !sched->nodes[i].halted;
+    }
+  return sched->now - start;
+}
+
+
+int M6502_schedulerHalted(M6502_Scheduler *sched, M6502 *mpu)
+{
+  node *n= findNode(sched, mpu);
+  return !n || n->halted;
+}
+
+
+/* the mpus and queues are not deleted */
+
+void M6502_schedulerDelete(M6502_Scheduler *sched)
+{
+  int i;
+
+  pthread_mutex_lock(&sched->lock);
+  sched->quit= 1;
+  pthread_cond_broadcast(&sched->start);
+  pthread_mutex_unlock(&sched->lock);
+  for (i= 0;  i < sched->nthreads;  ++i)
+    pthread_join(sched->threads[i], 0);
+  for (i= 0;  i < sched->nnodes;  ++i)
+    {
+      free(sched->nodes[i].ports);
+      sched->nodes[i].mpu->context= 0;
+    }
+  free(sched->nodes);
+  free(sched->threads);
+  pthread_cond_destroy(&sched->start);
+  pthread_cond_destroy(&sched->finish);
+  pthread_mutex_destroy(&sched->lock);
+  free(sched);
+}
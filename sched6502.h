@@ -0,0 +1,44 @@
+#ifndef __sched6502_h
+#define __sched6502_h
+
+
+#include "lib6502.h"
+
+/* Run many M6502s cooperatively on a few host threads.  Each mpu runs for
+ * a slice of cycles at a time (with M6502_runFor) and all of them are kept
+ * within one slice of each other.  They talk through byte queues mapped
+ * into memory by M6502_schedulerMap:
+ *
+ *   addr	read: next byte from the input queue (0 if empty)
+ *		write: append to the output queue (dropped if full)
+ *   addr + 1	read: status, bit 7 = input available, bit 6 = output not full
+ *
+ * so that "BIT status : BPL wait" waits for input and "BIT status : BVC
+ * wait" for room to send.  A status read that finds the mpu must be
+ * waiting (its output queue full, or its input queue empty and no room to
+ * send) ends its slice at the next backward branch, so waiting mpus cost
+ * next to nothing.  Map input and output as separate ports where a
+ * receiver should yield while it waits.  An mpu that stops for any other reason (M6502_stop from
+ * a callback, an illegal instruction) is halted and not run again.
+ *
+ * The scheduler owns the context pointer of every mpu added to it.
+ */
+
+typedef struct _M6502_Scheduler	M6502_Scheduler;
+typedef struct _M6502_Queue	M6502_Queue;
+
+extern M6502_Queue *M6502_queueNew(unsigned capacity);
+extern int	    M6502_queuePut(M6502_Queue *queue, uint8_t data);
+extern int	    M6502_queueGet(M6502_Queue *queue);
+extern unsigned	    M6502_queueCount(M6502_Queue *queue);
+extern void	    M6502_queueDelete(M6502_Queue *queue);
+
+extern M6502_Scheduler *M6502_schedulerNew(int threads, uint64_t slice);
+extern void		M6502_schedulerAdd(M6502_Scheduler *sched, M6502 *mpu);
+extern void		M6502_schedulerMap(M6502_Scheduler *sched, M6502 *mpu, uint16_t addr, M6502_Queue *in, M6502_Queue *out);
+extern uint64_t		M6502_schedulerRun(M6502_Scheduler *sched, uint64_t cycles);
+extern int		M6502_schedulerHalted(M6502_Scheduler *sched, M6502 *mpu);
+extern void		M6502_schedulerDelete(M6502_Scheduler *sched);
+
+
+#endif /* __sched6502_h */
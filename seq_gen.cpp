@@ -93,17 +93,52 @@ bool sequence_generator::init()
 	}
 	// optimization for OMP critical function
 	opcode_max=usable_opcodes.size()-1;
+
+	digits.clear();
+	first_digit.clear();
+	for (size_t i=0;i<usable_opcodes.size();++i)
+	{
+		first_digit.push_back(digits.size());
+		for (size_t j=0;j<usable_opcodes[i].params_per_opcode.size();++j)
+			digits.push_back(pair <byte, byte> ((byte)j,(byte)i));
+	}
+	max_rank_instructions=0;
+	for (uint64_t limit=~(uint64_t)0;limit>=digits.size();limit/=digits.size())
+		++max_rank_instructions;
 	return true;
 }
 
+uint64_t sequence_generator::get_rank(const std::vector <byte> &a_sequence) const
+{
+	// the first instruction is the lowest digit
+	assert(a_sequence.size()/2<=max_rank_instructions);
+	uint64_t rank=0;
+	for (size_t i=a_sequence.size();i>=2;i-=2)
+		rank=rank*digits.size()+first_digit[a_sequence[i-1]]+a_sequence[i-2];
+	return rank;
+}
+
+void sequence_generator::get_sequence(size_t instructions, uint64_t rank, std::vector <byte> &a_sequence) const
+{
+	assert(instructions<=max_rank_instructions);
+	a_sequence.resize(instructions*2);
+	for (size_t i=0;i<instructions;++i)
+	{
+		const pair <byte, byte> &digit=digits[(size_t)(rank%digits.size())];
+		rank/=digits.size();
+		a_sequence[i*2]=digit.first;
+		a_sequence[i*2+1]=digit.second;
+	}
+}
+
 bool sequence_generator::convert_seq_to_instructions(const std::vector<byte> &a_sequence, std::vector<s_instruction> &a_instructions)
 {
 	// convert incremental values into opcodes and return it
 	size_t s=a_sequence.size();
 	for (size_t i=0;i<s;i+=2)
 	{
-		unsigned char &param_i=last_sequence_vector[i];
-		unsigned char &opcode_i=last_sequence_vector[i+1];
+		const unsigned char &param_i=a_sequence[i];
+		const unsigned char &opcode_i=a_sequence[i+1];
 		sequence_generator_opcode_info &opcode_info=usable_opcodes[opcode_i];
 
 		s_instruction new_one;
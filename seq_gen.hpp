@@ -3,6 +3,7 @@
 
 #include <vector>
 #include <assert.h>
+#include <stdint.h>
 
 struct sequence_generator_opcode_info {
 
@@ -24,9 +25,21 @@ private:
 	// the sequence is vector of byte pairs <parameter_index, opcode_index>
 	std::vector <byte> last_sequence_vector;
 
+	// every <parameter_index, opcode_index> pair an instruction can be, in
+	// the order get_next_sequence counts them
+	std::vector < std::pair <byte, byte> > digits;
+	std::vector <size_t> first_digit; // per usable opcode
+	size_t max_rank_instructions; // digits^n still fits a rank
+
 public:
 	bool init();
 	void get_next_sequence(std::vector <byte> &a_sequence);
+	// a sequence of n instructions as a number below digits^n, consecutive
+	// sequences of get_next_sequence have consecutive ranks
+	size_t get_digits() const { return digits.size(); }
+	size_t get_max_rank_instructions() const { return max_rank_instructions; }
+	uint64_t get_rank(const std::vector <byte> &a_sequence) const;
+	void get_sequence(size_t instructions, uint64_t rank, std::vector <byte> &a_sequence) const;
 	bool convert_seq_to_instructions(const std::vector<byte> &a_sequence, std::vector<s_instruction> &a_instructions);
 	void print_sequence(const std::vector <s_instruction> &to_print);
 };
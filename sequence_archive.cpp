@@ -0,0 +1,213 @@
+#include <string.h>
+#include <algorithm>
+#include "sequence_archive.hpp"
+
+using namespace std;
+
+static int seek(FILE *file, uint64_t offset)
+{
+#ifdef _WIN32
+	return _fseeki64(file,(__int64)offset,SEEK_SET);
+#else
+	return fseeko(file,(off_t)offset,SEEK_SET);
+#endif
+}
+
+// 7 bits per byte, the lowest first, the top bit set on all but the last
+static void put_varint(vector <byte> &data, uint64_t value)
+{
+	while (value>=0x80)
+	{
+		data.push_back((byte)(value | 0x80));
+		value>>=7;
+	}
+	data.push_back((byte)value);
+}
+
+static bool get_varint(const byte *&data, const byte *end, uint64_t &value)
+{
+	value=0;
+	for (unsigned shift=0;data<end && shift<64;shift+=7)
+	{
+		byte next=*data++;
+		value|=(uint64_t)(next & 0x7f)<<shift;
+		if (!(next & 0x80))
+			return true;
+	}
+	return false;
+}
+
+sequence_archive_writer::sequence_archive_writer()
+{
+	file=NULL;
+	memset(&header,0,sizeof(header));
+	offset=0;
+	last.instructions=0;
+	last.rank=0;
+}
+
+sequence_archive_writer::~sequence_archive_writer()
+{
+	close();
+}
+
+bool sequence_archive_writer::open(const std::string &path, size_t digits)
+{
+	close();
+	memset(&header,0,sizeof(header));
+	memcpy(header.magic,SEQUENCE_ARCHIVE_MAGIC,sizeof(header.magic));
+	header.digits=(uint32_t)digits;
+	header.block_records=ARCHIVE_BLOCK_RECORDS;
+	block.clear();
+	index.clear();
+
+	file=fopen(path.c_str(),"wb");
+	if (!file)
+		return false;
+	// written again with the counts by close()
+	offset=sizeof(header);
+	return fwrite(&header,sizeof(header),1,file)==1;
+}
+
+bool sequence_archive_writer::write_block()
+{
+	if (block.empty())
+		return true;
+	index.push_back(offset);
+	offset+=block.size();
+	bool ok=fwrite(&block[0],1,block.size(),file)==block.size();
+	block.clear();
+	return ok;
+}
+
+bool sequence_archive_writer::add(size_t instructions, uint64_t rank)
+{
+	if (!file)
+		return false;
+	if (header.records%header.block_records==0)
+	{
+		if (!write_block())
+			return false;
+		put_varint(block,instructions);
+		put_varint(block,rank);
+	}
+	else if (instructions==last.instructions && rank>last.rank)
+		put_varint(block,rank-last.rank);
+	else
+	{
+		put_varint(block,0);
+		put_varint(block,instructions);
+		put_varint(block,rank);
+	}
+	last.instructions=instructions;
+	last.rank=rank;
+	++header.records;
+	return true;
+}
+
+bool sequence_archive_writer::close()
+{
+	if (!file)
+		return true;
+	bool ok=write_block();
+	index.push_back(offset);
+	header.blocks=index.size()-1;
+	header.index_offset=offset;
+	ok&=fwrite(&index[0],sizeof(uint64_t),index.size(),file)==index.size();
+	offset+=index.size()*sizeof(uint64_t);
+	ok&=seek(file,0)==0;
+	ok&=fwrite(&header,sizeof(header),1,file)==1;
+	ok&=fclose(file)==0;
+	file=NULL;
+	return ok;
+}
+
+sequence_archive::sequence_archive()
+{
+	file=NULL;
+	memset(&header,0,sizeof(header));
+	block_number=~(uint64_t)0;
+}
+
+sequence_archive::~sequence_archive()
+{
+	close();
+}
+
+bool sequence_archive::open(const std::string &path)
+{
+	close();
+	file=fopen(path.c_str(),"rb");
+	if (!file)
+		return false;
+	if (fread(&header,sizeof(header),1,file)!=1 || memcmp(header.magic,SEQUENCE_ARCHIVE_MAGIC,sizeof(header.magic))!=0
+		|| header.block_records==0 || header.blocks!=(header.records+header.block_records-1)/header.block_records)
+	{
+		close();
+		return false;
+	}
+	index.resize((size_t)header.blocks+1);
+	if (seek(file,header.index_offset)!=0 || fread(&index[0],sizeof(uint64_t),index.size(),file)!=index.size())
+	{
+		close();
+		return false;
+	}
+	return true;
+}
+
+void sequence_archive::close()
+{
+	if (file)
+		fclose(file);
+	file=NULL;
+	index.clear();
+	block_data.clear();
+	block.clear();
+	block_number=~(uint64_t)0;
+}
+
+bool sequence_archive::read_block(uint64_t number)
+{
+	block_number=~(uint64_t)0;
+	block.clear();
+	if (index[number+1]<=index[number])
+		return false;
+	block_data.resize((size_t)(index[number+1]-index[number]));
+	if (seek(file,index[number])!=0 || fread(&block_data[0],1,block_data.size(),file)!=block_data.size())
+		return false;
+
+	uint64_t first=number*header.block_records;
+	size_t count=(size_t)min((uint64_t)header.block_records,header.records-first);
+	const byte *data=&block_data[0], *end=data+block_data.size();
+	s_archived_sequence sequence;
+	uint64_t value;
+	for (size_t i=0;i<count;++i)
+	{
+		if (!get_varint(data,end,value))
+			return false;
+		if (i==0 || value==0)
+		{
+			if (i!=0 && !get_varint(data,end,value))
+				return false;
+			sequence.instructions=(size_t)value;
+			if (!get_varint(data,end,sequence.rank))
+				return false;
+		}
+		else
+			sequence.rank+=value;
+		block.push_back(sequence);
+	}
+	block_number=number;
+	return true;
+}
+
+bool sequence_archive::get(uint64_t record, s_archived_sequence &sequence)
+{
+	if (!file || record>=header.records)
+		return false;
+	uint64_t number=record/header.block_records;
+	if (number!=block_number && !read_block(number))
+		return false;
+	sequence=block[(size_t)(record-number*header.block_records)];
+	return true;
+}
@@ -0,0 +1,93 @@
+#ifndef SEQUENCE_ARCHIVE_H
+#define SEQUENCE_ARCHIVE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "types.hpp"
+
+#define SEQUENCE_ARCHIVE_MAGIC "6502SEQ\1"
+#define ARCHIVE_BLOCK_RECORDS 4096
+
+// File layout, all offsets from the start of the file:
+//   header
+//   blocks	ARCHIVE_BLOCK_RECORDS records each, the last may be shorter;
+//		the first record of a block is its instruction count and rank
+//		as varints, every other one the rank minus the previous rank
+//		as a varint, or 0 and then the instruction count and rank when
+//		the count changes or the rank does not go up
+//   index	uint64_t offset of every block, then of the index itself
+struct s_sequence_archive_header {
+	char magic[8];
+	uint32_t digits; // of the sequence_generator the ranks are from
+	uint32_t block_records;
+	uint64_t records;
+	uint64_t blocks;
+	uint64_t index_offset;
+};
+
+struct s_archived_sequence {
+	size_t instructions;
+	uint64_t rank; // see sequence_generator::get_rank
+};
+
+// Writes sequences as their ranks. get_next_sequence counts them, so
+// nearly every record is a one byte delta from the one before it instead
+// of the instructions themselves. add() is not thread safe.
+class sequence_archive_writer {
+private:
+	FILE *file;
+	s_sequence_archive_header header;
+	std::vector <byte> block;
+	std::vector <uint64_t> index;
+	uint64_t offset;
+	s_archived_sequence last;
+
+	sequence_archive_writer(const sequence_archive_writer &);
+	sequence_archive_writer &operator=(const sequence_archive_writer &);
+
+	bool write_block();
+
+public:
+	sequence_archive_writer();
+	~sequence_archive_writer();
+
+	bool open(const std::string &path, size_t digits);
+	// the record number is get_records() before the call
+	bool add(size_t instructions, uint64_t rank);
+	bool close();
+
+	uint64_t get_records() const { return header.records; }
+	uint64_t get_size() const { return offset; }
+};
+
+// Reads records by number through the block index. The block of the last
+// record read is kept decoded, so a scan in order decodes every block once.
+class sequence_archive {
+private:
+	FILE *file;
+	s_sequence_archive_header header;
+	std::vector <uint64_t> index;
+	std::vector <byte> block_data;
+	std::vector <s_archived_sequence> block;
+	uint64_t block_number;
+
+	sequence_archive(const sequence_archive &);
+	sequence_archive &operator=(const sequence_archive &);
+
+	bool read_block(uint64_t number);
+
+public:
+	sequence_archive();
+	~sequence_archive();
+
+	bool open(const std::string &path);
+	void close();
+	bool get(uint64_t record, s_archived_sequence &sequence);
+
+	uint64_t get_records() const { return file ? header.records : 0; }
+	size_t get_digits() const { return file ? header.digits : 0; }
+};
+
+#endif
@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <string.h>
+#include "table_memory.hpp"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#define PAGE_2MB ((size_t)2<<20)
+#define PAGE_1GB ((size_t)1<<30)
+
+static size_t round_up(size_t size, size_t page)
+{
+	return (size+page-1)/page*page;
+}
+
+#ifdef _WIN32
+
+// needs the "Lock pages in memory" privilege; 1 GB pages need VirtualAlloc2, not used here
+static bool enable_large_pages()
+{
+	HANDLE token;
+	if (!OpenProcessToken(GetCurrentProcess(),TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY,&token))
+		return false;
+	TOKEN_PRIVILEGES privileges;
+	privileges.PrivilegeCount=1;
+	privileges.Privileges[0].Attributes=SE_PRIVILEGE_ENABLED;
+	bool ok=LookupPrivilegeValueA(NULL,"SeLockMemoryPrivilege",&privileges.Privileges[0].Luid)
+		&& AdjustTokenPrivileges(token,FALSE,&privileges,0,NULL,NULL) && GetLastError()==ERROR_SUCCESS;
+	CloseHandle(token);
+	return ok;
+}
+
+// there is no interleave policy, so commit the reserved range in chunks,
+// each preferring the next node
+#define INTERLEAVE_CHUNK ((size_t)64<<10)
+
+static void *allocate_interleaved(size_t size, int nodes)
+{
+	void *address=VirtualAlloc(NULL,size,MEM_RESERVE,PAGE_READWRITE);
+	if (!address)
+		return NULL;
+	for (size_t offset=0;offset<size;offset+=INTERLEAVE_CHUNK)
+	{
+		size_t chunk=size-offset<INTERLEAVE_CHUNK ? size-offset : INTERLEAVE_CHUNK;
+		if (!VirtualAllocExNuma(GetCurrentProcess(),(char *)address+offset,chunk,MEM_COMMIT,PAGE_READWRITE,(DWORD)((offset/INTERLEAVE_CHUNK)%nodes)))
+		{
+			VirtualFree(address,0,MEM_RELEASE);
+			return NULL;
+		}
+	}
+	return address;
+}
+
+bool allocate_table_memory(size_t size, unsigned flags, s_table_memory &memory)
+{
+	memory.nodes=1;
+	size_t large=GetLargePageMinimum();
+	// large pages are committed at once, on whichever nodes have them
+	if ((flags & TABLE_LARGE_PAGES) && large && size>=large && enable_large_pages())
+	{
+		memory.size=round_up(size,large);
+		memory.pages=E_PAGE_2MB;
+		memory.address=VirtualAlloc(NULL,memory.size,MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES,PAGE_READWRITE);
+		if (memory.address)
+			return true;
+	}
+	memory.size=round_up(size,4096);
+	memory.pages=E_PAGE_NORMAL;
+	int nodes=(flags & TABLE_NUMA) ? get_numa_nodes() : 1;
+	if (nodes>1 && (memory.address=allocate_interleaved(memory.size,nodes)))
+	{
+		memory.nodes=nodes;
+		return true;
+	}
+	memory.address=VirtualAlloc(NULL,memory.size,MEM_RESERVE | MEM_COMMIT,PAGE_READWRITE);
+	return memory.address!=NULL;
+}
+
+void free_table_memory(s_table_memory &memory)
+{
+	if (memory.address)
+		VirtualFree(memory.address,0,MEM_RELEASE);
+	memory.address=NULL;
+	memory.size=0;
+}
+
+int get_numa_nodes()
+{
+	ULONG highest;
+	if (!GetNumaHighestNodeNumber(&highest))
+		return 1;
+	return (int)highest+1;
+}
+
+#else
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MPOL_INTERLEAVE
+#define MPOL_INTERLEAVE 3
+#endif
+
+static void *map_pages(size_t size, int extra_flags)
+{
+	void *address=mmap(NULL,size,PROT_READ | PROT_WRITE,MAP_PRIVATE | MAP_ANONYMOUS | extra_flags,-1,0);
+	return address==MAP_FAILED ? NULL : address;
+}
+
+bool allocate_table_memory(size_t size, unsigned flags, s_table_memory &memory)
+{
+	memory.address=NULL;
+	memory.nodes=1;
+#ifdef MAP_HUGETLB
+	if (flags & TABLE_LARGE_PAGES)
+	{
+		// needs pages reserved in /proc/sys/vm/nr_hugepages or the 1 GB pool
+		if (size>=PAGE_1GB && (memory.address=map_pages(round_up(size,PAGE_1GB),MAP_HUGETLB | (30<<MAP_HUGE_SHIFT))))
+		{
+			memory.size=round_up(size,PAGE_1GB);
+			memory.pages=E_PAGE_1GB;
+		}
+		else if (size>=PAGE_2MB && (memory.address=map_pages(round_up(size,PAGE_2MB),MAP_HUGETLB | (21<<MAP_HUGE_SHIFT))))
+		{
+			memory.size=round_up(size,PAGE_2MB);
+			memory.pages=E_PAGE_2MB;
+		}
+	}
+#endif
+	if (!memory.address)
+	{
+		memory.size=round_up(size,(size_t)sysconf(_SC_PAGESIZE));
+		memory.pages=E_PAGE_NORMAL;
+		memory.address=map_pages(memory.size,0);
+		if (!memory.address)
+			return false;
+#ifdef MADV_HUGEPAGE
+		if (flags & TABLE_LARGE_PAGES)
+			madvise(memory.address,memory.size,MADV_HUGEPAGE);
+#endif
+	}
+#ifdef SYS_mbind
+	// before any page is touched; without NUMA support it just fails
+	int nodes=(flags & TABLE_NUMA) ? get_numa_nodes() : 1;
+	if (nodes>(int)(sizeof(unsigned long)*8))
+		nodes=(int)(sizeof(unsigned long)*8);
+	if (nodes>1)
+	{
+		unsigned long mask=nodes==(int)(sizeof(unsigned long)*8) ? ~0UL : (1UL<<nodes)-1;
+		// maxnode is one more than the bits to read
+		if (syscall(SYS_mbind,memory.address,memory.size,MPOL_INTERLEAVE,&mask,sizeof(mask)*8+1,0)==0)
+			memory.nodes=nodes;
+	}
+#endif
+	return true;
+}
+
+void free_table_memory(s_table_memory &memory)
+{
+	if (memory.address)
+		munmap(memory.address,memory.size);
+	memory.address=NULL;
+	memory.size=0;
+}
+
+int get_numa_nodes()
+{
+	int nodes=0;
+	char path[64];
+	for (;;)
+	{
+		sprintf(path,"/sys/devices/system/node/node%d",nodes);
+		if (access(path,F_OK)!=0)
+			break;
+		++nodes;
+	}
+	return nodes ? nodes : 1;
+}
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef TABLE_MEMORY_H
+#define TABLE_MEMORY_H
+
+#include <stddef.h>
+
+#define TABLE_LARGE_PAGES 1 // 1 GB or 2 MB pages where the system gives them
+#define TABLE_NUMA 2 // pages interleaved over all NUMA nodes
+
+enum e_page_size {
+	E_PAGE_NORMAL,
+	E_PAGE_2MB,
+	E_PAGE_1GB,
+};
+
+struct s_table_memory {
+	void *address;
+	size_t size; // rounded up to the page size
+	e_page_size pages;
+	int nodes; // NUMA nodes the pages are interleaved over, 1 if not
+};
+
+// Zero filled memory for a large, randomly probed table. With
+// TABLE_LARGE_PAGES the largest page size that succeeds is used, falling
+// back to normal pages (transparent huge pages where there are some), so
+// that the table needs few TLB entries. With TABLE_NUMA the pages go
+// round robin to the nodes, for tables every thread probes at random.
+bool allocate_table_memory(size_t size, unsigned flags, s_table_memory &memory);
+void free_table_memory(s_table_memory &memory);
+
+// 1 if the system is not NUMA or does not say
+int get_numa_nodes();
+
+#endif
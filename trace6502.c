@@ -0,0 +1,136 @@
+/* trace6502.c -- print or compare lib6502 execution traces	-*- C -*- */
+
+/* usage: trace6502 trace		-- print every insn in trace
+ *        trace6502 trace1 trace2	-- report the first insn where they differ
+ *
+ * traces are written by M6502_trace() (run6502 -t file).  the exit status
+ * of a comparison is 0 if the traces are identical and 1 otherwise.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "lib6502.h"
+
+static char *program= 0;
+
+
+static void fail(const char *fmt, ...)
+{
+  va_list ap;
+  fflush(stdout);
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  fprintf(stderr, "\n");
+  exit(2);
+}
+
+
+static FILE *openTrace(const char *path, M6502_TraceRecord *record)
+{
+  FILE *stream= fopen(path, "rb");
+  if (!stream)
+    {
+      perror(path);
+      exit(2);
+    }
+  if (!M6502_traceBegin(stream, record))
+    fail("%s: not a trace", path);
+  return stream;
+}
+
+
+static int readTrace(FILE *stream, M6502_TraceRecord *record, const char *path)
+{
+  int status= M6502_traceRead(stream, record);
+  if (status < 0) fail("%s: truncated or corrupt", path);
+  return status;
+}
+
+
+static void printRecord(FILE *stream, unsigned long n, M6502_TraceRecord *r)
+{
+  int i;
+  fprintf(stream, "%10lu  PC=%04X op=%02X A=%02X X=%02X Y=%02X P=%02X S=%02X",
+	  n, r->pc, r->op, r->a, r->x, r->y, r->p, r->s);
+  for (i= 0;  i < r->writes;  ++i)
+    fprintf(stream, "  [%04X]=%02X", r->addr[i], r->data[i]);
+  fprintf(stream, "\n");
+}
+
+
+static int sameRecord(M6502_TraceRecord *r, M6502_TraceRecord *q)
+{
+  int i;
+  if ((r->pc != q->pc) || (r->op != q->op)
+      || (r->a != q->a) || (r->x != q->x) || (r->y != q->y) || (r->p != q->p) || (r->s != q->s)
+      || (r->writes != q->writes))
+    return 0;
+  for (i= 0;  i < r->writes;  ++i)
+    if ((r->addr[i] != q->addr[i]) || (r->data[i] != q->data[i]))
+      return 0;
+  return 1;
+}
+
+
+static int print(const char *path)
+{
+  M6502_TraceRecord r;
+  FILE		   *stream= openTrace(path, &r);
+  unsigned long	    n= 0;
+
+  while (readTrace(stream, &r, path))
+    printRecord(stdout, n++, &r);
+  fclose(stream);
+  return 0;
+}
+
+
+static int compare(const char *path1, const char *path2)
+{
+  M6502_TraceRecord r1, r2, p1;
+  FILE		   *s1= openTrace(path1, &r1);
+  FILE		   *s2= openTrace(path2, &r2);
+  unsigned long	    n= 0;
+  int		    more1, more2;
+
+  for (;;)
+    {
+      p1= r1;
+      more1= readTrace(s1, &r1, path1);
+      more2= readTrace(s2, &r2, path2);
+      if (!more1 || !more2 || !sameRecord(&r1, &r2))
+	break;
+      ++n;
+    }
+  fclose(s1);
+  fclose(s2);
+
+  if (!more1 && !more2)
+    {
+      printf("traces are identical (%lu insns)\n", n);
+      return 0;
+    }
+  if (n) printRecord(stdout, n - 1, &p1);
+  if (!more1)	   printf("%s ends after %lu insns\n", path1, n);
+  else		 { printf("%s:\n", path1);  printRecord(stdout, n, &r1); }
+  if (!more2)	   printf("%s ends after %lu insns\n", path2, n);
+  else		 { printf("%s:\n", path2);  printRecord(stdout, n, &r2); }
+  return 1;
+}
+
+
+int main(int argc, char **argv)
+{
+  program= argv[0];
+  switch (argc)
+    {
+    case 2:	return print(argv[1]);
+    case 3:	return compare(argv[1], argv[2]);
+    }
+  fprintf(stderr, "usage: %s trace [trace]\n", program);
+  return 2;
+}
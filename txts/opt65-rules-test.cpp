@@ -0,0 +1,50 @@
+/* opt65-rules-test.cpp -- the rule database for opt65-rules-test.s
+ *
+ * Writes a database with the one rule
+ *
+ *   ldx m0 / inx / stx m0  ->  inc m0	(X dead)
+ *
+ * Build it, and opt65 with USE_RULE_DATABASE, from this directory and run
+ *
+ *   c++ -std=c++14 -I.. -o opt65-rules-test opt65-rules-test.cpp ../rule_database.cpp ../opcode_def.cpp
+ *   ./opt65-rules-test rules-test.db
+ *   ./opt65 -r rules-test.db opt65-rules-test.s
+ *
+ * which prints the block as the comment at the top of the input says.
+ */
+
+#include <stdio.h>
+#include "rule_database.hpp"
+#include "equivalence_table.hpp"
+
+static s_instruction instruction(byte opcode, e_param_type type=E_PARAM_NONE, byte value=0)
+{
+	s_instruction result;
+	result.opcode=opcode;
+	result.canonized_param.type=type;
+	result.canonized_param.value=value;
+	return result;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc!=2)
+	{
+		fprintf(stderr,"usage: opt65-rules-test database\n");
+		return 1;
+	}
+	std::vector <s_instruction> target, replacement;
+	target.push_back(instruction(0xae,E_PARAM_MEM_SLOT,0)); // ldx m0
+	target.push_back(instruction(0xe8)); // inx
+	target.push_back(instruction(0x8e,E_PARAM_MEM_SLOT,0)); // stx m0
+	replacement.push_back(instruction(0xee,E_PARAM_MEM_SLOT,0)); // inc m0
+
+	rule_database_builder builder;
+	builder.add(target,replacement,SEQUENCE_COST(6,3),ALL_LIVE & ~D_X);
+	if (!builder.finalize(argv[1]))
+	{
+		fprintf(stderr,"can't write %s\n",argv[1]);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,25 @@
+; opt65-rules-test.s -- regression input for the rules path of opt65
+;
+; With only the rule of opt65-rules-test.cpp the block must come out as
+;
+;	 lda v1
+;	 asl a
+;	 sta v2
+;	 inc v4
+;	 ldx #$00
+;	 stx v7
+;	 sta v9
+;
+; The lines the rule does not replace keep their operands: "asl a" once
+; lost its "a", and the value 0 was taken from it to make "ldx a".
+
+	lda v1
+	asl a
+	sta v2
+	ldx v4
+	inx
+	stx v4
+	ldx #$00
+	stx v7
+	sta v9
+	rts
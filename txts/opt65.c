@@ -12,12 +12,27 @@
 
    - hexadecimal numbers in uppercase work aswell
    - readline hacked to work with both unix and dos line endings
+   - several files, and the blocks of a file, are optimized in parallel
+   - opti2 and opti3 look lines up by parameter, and opti3 only tries
+     lines again whose neighbourhood has changed
 
 */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
+
+/* with OpenMP blocks are optimized on all cores */
+#ifdef _OPENMP
+#  include <omp.h>
+#endif
+
+/* define USE_RULE_DATABASE and link with the superoptimizer's rule_rewriter
+   to use its rules as well */
+#ifdef USE_RULE_DATABASE
+#  include "../rule_rewriter.h"
+#endif
 
 #undef debug_parse
 #undef debug_opti1
@@ -28,11 +43,11 @@
 //#define VERBOSE
 
 #ifdef debug
-#  define dbmsg(par) printf(par)
+#  define dbmsg(par) bprintf(ctx,par)
 #else
 #  define dbmsg(par)
-#  define op2msg(par)
-#  define mapout(_x)
+#  define op2msg(ctx,par)
+#  define mapout(ctx,_x)
 #endif
 
 /* maximum lenght of a single assembly line */
@@ -247,28 +262,10 @@ typedef struct {
   int   par;    /* command parameter              */
   int   mpar;   /* memory-address of dep or mod   */
   int   mparhi; /* high-byte if indirect addressed*/
+  int   serial; /* same line, wherever it is moved */
   } line;
 
-#define blkbuf_max 500  /* max blocksize of 500 lines should do the job */
-
-static line blkbuf[blkbuf_max];
-static line blkbuf_org[blkbuf_max];
-static int  blkbuf_len;
-static int  blkbuf_org_len;
-
-#define par_max 200     /* max 200 different parameter should be enough */
-#define par_length 10   /* just an average */
-#define no_par (par_max+1)
-
-static int  par_num;
-static int  par_pos[par_max];
-static int  par_used;
-static char parbuf[par_length*par_max];
-
-static char mparbuf[par_length*par_max];
-static int  mpar_used;
-static int  mpar_num;
-static int  mpar_pos[par_max];
+#define no_par (-1)
 
 #define direct 0x0001
 #define indirect 0x0002
@@ -276,33 +273,146 @@ static int  mpar_pos[par_max];
 #define yindexed 0x0008
 #define absolute 0x2000 /* set, if there is a known immediate value      */
 
-static int  mpar_flag[par_max];
 #define undefd 0x0100
 
-static int  blk_mod;
+/* hash index of parameter strings, open addressed */
 
-static int  com_match_lnum;
-static line *com_match_lptr;
-static int test_match;
+typedef struct {
+  int  *slot;        /* id of the string, -1 if free */
+  int  size;         /* a power of two, at least twice the strings */
+  unsigned *hash;    /* of each id */
+  int  hash_max;
+  } str_index;
+
+/* All state of a block is kept in its context, so that blocks can be
+   optimized in parallel, each by one thread. With more than one thread
+   the blocks of a file are split off the context it is read with, with
+   the parameters their lines refer to; with one they are optimized in
+   that context as they end, like all blocks once were.
+
+   Block storage has no fixed limits: every buffer grows when it is full,
+   and clearing a block only resets the counters. Lines and parameters
+   are addressed by index and no pointer into a buffer is kept across a
+   call that may grow it. */
 
-static char tmpstr[100];
+typedef struct {
+  line *blkbuf;      /* room for blkbuf_len lines again plus one, used */
+                     /* as scratch by opti2, opti3, try_sim2 */
+  line *blkbuf_org;  /* the block as read, listed beside the result */
+  int  blkbuf_len;
+  int  blkbuf_org_len;
+  int  blkbuf_max;   /* lines allocated in each */
+
+  int  par_num;
+  int  *par_pos;
+  int  par_max;
+  int  par_used;
+  char *parbuf;
+  int  parbuf_max;
+  str_index par_index;
+
+  char *mparbuf;
+  int  mparbuf_max;
+  int  mpar_used;
+  int  mpar_num;
+  int  *mpar_pos;
+  int  mpar_max;
+  str_index mpar_index;
+
+  int  *mpar_flag;    /* per mpar, allocated with mpar_pos */
+
+  int  blk_mod;
+
+  int  com_match_lnum;
+  line *com_match_lptr;
+  int  test_match;
+
+  char tmpstr[100];
+
+  int  opt;
+  int  was_line;
+
+  int  remove_count;
+  int  hit_count;
+
+  /* opti3's worklist, per serial of a line if not said otherwise */
+  int  serial_num;
+  line *work_last;      /* the block as opti3 last tried it */
+  int  work_len;
+  int  work_max;        /* lines allocated, and work_count */
+  int  *work_where;     /* index in work_last */
+  int  *work_reach;     /* lines after it its last try has read */
+  char *work_pending;   /* to be tried (again) as first command */
+  int  work_serial_max;
+  int  *work_count;     /* per line: changed lines before it */
+  int  *work_limit_par; /* per par: last changed line of a pair with it,
+                           then scratch */
+  int  work_par_max;
+  int  work_limit_tok[tok_num];  /* per tok, for equal commands, then scratch */
+  int  work_limit_pair[tok_num]; /* per tok, for the pairs of pair_tok */
+  int  work_read;       /* last line read by no_dep */
+  int  work_index_max;  /* lines allocated in the line index: */
+  int  *work_next_par;  /* per line: next line with its par */
+  int  *work_next_tok;  /* per line: next line with its tok */
+  int  *work_tok_pos;   /* the lines, by tok */
+  int  work_tok_start[tok_num+1];
+  int  work_cur_par;    /* second commands of a try, see pair_next */
+  int  work_cur_tok;
+  int  work_cur_pair[2];
+  int  work_end_pair[2];
+  int  work_pairs;
+
+  char *out;          /* everything printed for the block, in order */
+  int  out_len;
+  int  out_max;
+
+#ifdef USE_RULE_DATABASE
+  rule_rewriter_instruction *rules_program,*rules_rewritten;
+  unsigned char *rules_live;
+  rule_rewriter_span *rules_spans;
+  line *rules_lines;
+  int  rules_program_max,rules_rewritten_max;
+#endif
+  } block;
+
+/* the blocks read but not optimized yet, in the order they are printed.
+   At most batch_blocks are kept, so a file is optimized while it is
+   read and not all of it is held at once. */
 
-static int  opt;
-static int  inp_line;
-static int  was_line;
+#define batch_blocks 1024
 
-static int remove_count;
-static int hit_count;
+typedef struct {
+  block **blk;
+  int  num;
+  int  max;
+  int  threads;       /* 1 for no blocks kept at all */
+  FILE *fout;
+  int  remove_count;
+  int  hit_count;
+  } block_list;
+
+static int  inp_line;  /* of the file being read */
 
 char *getexpr(char *a, unsigned int *par);
+void index_clear(str_index *ix, int num);
 
 /*********************************************************************/
 
 void how_to(void)
 {
-  printf("usage: opt65 file\n");
+#ifdef USE_RULE_DATABASE
+  printf("usage: opt65 [-j threads] [-r rules] file [file...]\n");
+#else
+  printf("usage: opt65 [-j threads] file [file...]\n");
+#endif
   printf("  \"opt65\" is a peephole optimizer for 6502/10-assembler\n");
-  printf("  sources. The optimized code is printed to stdout.\n");
+  printf("  sources. The optimized code is printed to stdout, or\n");
+  printf("  for more than one file to \"file.opt\" for each file.\n");
+  printf("  Blocks are optimized by \"threads\" threads, by default\n");
+  printf("  one for each core.\n");
+#ifdef USE_RULE_DATABASE
+  printf("  \"rules\" is a rule database of the superoptimizer.\n");
+#endif
   printf("  This is version 0.12, Aug 23 1996, by 'Poldi',\n");
   printf("  modified and fixed for use with cc65/ca65 by 'Groepaz/Hitmen'\n");
   exit(1);
@@ -349,233 +459,350 @@ int readline(char *buf, FILE *infile)
   return 0;
 }
 
-void clear_buf(void)
+/* make room for need items of size bytes in buf, that has room for max */
+
+void *grow(void *buf, int *max, int need, int size)
+{
+  if (need<=*max) return buf;
+  if (*max==0) *max=64;
+  while (*max<need) *max=*max*2;
+  buf=realloc(buf,(size_t)*max*size);
+  if (buf==NULL) {
+    printf("error: out of memory\n");
+    exit(1); }
+  return buf;
+}
+
+/* print to the output of a block */
+
+void bprintf(block *ctx, const char *format, ...)
+{
+  va_list args;
+  int n;
+
+  ctx->out=(char *)grow(ctx->out,&ctx->out_max,ctx->out_len+1,1);
+  va_start(args,format);
+  n=vsnprintf(&ctx->out[ctx->out_len],ctx->out_max-ctx->out_len,format,args);
+  va_end(args);
+  if (n<0) return;
+  if (n>=ctx->out_max-ctx->out_len) {
+    ctx->out=(char *)grow(ctx->out,&ctx->out_max,ctx->out_len+n+1,1);
+    va_start(args,format);
+    vsnprintf(&ctx->out[ctx->out_len],ctx->out_max-ctx->out_len,format,args);
+    va_end(args); }
+  ctx->out_len+=n;
+}
+
+/*********************************************************************/
+
+void clear_buf(block *ctx)
 {
   dbmsg("clearing buffer...\n");
 
-  par_used=0;
-  par_num=0;
+  index_clear(&ctx->par_index,ctx->par_num);
+  index_clear(&ctx->mpar_index,ctx->mpar_num);
+  ctx->par_used=0;
+  ctx->par_num=0;
 
-  mpar_used=0;
-  mpar_num=0;
+  ctx->mpar_used=0;
+  ctx->mpar_num=0;
 }
 
 /*********************************************************************/
 
-void blk_lineout(line *p)
+void blk_lineout(block *ctx, line *p)
 {
-  if ( p->tok==no_tok ) printf("???");
-  else if ( p->tok==null_tok ) printf("---");
-  else printf("%s",tok[p->tok].text);
+  if ( p->tok==no_tok ) bprintf(ctx,"???");
+  else if ( p->tok==null_tok ) bprintf(ctx,"---");
+  else bprintf(ctx,"%s",tok[p->tok].text);
 
   if (p->par!=no_par)
   {
-    printf(" %15s",&parbuf[par_pos[p->par]]);
+    bprintf(ctx," %15s",&ctx->parbuf[ctx->par_pos[p->par]]);
   }
   else
   {
-    printf(" %15s","");
+    bprintf(ctx," %15s","");
   }
 
 }
 
-void blk_infoout(line *p)
+void blk_infoout(block *ctx, line *p)
 {
 
-  printf(" dep:");
-   mapout(p->dep);
-  printf(" mod:");
-   mapout(p->mod);
-  printf(" feeds:");
-   mapout(p->feeds);
-  printf(" passes:");
-   mapout(p->passes);
-  printf(" fl:%2i",p->flags);
+  bprintf(ctx," dep:");
+   mapout(ctx,p->dep);
+  bprintf(ctx," mod:");
+   mapout(ctx,p->mod);
+  bprintf(ctx," feeds:");
+   mapout(ctx,p->feeds);
+  bprintf(ctx," passes:");
+   mapout(ctx,p->passes);
+  bprintf(ctx," fl:%2i",p->flags);
 
   if (p->par!=no_par) {
-//    printf(" \"%s\"  [%d",&parbuf[par_pos[p->par]],p->par);
-    printf(" [%d",p->par);
+//    bprintf(ctx," \"%s\"  [%d",&ctx->parbuf[ctx->par_pos[p->par]],p->par);
+    bprintf(ctx," [%d",p->par);
     if (p->depind & mem)
 	{
-      printf("/%d",p->mpar);
-      if (p->depind&imem ) printf(",%d",p->mparhi);
-      if (p->depind&reg_x) printf("Ix");
-      if (p->depind&reg_y) printf("Iy");
+      bprintf(ctx,"/%d",p->mpar);
+      if (p->depind&imem ) bprintf(ctx,",%d",p->mparhi);
+      if (p->depind&reg_x) bprintf(ctx,"Ix");
+      if (p->depind&reg_y) bprintf(ctx,"Iy");
 	}
-    printf("]");
-    if (p->depind&absolute) printf(", val=%d",p->mpar); }
+    bprintf(ctx,"]");
+    if (p->depind&absolute) bprintf(ctx,", val=%d",p->mpar); }
 
 }
 
 
 #ifdef debug
 
-void mapout(int map)
+void mapout(block *ctx, int map)
 {
-  if ( (map&reg_a )!=0 ) printf("A"); else printf("-");
-  if ( (map&reg_x )!=0 ) printf("X"); else printf("-");
-  if ( (map&reg_y )!=0 ) printf("Y"); else printf("-");
-  if ( (map&reg_s )!=0 ) printf("S"); else printf("-");
-  if ( (map&mem   )!=0 ) printf("M"); else printf("-");
-  if ( (map&flag_n)!=0 ) printf("n"); else printf("-");
-  if ( (map&flag_z)!=0 ) printf("z"); else printf("-");
-  if ( (map&flag_c)!=0 ) printf("c"); else printf("-");
-  if ( (map&flag_v)!=0 ) printf("v"); else printf("-");
-  if ( (map&flag_d)!=0 ) printf("d"); else printf("-");
-  if ( (map&flag_i)!=0 ) printf("i"); else printf("-");
+  if ( (map&reg_a )!=0 ) bprintf(ctx,"A"); else bprintf(ctx,"-");
+  if ( (map&reg_x )!=0 ) bprintf(ctx,"X"); else bprintf(ctx,"-");
+  if ( (map&reg_y )!=0 ) bprintf(ctx,"Y"); else bprintf(ctx,"-");
+  if ( (map&reg_s )!=0 ) bprintf(ctx,"S"); else bprintf(ctx,"-");
+  if ( (map&mem   )!=0 ) bprintf(ctx,"M"); else bprintf(ctx,"-");
+  if ( (map&flag_n)!=0 ) bprintf(ctx,"n"); else bprintf(ctx,"-");
+  if ( (map&flag_z)!=0 ) bprintf(ctx,"z"); else bprintf(ctx,"-");
+  if ( (map&flag_c)!=0 ) bprintf(ctx,"c"); else bprintf(ctx,"-");
+  if ( (map&flag_v)!=0 ) bprintf(ctx,"v"); else bprintf(ctx,"-");
+  if ( (map&flag_d)!=0 ) bprintf(ctx,"d"); else bprintf(ctx,"-");
+  if ( (map&flag_i)!=0 ) bprintf(ctx,"i"); else bprintf(ctx,"-");
 }
 
 
-void lineout(line *p)
+void lineout(block *ctx, line *p)
 {
 
-  if ( p->tok==no_tok ) printf("???");
-  else if ( p->tok==null_tok ) printf("---");
-  else printf("%s",tok[p->tok].text);
+  if ( p->tok==no_tok ) bprintf(ctx,"???");
+  else if ( p->tok==null_tok ) bprintf(ctx,"---");
+  else bprintf(ctx,"%s",tok[p->tok].text);
 
   if (p->par!=no_par)
   {
-    printf(" %15s",&parbuf[par_pos[p->par]]);
+    bprintf(ctx," %15s",&ctx->parbuf[ctx->par_pos[p->par]]);
   }
 
-  printf(" dep:");
-   mapout(p->dep);
-  printf(" mod:");
-   mapout(p->mod);
-  printf(" feeds:");
-   mapout(p->feeds);
-  printf(" passes:");
-   mapout(p->passes);
-  printf(" fl:%2i",p->flags);
+  bprintf(ctx," dep:");
+   mapout(ctx,p->dep);
+  bprintf(ctx," mod:");
+   mapout(ctx,p->mod);
+  bprintf(ctx," feeds:");
+   mapout(ctx,p->feeds);
+  bprintf(ctx," passes:");
+   mapout(ctx,p->passes);
+  bprintf(ctx," fl:%2i",p->flags);
 
   if (p->par!=no_par) {
-    printf(" \"%s\"  [%i",&parbuf[par_pos[p->par]],p->par);
+    bprintf(ctx," \"%s\"  [%i",&ctx->parbuf[ctx->par_pos[p->par]],p->par);
     if (p->depind & mem)
 	{
-      printf("/%i",p->mpar);
-      if (p->depind&imem ) printf(",%i",p->mparhi);
-      if (p->depind&reg_x) printf("Ix");
-      if (p->depind&reg_y) printf("Iy");
+      bprintf(ctx,"/%i",p->mpar);
+      if (p->depind&imem ) bprintf(ctx,",%i",p->mparhi);
+      if (p->depind&reg_x) bprintf(ctx,"Ix");
+      if (p->depind&reg_y) bprintf(ctx,"Iy");
 	}
-    printf("]");
-    if (p->depind&absolute) printf(", val=%i",p->mpar); }
+    bprintf(ctx,"]");
+    if (p->depind&absolute) bprintf(ctx,", val=%i",p->mpar); }
 
-  printf("\n");
+  bprintf(ctx,"\n");
 }
 
-void op2msg(char *a)
+void op2msg(block *ctx, char *a)
 {
-  if (test_match) printf("### "); else printf("*** ");
-  printf("%s",a);
+  if (ctx->test_match) bprintf(ctx,"### "); else bprintf(ctx,"*** ");
+  bprintf(ctx,"%s",a);
 }
 
 #endif
 
-void bufout(void)
+void bufout(block *ctx)
 {
   /* print block buffer */
 
   int i;
 
   i=0;
-  while (i<blkbuf_len) {
-    printf("\t %s",tok[blkbuf[i].tok].text);
-    if (blkbuf[i].par!=no_par) {
-      printf(" %s\n",&parbuf[par_pos[blkbuf[i].par]]); }
-    else printf("\n");
+  while (i<ctx->blkbuf_len) {
+    bprintf(ctx,"\t %s",tok[ctx->blkbuf[i].tok].text);
+    if (ctx->blkbuf[i].par!=no_par) {
+      bprintf(ctx," %s\n",&ctx->parbuf[ctx->par_pos[ctx->blkbuf[i].par]]); }
+    else bprintf(ctx,"\n");
     i++; }
 }
 
 /*********************************************************************/
 
-int get_parid( char *par, int length)
+void blk_reserve(block *ctx, int len)
+{
+  int max;
+
+  max=ctx->blkbuf_max;
+  ctx->blkbuf=(line *)grow(ctx->blkbuf,&max,2*len+1,sizeof(line));
+  max=ctx->blkbuf_max;
+  ctx->blkbuf_org=(line *)grow(ctx->blkbuf_org,&max,2*len+1,sizeof(line));
+  ctx->blkbuf_max=max;
+}
+
+/*********************************************************************/
+
+unsigned str_hash(char *a, int length)
+{
+  unsigned h;
+  int i;
+
+  h=2166136261u; /* FNV-1a */
+  for (i=0;i<length;++i) h=(h^(unsigned char)a[i])*16777619u;
+  return h;
+}
+
+/* id of the string a of length in buf, -1 if there is none */
+
+int index_find(str_index *ix, char *buf, int *pos, char *a, int length, unsigned h)
+{
+  int i,id;
+
+  if (ix->size==0) return -1;
+  i=h&(ix->size-1);
+  while ((id=ix->slot[i])>=0) {
+    if (ix->hash[id]==h && strncmp(&buf[pos[id]],a,length)==0 && buf[pos[id]+length]=='\0')
+      return id;
+    i=(i+1)&(ix->size-1); }
+  return -1;
+}
+
+void index_put(str_index *ix, int id)
+{
+  int i;
+
+  i=ix->hash[id]&(ix->size-1);
+  while (ix->slot[i]>=0) i=(i+1)&(ix->size-1);
+  ix->slot[i]=id;
+}
+
+/* add id with hash h, num strings (id included) are in the index then */
+
+void index_add(str_index *ix, int id, unsigned h, int num)
+{
+  int i;
+
+  ix->hash=(unsigned *)grow(ix->hash,&ix->hash_max,id+1,sizeof(unsigned));
+  ix->hash[id]=h;
+  if (2*num>ix->size) {
+    free(ix->slot);
+    if (ix->size==0) ix->size=64;
+    while (2*num>ix->size) ix->size*=2;
+    ix->slot=(int *)malloc(ix->size*sizeof(int));
+    if (ix->slot==NULL) {
+      printf("error: out of memory\n");
+      exit(1); }
+    memset(ix->slot,-1,ix->size*sizeof(int));
+    for (i=0;i<num;++i) index_put(ix,i);
+    return; }
+  index_put(ix,id);
+}
+
+/* remove the num strings, only their slots are touched */
+
+void index_clear(str_index *ix, int num)
+{
+  int i,id;
+
+  for (id=0;id<num;++id) {
+    i=ix->hash[id]&(ix->size-1);
+    while (ix->slot[i]!=id) i=(i+1)&(ix->size-1);
+    ix->slot[i]=-1; }
+}
+
+void index_free(str_index *ix)
+{
+  free(ix->slot);
+  free(ix->hash);
+  ix->slot=NULL;
+  ix->hash=NULL;
+  ix->size=ix->hash_max=0;
+}
+
+int get_parid(block *ctx, char *par, int length)
 {
   int x,y;
+  unsigned h;
 
-  y=0;
-  x=0;
-  while (x<par_num) {
-    y=0;
-    if (parbuf[par_pos[x]+length]!='\0') {
-      x++;
-      continue; }
-    while (y<length) {
-      if (parbuf[par_pos[x]+y]!=par[y]) {
-        y=0;
-        break; }
-      y++; }
-    if (y!=0) break;
-    x++; }
+  h=str_hash(par,length);
+  x=index_find(&ctx->par_index,ctx->parbuf,ctx->par_pos,par,length,h);
 
 # ifdef debug_parse
-  if (y!=0) printf(", equal to par[%i]\n",x);
+  if (x>=0) bprintf(ctx,", equal to par[%i]\n",x);
 # endif
 
-  if (y==0) {
+  if (x<0) {
 
     /* never seen this parameter before (in this block) so add it to list */
 
 #   ifdef debug_parse
-    printf(", added to database par[%i]\n",par_num);
+    bprintf(ctx,", added to database par[%i]\n",ctx->par_num);
 #   endif
+    ctx->parbuf=(char *)grow(ctx->parbuf,&ctx->parbuf_max,ctx->par_used+length+1,1);
+    ctx->par_pos=(int *)grow(ctx->par_pos,&ctx->par_max,ctx->par_num+1,sizeof(int));
     y=0;
     while (y<length) {
-      parbuf[par_used+y]=par[y];
+      ctx->parbuf[ctx->par_used+y]=par[y];
       y++; }
-    parbuf[par_used+y]='\0';
+    ctx->parbuf[ctx->par_used+y]='\0';
 
-    par_pos[par_num]=par_used;
-    par_used=par_used+length+1;
-    x=par_num;
-    par_num=par_num+1; }
+    ctx->par_pos[ctx->par_num]=ctx->par_used;
+    ctx->par_used=ctx->par_used+length+1;
+    x=ctx->par_num;
+    ctx->par_num=ctx->par_num+1;
+    index_add(&ctx->par_index,x,h,ctx->par_num); }
 
   return x;
 }
 
-int get_mparid( char *mpar, int length )
+int get_mparid(block *ctx, char *mpar, int length )
 {
-  static int x,y;
+  int x,y;
+  int flag_max;
+  unsigned h;
 
-  y=0;
-  x=0;
-  while (x<mpar_num) {
-    y=0;
-    if (mparbuf[mpar_pos[x]+length]!='\0') {
-      x++;
-      continue; }
-    while (y<length) {
-      if (mparbuf[mpar_pos[x]+y]!=mpar[y]) {
-        y=0;
-        break; }
-      y++; }
-    if (y!=0) break;
-    x++; }
+  h=str_hash(mpar,length);
+  x=index_find(&ctx->mpar_index,ctx->mparbuf,ctx->mpar_pos,mpar,length,h);
 
 # ifdef debug_parse
-  if (y!=0) printf("existing mpar[%i]",x);
+  if (x>=0) bprintf(ctx,"existing mpar[%i]",x);
 # endif
 
-  if (y==0) {
+  if (x<0) {
 
     /* never seen this address before (in this block) so add it to list */
 
 #   ifdef debug_parse
-    printf("new mpar[%i]",mpar_num);
+    bprintf(ctx,"new mpar[%i]",ctx->mpar_num);
 #   endif
 
+    ctx->mparbuf=(char *)grow(ctx->mparbuf,&ctx->mparbuf_max,ctx->mpar_used+length+1,1);
+    if (ctx->mpar_num+1>ctx->mpar_max) {
+      flag_max=ctx->mpar_max;
+      ctx->mpar_pos=(int *)grow(ctx->mpar_pos,&ctx->mpar_max,ctx->mpar_num+1,sizeof(int));
+      ctx->mpar_flag=(int *)grow(ctx->mpar_flag,&flag_max,ctx->mpar_num+1,sizeof(int)); }
+
     y=0;
     while (y<length) {
-      mparbuf[mpar_used+y]=mpar[y];
+      ctx->mparbuf[ctx->mpar_used+y]=mpar[y];
       y++; }
-    mparbuf[mpar_used+y]='\0';
+    ctx->mparbuf[ctx->mpar_used+y]='\0';
 
-    mpar_pos[mpar_num]=mpar_used;
-    mpar_used=mpar_used+length+1;
-    x=mpar_num;
-    mpar_num++; }
+    ctx->mpar_pos[ctx->mpar_num]=ctx->mpar_used;
+    ctx->mpar_used=ctx->mpar_used+length+1;
+    x=ctx->mpar_num;
+    ctx->mpar_num++;
+    index_add(&ctx->mpar_index,x,h,ctx->mpar_num); }
 
 # ifdef debug_parse
-  printf(":%s\n",&mparbuf[mpar_pos[x]]);
+  bprintf(ctx,":%s\n",&ctx->mparbuf[ctx->mpar_pos[x]]);
 # endif
 
   return x;
@@ -583,6 +810,37 @@ int get_mparid( char *mpar, int length )
 
 /*********************************************************************/
 
+/* perfect hash of the mnemonics, the constants are chosen so that no
+   two of them share a slot */
+
+#define tok_hash(a) (((unsigned char)(a)[0]*22+(unsigned char)(a)[1]*208+(unsigned char)(a)[2])&255)
+
+static unsigned char tok_index[256]; /* token+1, 0 if none */
+
+void init_tok_index(void)
+{
+  int j;
+
+  for (j=0;j<tok_num;++j) {
+    if (tok_index[tok_hash(tok[j].text)]!=0) {
+      printf("error: mnemonic hash collision\n");
+      exit(1); }
+    tok_index[tok_hash(tok[j].text)]=j+1; }
+}
+
+/* token of the mnemonic a starts with, tok_num if none */
+
+int find_tok(char *a)
+{
+  int j;
+
+  if (a[0]=='\0' || a[1]=='\0') return tok_num;
+  j=tok_index[tok_hash(a)]-1;
+  if (j<0 || a[0]!=tok[j].text[0] || a[1]!=tok[j].text[1] || a[2]!=tok[j].text[2])
+    return tok_num;
+  return j;
+}
+
 int is_sep(int c)
 {
   if (c>='0' && c<='9') return 0;
@@ -601,8 +859,8 @@ int nextchar(char *a, int i)
 
 char *getval(char *a, unsigned int *par)
 {
-  static int i,cnt;
-  static unsigned int val;
+  int i,cnt;
+  unsigned int val;
 
   cnt=0;
   *par=0;
@@ -736,30 +994,24 @@ char *getexpr(char *a, unsigned int *par)
 
 /*********************************************************************/
 
+/* the value of an immediate operand, undefd if it is not a byte */
+
 int resolve_abs(char *a)
 {
-  static unsigned int tmp;
-
-# ifdef debug_parse
-  printf("try to resolve \"%s\", ",a);
-# endif
+  unsigned int tmp;
 
-  if (getexpr(a, &tmp)==NULL) { dbmsg("sorry\n"); return undefd; }
-  if (tmp>0xff) { dbmsg("sorry >255\n"); return undefd; }
-  else {
-#   ifdef debug_parse
-    printf("value is %i\n",tmp);
-#   endif
-    return tmp; }
+  if (getexpr(a, &tmp)==NULL) return undefd;
+  if (tmp>0xff) return undefd;
+  return tmp;
 }
 
 /* parse_line returns a value unequal to zero, if line includes
    a label-definition */
 
-int parse_line(char *a, line *p)
+int parse_line(block *ctx, char *a, line *p)
 {
 //  static int i,j,x,y;
-  static int i,j,x;
+  int i,j,x;
 
   p->tok=null_tok;
   p->dep=0;
@@ -773,7 +1025,7 @@ int parse_line(char *a, line *p)
   p->par=no_par;
 
 # ifdef debug_parse
-  printf("line=\"%s\"\n",a);
+  bprintf(ctx,"line=\"%s\"\n",a);
 # endif
 
   /* remove leading white_spaces */
@@ -782,20 +1034,16 @@ int parse_line(char *a, line *p)
   if (a[i]=='\0') return 0;
   if (a[i]==';' )
   {
-  	 fprintf(stdout,"%s\n",&a[i]);
+  	 bprintf(ctx,"%s\n",&a[i]);
   	 return 0;
   }
 
   /* check for assembler-command */
 
-  j=0;
-  while (j<tok_num &&
-          !(   a[i  ]==tok[j].text[0]
-            && a[i+1]==tok[j].text[1]
-            && a[i+2]==tok[j].text[2] ) ) j++;
+  j=find_tok(&a[i]);
   if (j==tok_num) {
     while (a[i]!=' ' && a[i]!='\t' && a[i]!='\0') i++;
-    x=parse_line(&a[i], p);
+    x=parse_line(ctx,&a[i], p);
     if (x!=0) return 2;
     return 1; }
 
@@ -822,17 +1070,21 @@ int parse_line(char *a, line *p)
 
 # ifdef debug_parse
   a[i+j]='\0';
-  printf("par is \"%s\"",&a[i]);
+  bprintf(ctx,"par is \"%s\"",&a[i]);
 # endif
 
   /* now i points to start and j is length of parameter-string */
 
-  p->par=x=get_parid(&a[i],j);
+  p->par=x=get_parid(ctx,&a[i],j);
 
   if (j==1 && (a[i]=='a'||a[i]=='A') ) return 0; /* Akku addressed */
   if (a[i]=='#') { /* immediate */
-    if ( (p->mpar=resolve_abs(&parbuf[par_pos[x]+1]))!=undefd )
+    if ( (p->mpar=resolve_abs(&ctx->parbuf[ctx->par_pos[x]+1]))!=undefd )
       p->depind|=absolute; /* resolved */
+#   ifdef debug_parse
+    if (p->mpar!=undefd) bprintf(ctx,", value is %i\n",p->mpar);
+    else bprintf(ctx,", not resolved\n");
+#   endif
     return 0; }
 
   if ( a[i]=='(' ) {
@@ -849,15 +1101,15 @@ int parse_line(char *a, line *p)
 
   /* now "i" exactly points to start of mem-address, j is length */
 
-  x=get_mparid( &a[i], j );
+  x=get_mparid(ctx, &a[i], j );
   p->mpar=x;
 
   if (p->depind & imem) {
     /* address points to 16bit-pointer */
-    strcpy(tmpstr,&a[i]);
-    tmpstr[j]='+';
-    tmpstr[j+1]='1';
-    p->mparhi=get_mparid( tmpstr, j+2 ); }
+    strcpy(ctx->tmpstr,&a[i]);
+    ctx->tmpstr[j]='+';
+    ctx->tmpstr[j+1]='1';
+    p->mparhi=get_mparid(ctx, ctx->tmpstr, j+2 ); }
 
   i=i+j;
 
@@ -897,28 +1149,29 @@ void line_copy(line *to, line *from)
   to->par    =from->par;
   to->mpar   =from->mpar;
   to->mparhi =from->mparhi;
+  to->serial =from->serial;
 }
 
-#define iline_copy(par1,par2)  line_copy(&blkbuf[par1],&blkbuf[par2])
+#define iline_copy(par1,par2)  line_copy(&ctx->blkbuf[par1],&ctx->blkbuf[par2])
 
 /*********************************************************************/
 
-void make_feedlist(void)
+void make_feedlist(block *ctx)
 {
-  static int hlp;
-  static int i;
-  static line *p;
+  int hlp;
+  int i;
+  line *p;
 
   dbmsg("making feedlist...\n");
 
-  hlp=blk_mod;
-  if (blkbuf_len<1) return;
+  hlp=ctx->blk_mod;
+  if (ctx->blkbuf_len<1) return;
   i=0;
-  while (i<mpar_num) mpar_flag[i++]=1;
+  while (i<ctx->mpar_num) ctx->mpar_flag[i++]=1;
 
-  i=blkbuf_len-1;
+  i=ctx->blkbuf_len-1;
   while( i>=0 ) {
-    p=&blkbuf[i];
+    p=&ctx->blkbuf[i];
     p->feeds=p->mod & hlp;
     p->passes=hlp & ~p->mod;
 //    hlp=(hlp & ( ~p->mod )) | p->dep & valid_map;
@@ -935,8 +1188,8 @@ void make_feedlist(void)
 
         /* dep: ptr,ptr+1 */
 
-        mpar_flag[p->mpar]=1;
-        mpar_flag[p->mparhi]=1; }
+        ctx->mpar_flag[p->mpar]=1;
+        ctx->mpar_flag[p->mparhi]=1; }
 
       else if (p->depind & (reg_x|reg_y) ) {
 
@@ -947,27 +1200,27 @@ void make_feedlist(void)
 
         /* dep: ptr */
 
-        mpar_flag[p->mpar]=1; }
+        ctx->mpar_flag[p->mpar]=1; }
 
       else
 
         /* normal addressed memory (direct) */
 
-        if ( mpar_flag[p->mpar] ) {
+        if ( ctx->mpar_flag[p->mpar] ) {
           if ((p->mod & mem)!=0) {
             p->feeds|=mem;
-            mpar_flag[p->mpar]=0; }
+            ctx->mpar_flag[p->mpar]=0; }
           else p->passes|=mem; }
 
         if (p->dep & mem) {
-          mpar_flag[p->mpar]=1; } }
+          ctx->mpar_flag[p->mpar]=1; } }
 
     i--; }
 }
 
 /*********************************************************************/
 
-int simple_erase(void)
+int simple_erase(block *ctx)
 {
   /* erase all commands, that don't feed a register/flag nor change memory
      nor are fixed */
@@ -975,55 +1228,56 @@ int simple_erase(void)
   int i,j;
 
   i=0; j=0;
-  while (i<blkbuf_len)
+  while (i<ctx->blkbuf_len)
   {
-		if (blkbuf[i].feeds==0 && (blkbuf[i].flags&fixed)==0)
+		if (ctx->blkbuf[i].feeds==0 && (ctx->blkbuf[i].flags&fixed)==0)
 		{
 				/* erase it ! */
 		//#     ifdef debug
-		//      printf("*** simple_erased: buf[%i]\n",i);
+		//      bprintf(ctx,"*** simple_erased: buf[%i]\n",i);
 		//#     endif
 		#ifdef VERBOSE
-			printf(";; REMOVED: ");
-		//    lineout(&blkbuf[i]);
-			printf(" %s",tok[blkbuf[i].tok].text);
-			if (blkbuf[i].par!=no_par)
+			bprintf(ctx,";; REMOVED: ");
+		//    lineout(ctx,&ctx->blkbuf[i]);
+			bprintf(ctx," %s",tok[ctx->blkbuf[i].tok].text);
+			if (ctx->blkbuf[i].par!=no_par)
 			{
-			printf(" %s",&parbuf[par_pos[blkbuf[i].par]]);
+			bprintf(ctx," %s",&ctx->parbuf[ctx->par_pos[ctx->blkbuf[i].par]]);
 			}
 
-			printf("\n");
+			bprintf(ctx,"\n");
 
 
 		#endif
-			opt++;
+			ctx->opt++;
 			i++;
 			continue;
 		}
 		if (i!=j)
 		{
-			line_copy(&blkbuf[j],&blkbuf[i]);
+			line_copy(&ctx->blkbuf[j],&ctx->blkbuf[i]);
 		}
 		i++; j++;
 	}
 
-  blkbuf_len=j;
+  ctx->blkbuf_len=j;
   return (i!=j);
 }
 
 /*********************************************************************/
 
-void set_absval(line *p, int val)
+void set_absval(block *ctx, line *p, int val)
 {
-  static char par[5];
+  char par[5];
 
   sprintf(par,"#%i",val);
 
-  p->par=get_parid(par, strlen(par));
+  p->par=get_parid(ctx,par, strlen(par));
   p->depind=absolute;
+  p->mpar=val;
 }
 
-int opti1(void)
+int opti1(block *ctx)
 {
   /* do some clean up */
 
@@ -1037,11 +1291,11 @@ int opti1(void)
 
   rega=regx=regy=undefd;
   i=0; j=0; flag=0;
-  while (i<mpar_num) mpar_flag[i++]=undefd;
+  while (i<ctx->mpar_num) ctx->mpar_flag[i++]=undefd;
 
   i=0;
-  while (i<blkbuf_len) {
-    p=&blkbuf[i];
+  while (i<ctx->blkbuf_len) {
+    p=&ctx->blkbuf[i];
     done=0;
 
     if (p->par!=no_par && (p->depind&mem)==0) { /* mem=0 so its # or a */
@@ -1052,7 +1306,7 @@ int opti1(void)
 	    case as_lda: {
           if (rega==val && val!=undefd && (p->feeds&reg_sr)==0) {
 #           ifdef debug_opti1
-            printf("*** %i redundant lda#\n",i);
+            bprintf(ctx,"*** %i redundant lda#\n",i);
 #           endif
             done=2; }
           else done=1;
@@ -1062,7 +1316,7 @@ int opti1(void)
         case as_ldx: {
           if (regx==val && val!=undefd && (p->feeds&reg_sr)==0) {
 #           ifdef debug_opti1
-            printf("*** %i redundant ldx#\n",i);
+            bprintf(ctx,"*** %i redundant ldx#\n",i);
 #           endif
             done=2; }
           else done=1;
@@ -1072,7 +1326,7 @@ int opti1(void)
         case as_ldy: {
           if (regy==val && val!=undefd && (p->feeds&reg_sr)==0) {
 #           ifdef debug_opti1
-            printf("*** %i redundant ldy#\n",i);
+            bprintf(ctx,"*** %i redundant ldy#\n",i);
 #           endif
             done=2; }
           else done=1;
@@ -1083,17 +1337,17 @@ int opti1(void)
           if ( (val!=undefd && rega!=undefd) || val==0 || rega==0 ) {
             rega&=val;
 #           ifdef debug_opti1
-            printf("### %i known and#-result #%i\n", i, rega);
+            bprintf(ctx,"### %i known and#-result #%i\n", i, rega);
 #           endif
             /* replace "and #nn" with "lda #" */
-            set_absval(p,rega);
+            set_absval(ctx,p,rega);
             p->tok=as_lda;
             p->dep=tok[as_lda].dep; p->flags=tok[as_lda].flags;
             flag=done=1; }
           else {
             if ( (val==0xff) && (p->feeds&reg_sr)==0 ) {
 #             ifdef debug_opti1
-              printf("*** %i redundant and#\n",i);
+              bprintf(ctx,"*** %i redundant and#\n",i);
 #             endif
               done=2; }
             else done=1;
@@ -1102,19 +1356,19 @@ int opti1(void)
 
         case as_ora: {
           if ( (val!=undefd && rega!=undefd) || val==0xff || rega==0xff ) {
-            rega|=val;
+            rega=0xff&(rega|val);
 #           ifdef debug_opti1
-            printf("### %i known ora#-result #%i\n", i, rega);
+            bprintf(ctx,"### %i known ora#-result #%i\n", i, rega);
 #           endif
             /* replace "ora #nn" with "lda #" */
-            set_absval(p,rega);
+            set_absval(ctx,p,rega);
             p->tok=as_lda;
             p->dep=tok[as_lda].dep; p->flags=tok[as_lda].flags;
             flag=done=1; }
           else {
             if ( (val==0) && (p->feeds&reg_sr)==0 ) {
 #             ifdef debug_opti1
-              printf("*** %i redundant ora#\n",i);
+              bprintf(ctx,"*** %i redundant ora#\n",i);
 #             endif
               done=2; }
             else done=1;
@@ -1125,17 +1379,17 @@ int opti1(void)
           if ( val!=undefd && rega!=undefd ) {
             rega^=val;
 #           ifdef debug_opti1
-            printf("### %i known eor#-result #%i\n", i, rega);
+            bprintf(ctx,"### %i known eor#-result #%i\n", i, rega);
 #           endif
             /* replace "eor #nn" with "lda #" */
-            set_absval(p,rega);
+            set_absval(ctx,p,rega);
             p->tok=as_lda;
             p->dep=tok[as_lda].dep; p->flags=tok[as_lda].flags;
             flag=done=1; }
           else {
             if ( (val==0) && (p->feeds&reg_sr)==0 ) {
 #             ifdef debug_opti1
-              printf("*** %i redundant eor#\n",i);
+              bprintf(ctx,"*** %i redundant eor#\n",i);
 #             endif
               done=2; }
             else done=1;
@@ -1145,14 +1399,14 @@ int opti1(void)
 	}
 
     if ( (p->depind & (mem|imem|reg_x|reg_y))==mem ) {
-      par=&mpar_flag[p->mpar];
+      par=&ctx->mpar_flag[p->mpar];
 
       switch (p->tok) {
 
 	    case as_sta: {
           if (*par==rega && rega!=undefd) {
 #           ifdef debug_opti1
-            printf("*** %i redundant sta\n",i);
+            bprintf(ctx,"*** %i redundant sta\n",i);
 #           endif
             done=2; }
           else done=1;
@@ -1162,7 +1416,7 @@ int opti1(void)
 	    case as_stx: {
           if (*par==regx && regx!=undefd) {
 #           ifdef debug_opti1
-            printf("*** %i redundant stx\n",i);
+            bprintf(ctx,"*** %i redundant stx\n",i);
 #           endif
             done=2; }
           else done=1;
@@ -1172,7 +1426,7 @@ int opti1(void)
 	    case as_sty: {
           if (*par==regy && regy!=undefd) {
 #           ifdef debug_opti1
-            printf("*** %i redundant sty\n",i);
+            bprintf(ctx,"*** %i redundant sty\n",i);
 #           endif
             done=2; }
           else done=1;
@@ -1187,58 +1441,58 @@ int opti1(void)
           if ( (*par!=undefd && rega!=undefd) || *par==0 || rega==0 ) {
             rega&=*par;
 #           ifdef debug_opti1
-            printf("*** %i known and-result #%i\n", i, rega);
+            bprintf(ctx,"*** %i known and-result #%i\n", i, rega);
 #           endif
             /* replace "and adr" with "lda #" */
-            set_absval(p,rega);
+            set_absval(ctx,p,rega);
             p->tok=as_lda;
             p->dep=tok[as_lda].dep; p->flags=tok[as_lda].flags;
-            opt++;
+            ctx->opt++;
             flag=done=1; }
           else {
             if ( *par==0xff && (p->feeds&reg_sr)==0 ) {
 #             ifdef debug_opti1
-              printf("*** %i redundant and\n",i);
+              bprintf(ctx,"*** %i redundant and\n",i);
 #             endif
               done=2; }
             else
               if ( *par!=undefd ) {
 #               ifdef debug_opti1
-                printf("*** %i known par #%i of and\n",i,*par);
+                bprintf(ctx,"*** %i known par #%i of and\n",i,*par);
 #               endif
                 /* replace "and adr" with "and #" */
-                set_absval(p,*par);
-                opt++;
+                set_absval(ctx,p,*par);
+                ctx->opt++;
                 flag=done=1; }
             rega=undefd; }
           break; }
 
         case as_ora: {
           if ( (*par!=undefd && rega!=undefd) || *par==0xff || rega==0xff ) {
-            rega|=*par;
+            rega=0xff&(rega|*par);
 #           ifdef debug_opti1
-            printf("*** %i known ora-result #%i\n", i, rega);
+            bprintf(ctx,"*** %i known ora-result #%i\n", i, rega);
 #           endif
             /* replace "ora adr" with "lda #" */
-            set_absval(p,rega);
+            set_absval(ctx,p,rega);
             p->tok=as_lda;
             p->dep=tok[as_lda].dep; p->flags=tok[as_lda].flags;
-            opt++;
+            ctx->opt++;
             flag=done=1; }
           else {
             if ( (*par==0) && (p->feeds&reg_sr)==0 ) {
 #             ifdef debug_opti1
-              printf("*** %i redundant ora\n",i);
+              bprintf(ctx,"*** %i redundant ora\n",i);
 #             endif
               done=2; }
             else
               if ( *par!=undefd ) {
 #               ifdef debug_opti1
-                printf("*** %i known par #%i of ora\n",i,*par);
+                bprintf(ctx,"*** %i known par #%i of ora\n",i,*par);
 #               endif
                 /* replace "ora adr" with "ora #" */
-                set_absval(p,*par);
-                opt++;
+                set_absval(ctx,p,*par);
+                ctx->opt++;
                 flag=done=1; }
             rega=undefd; }
           break; }
@@ -1247,28 +1501,28 @@ int opti1(void)
           if ( *par!=undefd && rega!=undefd ) {
             rega^=*par;
 #           ifdef debug_opti1
-            printf("*** %i known eor-result #%i\n", i, rega);
+            bprintf(ctx,"*** %i known eor-result #%i\n", i, rega);
 #           endif
             /* replace "eor adr" with "lda #" */
-            set_absval(p,rega);
+            set_absval(ctx,p,rega);
             p->tok=as_lda;
             p->dep=tok[as_lda].dep; p->flags=tok[as_lda].flags;
-            opt++;
+            ctx->opt++;
             flag=done=1; }
           else {
             if ( (*par==0) && (p->feeds&reg_sr)==0 ) {
 #             ifdef debug_opti1
-              printf("*** %i redundant eor\n",i);
+              bprintf(ctx,"*** %i redundant eor\n",i);
 #             endif
               done=2; }
             else
               if ( *par!=undefd ) {
 #               ifdef debug_opti1
-                printf("*** %i known par #%i of eor\n",i,*par);
+                bprintf(ctx,"*** %i known par #%i of eor\n",i,*par);
 #               endif
                 /* replace "eor adr" with "eor #" */
-                set_absval(p,*par);
-                opt++;
+                set_absval(ctx,p,*par);
+                ctx->opt++;
                 flag=done=1; }
             rega=undefd; }
           break; }
@@ -1276,12 +1530,12 @@ int opti1(void)
         case as_lda: {
           if (*par!=undefd) {
 #           ifdef debug_opti1
-            printf("*** %i lda #%i\n",i,*par);
+            bprintf(ctx,"*** %i lda #%i\n",i,*par);
 #           endif
             /* replace "lda adr" with "lda #" */
-            set_absval(p,*par);
+            set_absval(ctx,p,*par);
             flag=1;
-            opt++; }
+            ctx->opt++; }
           rega=*par;
           done=1;
           break; }
@@ -1289,11 +1543,11 @@ int opti1(void)
         case as_adc: {
           if (*par!=undefd) {
 #           ifdef debug_opti1
-            printf("*** %i adc #%i\n",i,*par);
+            bprintf(ctx,"*** %i adc #%i\n",i,*par);
 #           endif
             /* replace "adc adr" with "adc #" */
-            set_absval(p,*par);
-            opt++;
+            set_absval(ctx,p,*par);
+            ctx->opt++;
             flag=1; }
           rega=undefd;
           done=1;
@@ -1302,11 +1556,11 @@ int opti1(void)
         case as_sbc: {
           if (*par!=undefd) {
 #           ifdef debug_opti1
-            printf("*** %i sbc #%i\n",i,*par);
+            bprintf(ctx,"*** %i sbc #%i\n",i,*par);
 #           endif
             /* replace "sbc adr" with "sbc #" */
-            set_absval(p,*par);
-            opt++;
+            set_absval(ctx,p,*par);
+            ctx->opt++;
             flag=1; }
           rega=undefd;
           done=1;
@@ -1315,11 +1569,11 @@ int opti1(void)
         case as_cmp: {
           if (*par!=undefd) {
 #           ifdef debug_opti1
-            printf("*** %i cmp #%i\n",i,*par);
+            bprintf(ctx,"*** %i cmp #%i\n",i,*par);
 #           endif
             /* replace "cmp adr" with "cmp #" */
-            set_absval(p,*par);
-            opt++;
+            set_absval(ctx,p,*par);
+            ctx->opt++;
             flag=1; }
           done=1;
           break; }
@@ -1327,11 +1581,11 @@ int opti1(void)
         case as_cpx: {
           if (*par!=undefd) {
 #           ifdef debug_opti1
-            printf("*** %i cpx #%i\n",i,*par);
+            bprintf(ctx,"*** %i cpx #%i\n",i,*par);
 #           endif
             /* replace "cpx adr" with "cpx #" */
-            set_absval(p,*par);
-            opt++;
+            set_absval(ctx,p,*par);
+            ctx->opt++;
             flag=1; }
           done=1;
           break; }
@@ -1339,11 +1593,11 @@ int opti1(void)
         case as_cpy: {
           if (*par!=undefd) {
 #           ifdef debug_opti1
-            printf("*** %i cpy #%i\n",i,*par);
+            bprintf(ctx,"*** %i cpy #%i\n",i,*par);
 #           endif
             /* replace "cpy adr" with "cpy #" */
-            set_absval(p,*par);
-            opt++;
+            set_absval(ctx,p,*par);
+            ctx->opt++;
             flag=1; }
           done=1;
           break; }
@@ -1351,11 +1605,11 @@ int opti1(void)
         case as_ldx: {
           if (*par!=undefd) {
 #           ifdef debug_opti1
-            printf("*** %i ldx #%i\n",i,*par);
+            bprintf(ctx,"*** %i ldx #%i\n",i,*par);
 #           endif
             /* replace "ldx adr" with "ldx #" */
-            set_absval(p,*par);
-            opt++;
+            set_absval(ctx,p,*par);
+            ctx->opt++;
             flag=1; }
           regx=*par;
           done=1;
@@ -1364,11 +1618,11 @@ int opti1(void)
         case as_ldy: {
           if (*par!=undefd) {
 #           ifdef debug_opti1
-            printf("*** %i ldy #%i\n",i,*par);
+            bprintf(ctx,"*** %i ldy #%i\n",i,*par);
 #           endif
             /* replace "ldy adr" with "ldy #" */
-            set_absval(p,*par);
-            opt++;
+            set_absval(ctx,p,*par);
+            ctx->opt++;
             flag=1; }
           regy=*par;
           done=1;
@@ -1382,25 +1636,25 @@ int opti1(void)
       case as_dey: { if (regy!=undefd) regy=0xff&(regy-1); done=1; break; }
 	}
 
-  if (i!=j) line_copy(&blkbuf[j],&blkbuf[i]);
+  if (i!=j) line_copy(&ctx->blkbuf[j],&ctx->blkbuf[i]);
 
   if (done==0) {
     if ( p->mod & reg_a ) rega=undefd;
     if ( p->mod & reg_x ) regx=undefd;
     if ( p->mod & reg_y ) regy=undefd;
-    if ( p->depind & p->mod & mem ) mpar_flag[p->mpar]=undefd;
+    if ( p->depind & p->mod & mem ) ctx->mpar_flag[p->mpar]=undefd;
     j++; }
-  else { if (done==2) { opt++; flag=1; } else j++; }
+  else { if (done==2) { ctx->opt++; flag=1; } else j++; }
 
   i++; }
 
-  blkbuf_len=j;
+  ctx->blkbuf_len=j;
   return (flag);
 }
 
 /*********************************************************************/
 
-int  changeable(int aa, int bb)
+int  changeable(block *ctx, int aa, int bb)
 {
   /* check if commands a,b can be exchanged */
   /* (no check of fixed-flags !)            */
@@ -1408,10 +1662,10 @@ int  changeable(int aa, int bb)
   line *a,*b;
 
 # ifdef debug
-  printf("check %i,%i :",aa,bb);
+  bprintf(ctx,"check %i,%i :",aa,bb);
 # endif
 
-  a=&blkbuf[aa]; b=&blkbuf[bb];
+  a=&ctx->blkbuf[aa]; b=&ctx->blkbuf[bb];
 
   if (a->feeds & b->dep & valid_map) { dbmsg("no\n"); return 0; }
   if (a->mod & b->feeds & valid_map) { dbmsg("no\n"); return 0; }
@@ -1427,25 +1681,26 @@ int  changeable(int aa, int bb)
   return 1;
 }
 
-int no_dep(int a, int b, int map)
+int no_dep(block *ctx, int a, int b, int map)
 {
   while (a<b) {
-    if ( (blkbuf[a].dep & map) ) return 0;
+    if ( (ctx->blkbuf[a].dep & map) ) break;
     a++; }
-  return 1;
+  if (a>ctx->work_read) ctx->work_read=a;
+  return (a==b);
 }
 
 /*********************************************************************/
 
-void repl1(int i, int j, int parsrc, int newtok)
+void repl1(block *ctx, int i, int j, int parsrc, int newtok)
 {
   int x;
   line *lj, *lparsrc;
 
-   if (test_match) return;
+   if (ctx->test_match) return;
 
-  lj=&blkbuf[j];
-  lparsrc=&blkbuf[parsrc];
+  lj=&ctx->blkbuf[j];
+  lparsrc=&ctx->blkbuf[parsrc];
 
   lj->tok    =newtok;
   lj->dep    =tok[newtok].dep | (lparsrc->depind & valid_map);
@@ -1457,46 +1712,46 @@ void repl1(int i, int j, int parsrc, int newtok)
   lj->mparhi =lparsrc->mparhi;
 
 # ifdef debug
-  printf("erase line %i, replace line %i with...\n",i,j);
-  lineout(&blkbuf[j]);
+  bprintf(ctx,"erase line %i, replace line %i with...\n",i,j);
+  lineout(ctx,&ctx->blkbuf[j]);
 # endif
 
 #ifdef VERBOSE
-      printf(";; REMOVED: ");
-    printf(" %s",tok[blkbuf[i].tok].text);
-    if (blkbuf[i].par!=no_par)
+      bprintf(ctx,";; REMOVED: ");
+    bprintf(ctx," %s",tok[ctx->blkbuf[i].tok].text);
+    if (ctx->blkbuf[i].par!=no_par)
 	{
-      printf(" %s",&parbuf[par_pos[blkbuf[i].par]]);
+      bprintf(ctx," %s",&ctx->parbuf[ctx->par_pos[ctx->blkbuf[i].par]]);
 	}
-	printf("\n");
-      printf(";; REPLACED BY: ");
-    printf(" %s",tok[blkbuf[j].tok].text);
-    if (blkbuf[j].par!=no_par)
+	bprintf(ctx,"\n");
+      bprintf(ctx,";; REPLACED BY: ");
+    bprintf(ctx," %s",tok[ctx->blkbuf[j].tok].text);
+    if (ctx->blkbuf[j].par!=no_par)
 	{
-      printf(" %s",&parbuf[par_pos[blkbuf[j].par]]);
+      bprintf(ctx," %s",&ctx->parbuf[ctx->par_pos[ctx->blkbuf[j].par]]);
 	}
-	printf("\n");
+	bprintf(ctx,"\n");
 
 
 #endif
 
 
   x=i;
-  while( x<blkbuf_len ) {
-    line_copy(&blkbuf[x],&blkbuf[x+1]);
+  while( x<ctx->blkbuf_len ) {
+    line_copy(&ctx->blkbuf[x],&ctx->blkbuf[x+1]);
     x++; }
 
-  blkbuf_len--;
-  opt++;
+  ctx->blkbuf_len--;
+  ctx->opt++;
 }
 
-void set_tcom(int j, int com)
+void set_tcom(block *ctx, int j, int com)
 {
   line *lj;
 
-  if (test_match) return;
+  if (ctx->test_match) return;
 
-  lj=&blkbuf[j];
+  lj=&ctx->blkbuf[j];
 
   lj->tok    =com;
   lj->dep    =tok[com].dep;
@@ -1504,12 +1759,12 @@ void set_tcom(int j, int com)
   lj->depind =0;
   lj->flags  =tok[com].flags;
   lj->par    =no_par;
-  opt++;
+  ctx->opt++;
 }
 
 /****************************************************************************/
 
-int add_dep(line *p, int hlp, int map)
+int add_dep(block *ctx, line *p, int hlp, int map)
 {
     hlp=((hlp & ( ~p->mod )) | p->dep) & valid_map;
 
@@ -1519,8 +1774,8 @@ int add_dep(line *p, int hlp, int map)
 
         /* dep: ptr,ptr+1 */
 
-        mpar_flag[p->mpar]|=map;
-        mpar_flag[p->mparhi]|=map;
+        ctx->mpar_flag[p->mpar]|=map;
+        ctx->mpar_flag[p->mparhi]|=map;
 
         if (p->dep&mem) hlp|=imem; }
 
@@ -1528,7 +1783,7 @@ int add_dep(line *p, int hlp, int map)
 
         /* dep: ptr */
 
-        mpar_flag[p->mpar]|=map;
+        ctx->mpar_flag[p->mpar]|=map;
 
         if (p->dep&mem) hlp|=imem; }
 
@@ -1536,8 +1791,8 @@ int add_dep(line *p, int hlp, int map)
 
         /* normal addressed memory (direct) */
 
-        if ( mpar_flag[p->mpar]!=0 && (p->mod & mem)!=0 ) mpar_flag[p->mpar]&=~map;
-        if (p->dep & mem) mpar_flag[p->mpar]|=map;
+        if ( ctx->mpar_flag[p->mpar]!=0 && (p->mod & mem)!=0 ) ctx->mpar_flag[p->mpar]&=~map;
+        if (p->dep & mem) ctx->mpar_flag[p->mpar]|=map;
     }
 
   return hlp;
@@ -1545,18 +1800,53 @@ int add_dep(line *p, int hlp, int map)
 
 #ifdef debug_opti2
 
-void reglistout(int map)
+void reglistout(block *ctx, int map)
 {
   int i;
   i=0;
-  while (i<mpar_num) {
-    if (mpar_flag[i]&map) printf("%s ",&mparbuf[mpar_pos[i]]);
+  while (i<ctx->mpar_num) {
+    if (ctx->mpar_flag[i]&map) bprintf(ctx,"%s ",&ctx->mparbuf[ctx->mpar_pos[i]]);
     i++; }
 }
 
 #endif
 
-int try_sim2(int i, int j)
+/* the lines by par and tok, valid until lines are changed or moved */
+
+void line_index(block *ctx)
+{
+  int len,i,max;
+  line *p;
+
+  len=ctx->blkbuf_len;
+
+  max=ctx->work_index_max;
+  ctx->work_next_par=(int *)grow(ctx->work_next_par,&max,len+1,sizeof(int));
+  max=ctx->work_index_max;
+  ctx->work_next_tok=(int *)grow(ctx->work_next_tok,&max,len+1,sizeof(int));
+  ctx->work_tok_pos=(int *)grow(ctx->work_tok_pos,&ctx->work_index_max,len+1,sizeof(int));
+  ctx->work_limit_par=(int *)grow(ctx->work_limit_par,&ctx->work_par_max,ctx->par_num,sizeof(int));
+
+  for (i=0;i<ctx->par_num;++i) ctx->work_limit_par[i]=len;
+  for (i=0;i<=tok_num;++i) ctx->work_tok_start[i]=0;
+  for (i=0;i<tok_num;++i) ctx->work_limit_tok[i]=len;
+  i=len-1;
+  while (i>=0) {
+    p=&ctx->blkbuf[i];
+    ctx->work_next_tok[i]=ctx->work_limit_tok[p->tok];
+    ctx->work_limit_tok[p->tok]=i;
+    ctx->work_next_par[i]=len;
+    if (p->par!=no_par) {
+      ctx->work_next_par[i]=ctx->work_limit_par[p->par];
+      ctx->work_limit_par[p->par]=i; }
+    ctx->work_tok_start[p->tok+1]++;
+    i--; }
+  for (i=0;i<tok_num;++i) ctx->work_tok_start[i+1]+=ctx->work_tok_start[i];
+  for (i=0;i<tok_num;++i) ctx->work_limit_tok[i]=ctx->work_tok_start[i];
+  for (i=0;i<len;++i) ctx->work_tok_pos[ctx->work_limit_tok[ctx->blkbuf[i].tok]++]=i;
+}
+
+int try_sim2(block *ctx, int i, int j)
 {
   int j_end,x,y;
   int A_dep,A_mod,A_feeds,rest_dep;
@@ -1568,25 +1858,25 @@ int try_sim2(int i, int j)
   /* calculate A.dep, A.mod and A.feeds */
 
   x=0;
-  while (x<mpar_num) mpar_flag[x++]=1; /* all mpar used later */
+  while (x<ctx->mpar_num) ctx->mpar_flag[x++]=1; /* all mpar used later */
 
-  rest_dep=blk_mod|imem;
+  rest_dep=ctx->blk_mod|imem;
 
-  x=blkbuf_len-1;
-  while (x>=j) rest_dep=add_dep(&blkbuf[x--],rest_dep,1);
+  x=ctx->blkbuf_len-1;
+  while (x>=j) rest_dep=add_dep(ctx,&ctx->blkbuf[x--],rest_dep,1);
 
   A_dep=0;
-  while (x>i) A_dep=add_dep(&blkbuf[x--],A_dep,4);
+  while (x>i) A_dep=add_dep(ctx,&ctx->blkbuf[x--],A_dep,4);
 
   A_mod=0;
   x=j-1;
   while (x>i) {
-    A_mod|=blkbuf[x].mod;
-    if( (blkbuf[x].depind & mem)!=0 && (blkbuf[x].mod & mem)!=0 ) {
-      if (blkbuf[x].depind&(imem|reg_x|reg_y)) A_mod|=imem;
+    A_mod|=ctx->blkbuf[x].mod;
+    if( (ctx->blkbuf[x].depind & mem)!=0 && (ctx->blkbuf[x].mod & mem)!=0 ) {
+      if (ctx->blkbuf[x].depind&(imem|reg_x|reg_y)) A_mod|=imem;
       else {
-        mpar_flag[blkbuf[x].mpar]|=8;
-        if (mpar_flag[blkbuf[x].mpar]&1) mpar_flag[blkbuf[x].mpar]|=2; } }
+        ctx->mpar_flag[ctx->blkbuf[x].mpar]|=8;
+        if (ctx->mpar_flag[ctx->blkbuf[x].mpar]&1) ctx->mpar_flag[ctx->blkbuf[x].mpar]|=2; } }
     x--; }
   A_mod&=valid_map|imem;
 
@@ -1594,16 +1884,16 @@ int try_sim2(int i, int j)
 
 #ifdef debug_opti2
 
-  printf("BLOCK A-summaries :");
-  printf("\n  A.dep="); mapout(A_dep);
-  printf("\n        "); reglistout(4);
-  printf("\n  A.mod="); mapout(A_mod);
-  printf("\n        "); reglistout(8);
-  printf("\n A.feed="); mapout(A_feeds);
-  printf("\n        "); reglistout(2);
-  printf("\n  r_dep="); mapout(rest_dep);
-  printf("\n        "); reglistout(1);
-  printf("\n");
+  bprintf(ctx,"BLOCK A-summaries :");
+  bprintf(ctx,"\n  A.dep="); mapout(ctx,A_dep);
+  bprintf(ctx,"\n        "); reglistout(ctx,4);
+  bprintf(ctx,"\n  A.mod="); mapout(ctx,A_mod);
+  bprintf(ctx,"\n        "); reglistout(ctx,8);
+  bprintf(ctx,"\n A.feed="); mapout(ctx,A_feeds);
+  bprintf(ctx,"\n        "); reglistout(ctx,2);
+  bprintf(ctx,"\n  r_dep="); mapout(ctx,rest_dep);
+  bprintf(ctx,"\n        "); reglistout(ctx,1);
+  bprintf(ctx,"\n");
 
 #endif
 
@@ -1612,15 +1902,15 @@ int try_sim2(int i, int j)
   /*  1) B_mod must not match A_dep  */
 
   j_end=j+1;
-  while (j_end<blkbuf_len) {
-    if (blkbuf[j_end].mod & A_dep) break;
-    if( (blkbuf[j_end].depind & mem)!=0 && (blkbuf[j_end].mod & mem)!=0 ) {
-      if ((blkbuf[j_end].depind&(imem|reg_x|reg_y))!=0 && (A_dep&imem)!=0) break;
-      else if (mpar_flag[blkbuf[j_end].mpar]&4) break; }
+  while (j_end<ctx->blkbuf_len) {
+    if (ctx->blkbuf[j_end].mod & A_dep) break;
+    if( (ctx->blkbuf[j_end].depind & mem)!=0 && (ctx->blkbuf[j_end].mod & mem)!=0 ) {
+      if ((ctx->blkbuf[j_end].depind&(imem|reg_x|reg_y))!=0 && (A_dep&imem)!=0) break;
+      else if (ctx->mpar_flag[ctx->blkbuf[j_end].mpar]&4) break; }
     j_end++; }
 
 # ifdef debug_opti2
-  printf("found j_end_max=%i\n",j_end);
+  bprintf(ctx,"found j_end_max=%i\n",j_end);
 # endif
 
   while (j_end>j+1) {
@@ -1628,25 +1918,25 @@ int try_sim2(int i, int j)
     /*  2) calculate Brest_dep, B_mod (B_feeds must not match A_mod) */
 
     x=0;
-    while (x<mpar_num) {
-      mpar_flag[x]=(mpar_flag[x]&15)|16; /* all mpar used later */
+    while (x<ctx->mpar_num) {
+      ctx->mpar_flag[x]=(ctx->mpar_flag[x]&15)|16; /* all mpar used later */
       x++; }
 
-    Brest_dep=blk_mod|imem;
+    Brest_dep=ctx->blk_mod|imem;
 
-    x=blkbuf_len-1;
-    while (x>=j_end) Brest_dep=add_dep(&blkbuf[x--],Brest_dep,16);
+    x=ctx->blkbuf_len-1;
+    while (x>=j_end) Brest_dep=add_dep(ctx,&ctx->blkbuf[x--],Brest_dep,16);
 
     B_mod=0; y=0; /* y used as flag */
     x=j_end-1;
     while (x>=j && y==0) {
-      B_mod|=blkbuf[x].mod;
-      if( (blkbuf[x].depind & mem)!=0 && (blkbuf[x].mod & mem)!=0 ) {
-        if (blkbuf[x].depind&(imem|reg_x|reg_y)) B_mod|=imem;
+      B_mod|=ctx->blkbuf[x].mod;
+      if( (ctx->blkbuf[x].depind & mem)!=0 && (ctx->blkbuf[x].mod & mem)!=0 ) {
+        if (ctx->blkbuf[x].depind&(imem|reg_x|reg_y)) B_mod|=imem;
         else {
-          if ( (mpar_flag[blkbuf[x].mpar]&4)!=0 )
+          if ( (ctx->mpar_flag[ctx->blkbuf[x].mpar]&4)!=0 )
             { y=1; continue; } /* B_mod matched A_dep */
-          if ( (mpar_flag[blkbuf[x].mpar]&(16|8))==(16|8) )
+          if ( (ctx->mpar_flag[ctx->blkbuf[x].mpar]&(16|8))==(16|8) )
             { y=1; continue; } /* B_feeds matched A_mod */
         }
       }
@@ -1657,8 +1947,8 @@ int try_sim2(int i, int j)
     B_mod&=valid_map|imem;
 
 #ifdef debug
-    printf(";; Brest_dep = "); mapout(Brest_dep); printf("\n");
-    printf(";; B_mod     = "); mapout(B_mod); printf("\n");
+    bprintf(ctx,";; Brest_dep = "); mapout(ctx,Brest_dep); bprintf(ctx,"\n");
+    bprintf(ctx,";; B_mod     = "); mapout(ctx,B_mod); bprintf(ctx,"\n");
 #endif
     if (Brest_dep & B_mod & A_mod) { j_end--; continue; }; /* B_feeds matches A_mod so skip */
 
@@ -1670,23 +1960,23 @@ int try_sim2(int i, int j)
 
     B_dep=0;
     x=j_end-1;
-    while (x>=j) B_dep=add_dep(&blkbuf[x--],B_dep,32);
+    while (x>=j) B_dep=add_dep(ctx,&ctx->blkbuf[x--],B_dep,32);
 
     if (B_dep & A_feeds & (valid_map|imem)) { j_end--; continue; }
 
     x=0;
-    while (x<mpar_num && (mpar_flag[x]&(2|32))!=(2|32) ) x++;
-    if (x!=mpar_num) { j_end--; continue; }
+    while (x<ctx->mpar_num && (ctx->mpar_flag[x]&(2|32))!=(2|32) ) x++;
+    if (x!=ctx->mpar_num) { j_end--; continue; }
 
     break;
 
   }
 
 # ifdef debug_opti2
-  printf("j_end is %i\n\n",j_end);
+  bprintf(ctx,"j_end is %i\n\n",j_end);
 # endif
 
-  if (j_end>=blkbuf_len) {
+  if (j_end>=ctx->blkbuf_len) {
     dbmsg("### no need to move\n");
     return 0; }
 
@@ -1696,7 +1986,7 @@ int try_sim2(int i, int j)
 
   x=j_end-j-1;
   while (x>=0) {
-    iline_copy(blkbuf_len+x, j+x);
+    iline_copy(ctx->blkbuf_len+x, j+x);
     x--; }
   x=j-i-2;
   y=i+(j_end-j)+1;
@@ -1705,65 +1995,66 @@ int try_sim2(int i, int j)
     x--; }
   x=j_end-j-1;
   while (x>=0) {
-    iline_copy(i+1+x, blkbuf_len+x);
+    iline_copy(i+1+x, ctx->blkbuf_len+x);
     x--; }
   return 1;
 
 }
 
-int opti2()
+int opti2(block *ctx)
 {
-  int i,j;
+  int i,j,x;
   int flag;
   line *tmp,*il,*jl;
 
   /* Search for "sta tmp,...,lda tmp" and try to simplify */
 
-  tmp=&blkbuf[blkbuf_len];
-  test_match=0;
+  tmp=&ctx->blkbuf[ctx->blkbuf_len];
+  ctx->test_match=0;
 
   /* first move all "cl/se ldy #,iny,dey" up as much as possible */
 
   i=0;
-  while (i<blkbuf_len) {
-    if (blkbuf[i].flags & isinit) {
-      if ( blkbuf[i].tok==as_ldy && (blkbuf[i].depind & mem)!=0 ) { i++; continue; }
+  while (i<ctx->blkbuf_len) {
+    if (ctx->blkbuf[i].flags & isinit) {
+      if ( ctx->blkbuf[i].tok==as_ldy && (ctx->blkbuf[i].depind & mem)!=0 ) { i++; continue; }
       j=i-1;
-      while (j>=0 && changeable(j,j+1)) {
-        il=&blkbuf[j+1];
-        jl=&blkbuf[j--];
+      while (j>=0 && changeable(ctx,j,j+1)) {
+        il=&ctx->blkbuf[j+1];
+        jl=&ctx->blkbuf[j--];
         line_copy(tmp,il);
         line_copy(il,jl);
         line_copy(jl,tmp); } }
   i++; }
 
-  make_feedlist();
+  make_feedlist(ctx);
+  line_index(ctx);
 
   /* search for "sta tmp,lda tmp" or "tax,txa" */
 
   i=0;
-  while (i<blkbuf_len) {
-    if (blkbuf[i].tok==as_sta && (blkbuf[i].depind&(reg_x|reg_y))==0) {
-      j=i+1;
-      while (j<blkbuf_len) {
-        if (blkbuf[j].par==blkbuf[i].par && blkbuf[j].tok==as_lda) {
+  while (i<ctx->blkbuf_len) {
+    if (ctx->blkbuf[i].tok==as_sta && (ctx->blkbuf[i].depind&(reg_x|reg_y))==0) {
+      j=ctx->work_next_par[i];
+      while (j<ctx->blkbuf_len) {
+        if (ctx->blkbuf[j].tok==as_lda) {
 #         ifdef debug
-          printf("### found sta/lda at %i/%i\n",i,j);
+          bprintf(ctx,"### found sta/lda at %i/%i\n",i,j);
 #         endif
-          if (try_sim2(i,j)) return 1; }
-        else if (blkbuf[j].par==blkbuf[i].par) break;
-	  j++; }
+          if (try_sim2(ctx,i,j)) return 1; }
+        else break;
+	  j=ctx->work_next_par[j]; }
 	}
 
-    if (blkbuf[i].tok==as_tax) {
+    if (ctx->blkbuf[i].tok==as_tax) {
       j=i+1;
-      while (j<blkbuf_len) {
-        if (blkbuf[j].tok==as_txa) {
+      while (j<ctx->blkbuf_len) {
+        if (ctx->blkbuf[j].tok==as_txa) {
 #         ifdef debug
-          printf("### found tax/txa at %i/%i\n",i,j);
+          bprintf(ctx,"### found tax/txa at %i/%i\n",i,j);
 #         endif
-          if (try_sim2(i,j)) return 1; }
-        else if (blkbuf[j].dep&reg_x) break;
+          if (try_sim2(ctx,i,j)) return 1; }
+        else if (ctx->blkbuf[j].dep&reg_x) break;
       j++; }
 	}
 
@@ -1775,40 +2066,42 @@ int opti2()
   /* first move all "ldy #" down as much as possible */
 
   i=0;
-  while (i<blkbuf_len) {
-    if (blkbuf[i].tok==as_ldy && (blkbuf[i].depind&mem)==0) {
+  while (i<ctx->blkbuf_len) {
+    if (ctx->blkbuf[i].tok==as_ldy && (ctx->blkbuf[i].depind&mem)==0) {
       j=i;
-      while (j<blkbuf_len-1 && changeable(j,j+1)) {
-        il=&blkbuf[j+1];
-        jl=&blkbuf[j++];
+      while (j<ctx->blkbuf_len-1 && changeable(ctx,j,j+1)) {
+        il=&ctx->blkbuf[j+1];
+        jl=&ctx->blkbuf[j++];
         line_copy(tmp,il);
         line_copy(il,jl);
         line_copy(jl,tmp); } }
   i++; }
 
-  make_feedlist();
+  make_feedlist(ctx);
+  line_index(ctx);
 
   i=0;
-  while (i<blkbuf_len) {
-    if (blkbuf[i].tok==as_sta && (blkbuf[i].depind&(reg_x|reg_y))==0) {
-      j=i+1; flag=blkbuf[i].passes;
-      while (j<blkbuf_len) {
-        flag|=blkbuf[j].mod|blkbuf[j].dep;
-        if (blkbuf[j].par==blkbuf[i].par && blkbuf[j].tok==as_lda && (blkbuf[j].passes & mem)==0 ) {
+  while (i<ctx->blkbuf_len) {
+    if (ctx->blkbuf[i].tok==as_sta && (ctx->blkbuf[i].depind&(reg_x|reg_y))==0) {
+      j=ctx->work_next_par[i]; flag=ctx->blkbuf[i].passes;
+      x=i+1;
+      while (j<ctx->blkbuf_len) {
+        while (x<=j) { flag|=ctx->blkbuf[x].mod|ctx->blkbuf[x].dep; x++; }
+        if (ctx->blkbuf[j].tok==as_lda && (ctx->blkbuf[j].passes & mem)==0 ) {
 #         ifdef debug
-          printf("### again sta/lda at %i/%i\n",i,j);
+          bprintf(ctx,"### again sta/lda at %i/%i\n",i,j);
 #         endif
           /* if y or x unused inbetween, then replace */
           if ( (flag & reg_y)==0 ) {
             dbmsg("*** replace sta,lda -> tay,tya\n");
-            set_tcom(i,as_tay); set_tcom(j,as_tya);
+            set_tcom(ctx,i,as_tay); set_tcom(ctx,j,as_tya);
             return 1; }
           if ( (flag & reg_x)==0 ) {
             dbmsg("*** replace sta,lda -> tax,txa\n");
-            set_tcom(i,as_tax); set_tcom(j,as_txa);
+            set_tcom(ctx,i,as_tax); set_tcom(ctx,j,as_txa);
             return 1; } }
-        else if (blkbuf[j].par==blkbuf[i].par) break;
-	  j++; }
+        else break;
+	  j=ctx->work_next_par[j]; }
 	}
   i++; }
 
@@ -1817,252 +2110,252 @@ int opti2()
 
 /****************************************************************************/
 
-int com_match2_default(int j)
+int com_match2_default(block *ctx, int j)
 {
-  if ( (com_match_lptr->flags & dupl)==0    && \
-       com_match_lptr->tok==blkbuf[j].tok   && \
-       com_match_lptr->par==blkbuf[j].par        ) {
-    op2msg("duplicated command\n");
-    repl1(com_match_lnum,j,com_match_lnum,com_match_lptr->tok);
+  if ( (ctx->com_match_lptr->flags & dupl)==0    && \
+       ctx->com_match_lptr->tok==ctx->blkbuf[j].tok   && \
+       ctx->com_match_lptr->par==ctx->blkbuf[j].par        ) {
+    op2msg(ctx,"duplicated command\n");
+    repl1(ctx,ctx->com_match_lnum,j,ctx->com_match_lnum,ctx->com_match_lptr->tok);
     return 1; }
   
   return 0;
 }
 
-int com_match2_tax(int j)
+int com_match2_tax(block *ctx, int j)
 {
   line *b;
-  b=&blkbuf[j];
+  b=&ctx->blkbuf[j];
 
   if (b->tok==as_txa) { 
-    op2msg("tax,txa -> tax\n"); 
-    repl1(com_match_lnum,j,com_match_lnum,as_tax); 
+    op2msg(ctx,"tax,txa -> tax\n"); 
+    repl1(ctx,ctx->com_match_lnum,j,ctx->com_match_lnum,as_tax); 
     return 1; }
 
   if (b->tok==as_stx && (b->passes & reg_x)==0) {
-    if (!no_dep(com_match_lnum,j,reg_x)) return 0;
-    op2msg("tax,stx -> sta\n"); 
-    repl1(com_match_lnum,j,j,as_sta); 
+    if (!no_dep(ctx,ctx->com_match_lnum,j,reg_x)) return 0;
+    op2msg(ctx,"tax,stx -> sta\n"); 
+    repl1(ctx,ctx->com_match_lnum,j,j,as_sta); 
     return 1; }
 
-  return com_match2_default(j);
+  return com_match2_default(ctx,j);
 }
 
-int com_match2_txa(int j)
+int com_match2_txa(block *ctx, int j)
 {
   line *b;
-  b=&blkbuf[j];
+  b=&ctx->blkbuf[j];
 
   if (b->tok==as_tax) { 
-    op2msg("txa,tax -> txa\n"); 
-    repl1(com_match_lnum,j,com_match_lnum,as_txa); 
+    op2msg(ctx,"txa,tax -> txa\n"); 
+    repl1(ctx,ctx->com_match_lnum,j,ctx->com_match_lnum,as_txa); 
     return 1; }
 
   if ( b->tok==as_sta && (b->dep&(reg_x|reg_y))==0 && (b->passes & reg_a)==0 ) {
-    if (!no_dep(com_match_lnum,j,reg_a)) return 0;
-    op2msg("txa,sta -> stx\n");
-    repl1(com_match_lnum,j,j,as_stx); 
+    if (!no_dep(ctx,ctx->com_match_lnum,j,reg_a)) return 0;
+    op2msg(ctx,"txa,sta -> stx\n");
+    repl1(ctx,ctx->com_match_lnum,j,j,as_stx); 
     return 1; }
 
-  return com_match2_default(j);
+  return com_match2_default(ctx,j);
 }
 
-int com_match2_tay(int j)
+int com_match2_tay(block *ctx, int j)
 {
   line *b;
-  b=&blkbuf[j];
+  b=&ctx->blkbuf[j];
 
   if (b->tok==as_tya) { 
-    op2msg("tay,tya -> tay\n"); 
-    repl1(com_match_lnum,j,com_match_lnum,as_tay); 
+    op2msg(ctx,"tay,tya -> tay\n"); 
+    repl1(ctx,ctx->com_match_lnum,j,ctx->com_match_lnum,as_tay); 
     return 1; }
 
   if (b->tok==as_sty && (b->passes & reg_y)==0) {
-    if (!no_dep(com_match_lnum,j,reg_y)) return 0;
-    op2msg("tay,sty -> sta\n"); 
-    repl1(com_match_lnum,j,j,as_sta); 
+    if (!no_dep(ctx,ctx->com_match_lnum,j,reg_y)) return 0;
+    op2msg(ctx,"tay,sty -> sta\n"); 
+    repl1(ctx,ctx->com_match_lnum,j,j,as_sta); 
     return 1; }
 
-  return com_match2_default(j);
+  return com_match2_default(ctx,j);
 }
 
-int com_match2_tya(int j)
+int com_match2_tya(block *ctx, int j)
 {
   line *b;
-  b=&blkbuf[j];
+  b=&ctx->blkbuf[j];
 
   if (b->tok==as_tay) { 
-    op2msg("tya,tay -> tya\n");
-    repl1(com_match_lnum,j,com_match_lnum,as_tya); 
+    op2msg(ctx,"tya,tay -> tya\n");
+    repl1(ctx,ctx->com_match_lnum,j,ctx->com_match_lnum,as_tya); 
     return 1; }
 
   if ( b->tok==as_sta && (b->dep&(reg_x|reg_y))==0 && (b->passes & reg_a)==0 ) {
-    if (!no_dep(com_match_lnum,j,reg_a)) return 0;
-    op2msg("tya,sta -> sty\n"); 
-    repl1(com_match_lnum,j,j,as_sty); 
+    if (!no_dep(ctx,ctx->com_match_lnum,j,reg_a)) return 0;
+    op2msg(ctx,"tya,sta -> sty\n"); 
+    repl1(ctx,ctx->com_match_lnum,j,j,as_sty); 
     return 1; }
 
-  return com_match2_default(j);
+  return com_match2_default(ctx,j);
 }
 
-int com_match2_txs(int j)
+int com_match2_txs(block *ctx, int j)
 {
-  if (blkbuf[j].tok==as_tsx) {
-    op2msg("txs,tsx -> txs\n");
-    repl1(com_match_lnum,j,com_match_lnum,as_txs);
+  if (ctx->blkbuf[j].tok==as_tsx) {
+    op2msg(ctx,"txs,tsx -> txs\n");
+    repl1(ctx,ctx->com_match_lnum,j,ctx->com_match_lnum,as_txs);
     return 1; }
 
-  return com_match2_default(j);
+  return com_match2_default(ctx,j);
 }
 
-int com_match2_tsx(int j)
+int com_match2_tsx(block *ctx, int j)
 {
-  if (blkbuf[j].tok==as_txs) {
-    op2msg("tsx,txs -> tsx\n"); 
-    repl1(com_match_lnum,j,com_match_lnum,as_tsx); 
+  if (ctx->blkbuf[j].tok==as_txs) {
+    op2msg(ctx,"tsx,txs -> tsx\n"); 
+    repl1(ctx,ctx->com_match_lnum,j,ctx->com_match_lnum,as_tsx); 
     return 1; }
 
-  return com_match2_default(j);
+  return com_match2_default(ctx,j);
 }
 
-int com_match2_lda(int j)
+int com_match2_lda(block *ctx, int j)
 {
   line *b;
-  b=&blkbuf[j];
+  b=&ctx->blkbuf[j];
 
-  if ( (b->passes & reg_a)==0 && (com_match_lptr->dep&(reg_x|reg_y))==0 )
+  if ( (b->passes & reg_a)==0 && (ctx->com_match_lptr->dep&(reg_x|reg_y))==0 )
   {
     if (b->tok==as_tax) {
-      if (!no_dep(com_match_lnum,j,reg_a)) return 0;
-      op2msg("lda,tax -> ldx\n");
-      repl1(com_match_lnum,j,com_match_lnum,as_ldx);
+      if (!no_dep(ctx,ctx->com_match_lnum,j,reg_a)) return 0;
+      op2msg(ctx,"lda,tax -> ldx\n");
+      repl1(ctx,ctx->com_match_lnum,j,ctx->com_match_lnum,as_ldx);
       return 1; }
     if (b->tok==as_tay) {
-      if (!no_dep(com_match_lnum,j,reg_a)) return 0;
-      op2msg("lda,tay -> ldy\n");
-      repl1(com_match_lnum,j,com_match_lnum,as_ldy);
+      if (!no_dep(ctx,ctx->com_match_lnum,j,reg_a)) return 0;
+      op2msg(ctx,"lda,tay -> ldy\n");
+      repl1(ctx,ctx->com_match_lnum,j,ctx->com_match_lnum,as_ldy);
       return 1; }
   }
 
-  if ( b->tok==as_sta && com_match_lptr->par==blkbuf[j].par ) { 
-    op2msg("lda,sta -> lda\n"); 
-    repl1(com_match_lnum,j,com_match_lnum,as_lda); 
+  if ( b->tok==as_sta && ctx->com_match_lptr->par==ctx->blkbuf[j].par ) { 
+    op2msg(ctx,"lda,sta -> lda\n"); 
+    repl1(ctx,ctx->com_match_lnum,j,ctx->com_match_lnum,as_lda); 
     return 1; }
 
-  return com_match2_default(j);
+  return com_match2_default(ctx,j);
 }
 
-int com_match2_ldx(int j)
+int com_match2_ldx(block *ctx, int j)
 {
   line *b;
-  b=&blkbuf[j];
+  b=&ctx->blkbuf[j];
 
   if (b->tok==as_txa && (b->passes & reg_x)==0) {
-    if (!no_dep(com_match_lnum,j,reg_x)) return 0;
-    op2msg("ldx,txa -> lda\n"); 
-    repl1(com_match_lnum,j,com_match_lnum,as_lda); 
+    if (!no_dep(ctx,ctx->com_match_lnum,j,reg_x)) return 0;
+    op2msg(ctx,"ldx,txa -> lda\n"); 
+    repl1(ctx,ctx->com_match_lnum,j,ctx->com_match_lnum,as_lda); 
     return 1; }
 
-  if ( b->tok==as_stx && com_match_lptr->par==b->par ) {
-    op2msg("ldx,stx -> ldx\n"); 
-    repl1(com_match_lnum,j,com_match_lnum,as_ldx); 
+  if ( b->tok==as_stx && ctx->com_match_lptr->par==b->par ) {
+    op2msg(ctx,"ldx,stx -> ldx\n"); 
+    repl1(ctx,ctx->com_match_lnum,j,ctx->com_match_lnum,as_ldx); 
     return 1; }
 
-  return com_match2_default(j);
+  return com_match2_default(ctx,j);
 }
 
-int com_match2_ldy(int j)
+int com_match2_ldy(block *ctx, int j)
 {
   line *b;
-  b=&blkbuf[j];
+  b=&ctx->blkbuf[j];
 
   if (b->tok==as_tya && (b->passes & reg_y)==0) { 
-    if (!no_dep(com_match_lnum,j,reg_y)) return 0;
-    op2msg("ldy,tya -> lda\n");
-    repl1(com_match_lnum,j,com_match_lnum,as_lda); 
+    if (!no_dep(ctx,ctx->com_match_lnum,j,reg_y)) return 0;
+    op2msg(ctx,"ldy,tya -> lda\n");
+    repl1(ctx,ctx->com_match_lnum,j,ctx->com_match_lnum,as_lda); 
     return 1; }
 
-  if ( b->tok==as_sty && com_match_lptr->par==b->par ) {
-    op2msg("ldy,sty -> ldy\n");
-    repl1(com_match_lnum,j,com_match_lnum,as_ldy); 
+  if ( b->tok==as_sty && ctx->com_match_lptr->par==b->par ) {
+    op2msg(ctx,"ldy,sty -> ldy\n");
+    repl1(ctx,ctx->com_match_lnum,j,ctx->com_match_lnum,as_ldy); 
     return 1; }
 
-  return com_match2_default(j);
+  return com_match2_default(ctx,j);
 }
 
-int com_match2_sta(int j)
+int com_match2_sta(block *ctx, int j)
 {
   line *b;
-  b=&blkbuf[j];
+  b=&ctx->blkbuf[j];
 
-  if (com_match_lptr->par==b->par) {
+  if (ctx->com_match_lptr->par==b->par) {
     if (b->tok==as_lda) { 
-      op2msg("sta,lda -> sta\n"); 
-      repl1(com_match_lnum,j,com_match_lnum,as_sta);
+      op2msg(ctx,"sta,lda -> sta\n"); 
+      repl1(ctx,ctx->com_match_lnum,j,ctx->com_match_lnum,as_sta);
       return 1; }
     if (b->tok==as_ldx) { 
-      op2msg("sta,ldx -> sta,tax\n"); 
-      set_tcom(j,as_tax);
+      op2msg(ctx,"sta,ldx -> sta,tax\n"); 
+      set_tcom(ctx,j,as_tax);
       return 1; }
     if (b->tok==as_ldy) {
-      op2msg("sta,ldy -> sta,tay\n"); 
-      set_tcom(j,as_tay); 
+      op2msg(ctx,"sta,ldy -> sta,tay\n"); 
+      set_tcom(ctx,j,as_tay); 
       return 1; }
   }
 
-  return com_match2_default(j);
+  return com_match2_default(ctx,j);
 }
 
-int com_match2_stx(int j)
+int com_match2_stx(block *ctx, int j)
 {
   line *b;
-  b=&blkbuf[j];
+  b=&ctx->blkbuf[j];
 
-  if (com_match_lptr->par==b->par) {
+  if (ctx->com_match_lptr->par==b->par) {
     if (b->tok==as_ldx) { 
-      op2msg("stx,ldx -> stx\n"); 
-      repl1(com_match_lnum,j,com_match_lnum,as_stx); 
+      op2msg(ctx,"stx,ldx -> stx\n"); 
+      repl1(ctx,ctx->com_match_lnum,j,ctx->com_match_lnum,as_stx); 
       return 1; }
     if (b->tok==as_lda) {
-      op2msg("stx,lda -> stx,txa\n"); 
-      set_tcom(j,as_txa); 
+      op2msg(ctx,"stx,lda -> stx,txa\n"); 
+      set_tcom(ctx,j,as_txa); 
       return 1; }
   }
 
-  return com_match2_default(j);
+  return com_match2_default(ctx,j);
 }
 
-int com_match2_sty(int j)
+int com_match2_sty(block *ctx, int j)
 {
   line *b;
-  b=&blkbuf[j];
+  b=&ctx->blkbuf[j];
 
-  if (com_match_lptr->par==b->par) {
+  if (ctx->com_match_lptr->par==b->par) {
     if (b->tok==as_ldy) {
-      op2msg("sty,ldy -> sty\n"); 
-      repl1(com_match_lnum,j,com_match_lnum,as_sty); 
+      op2msg(ctx,"sty,ldy -> sty\n"); 
+      repl1(ctx,ctx->com_match_lnum,j,ctx->com_match_lnum,as_sty); 
       return 1; }
     if (b->tok==as_lda) { 
-      op2msg("sty,lda -> sty,tya\n");
-      set_tcom(j,as_tya); 
+      op2msg(ctx,"sty,lda -> sty,tya\n");
+      set_tcom(ctx,j,as_tya); 
       return 1; }
   }
 
-  return com_match2_default(j);
+  return com_match2_default(ctx,j);
 }
 
 /****************************************************************************/
 
-int (*com_match1(int i))()
+int (*com_match1(block *ctx, int i))(block *, int)
 {
   /* find match for first command (of two) and return pointer to com_match2-function */
 
   dbmsg("com_match1\n");
 
-  com_match_lnum=i;
-  com_match_lptr=&blkbuf[i];
+  ctx->com_match_lnum=i;
+  ctx->com_match_lptr=&ctx->blkbuf[i];
 
-  switch (com_match_lptr->tok) {
+  switch (ctx->com_match_lptr->tok) {
     case as_tax: return com_match2_tax;
     case as_txa: return com_match2_txa;
     case as_tay: return com_match2_tay;
@@ -2080,52 +2373,246 @@ int (*com_match1(int i))()
   return NULL;
 }
 
-int opti3()
+/* first and second command of the pairs com_match2_* merge, besides
+   equal commands and commands with the same parameter, and what the
+   second one must not pass on for that */
+
+static int pair_tok[][3]={
+  { as_tax, as_txa, 0     }, { as_tax, as_stx, reg_x },
+  { as_txa, as_tax, 0     }, { as_txa, as_sta, reg_a },
+  { as_tay, as_tya, 0     }, { as_tay, as_sty, reg_y },
+  { as_tya, as_tay, 0     }, { as_tya, as_sta, reg_a },
+  { as_txs, as_tsx, 0     }, { as_tsx, as_txs, 0     },
+  { as_lda, as_tax, reg_a }, { as_lda, as_tay, reg_a },
+  { as_ldx, as_txa, reg_x }, { as_ldy, as_tya, reg_y } };
+
+#define pair_num (int)(sizeof(pair_tok)/sizeof(pair_tok[0]))
+
+/* the command may be the second one of a pair */
+
+int second_tok(line *p)
+{
+  int k;
+
+  if ((p->flags & dupl)==0) return 1;
+  switch (p->tok) {
+    case as_lda: case as_ldx: case as_ldy:
+    case as_sta: case as_stx: case as_sty: return 1; }
+  for (k=0;k<pair_num;++k)
+    if (pair_tok[k][1]==p->tok) return 1;
+  return 0;
+}
+
+int same_line(line *a, line *b)
+{
+  return ( a->tok==b->tok && a->dep==b->dep && a->mod==b->mod &&
+           a->depind==b->depind && a->flags==b->flags &&
+           a->feeds==b->feeds && a->passes==b->passes && a->par==b->par &&
+           a->mpar==b->mpar && a->mparhi==b->mparhi );
+}
+
+/* opti3 stops at the first pair it changes and is called again on the
+   whole block, so a line whose try found nothing is only tried again if
+   that may find something now. That is, if since the last call
+     - the line itself has changed,
+     - a line it has read has changed (up to where it stopped, or no_dep),
+     - or a changed line, or a line moved over one, may now be merged
+       with it (see the second loop of opti3).
+   A line has changed if it is new, differs from what it was, or has
+   other neighbours (something was moved or removed next to it). */
+
+void opti3_work(block *ctx)
+{
+  int len,i,k,x,y,s,max,last;
+  int *count;
+  line *p,*q;
+
+  len=ctx->blkbuf_len;
+
+  max=ctx->work_serial_max;
+  ctx->work_where=(int *)grow(ctx->work_where,&max,ctx->serial_num,sizeof(int));
+  max=ctx->work_serial_max;
+  ctx->work_reach=(int *)grow(ctx->work_reach,&max,ctx->serial_num,sizeof(int));
+  ctx->work_pending=(char *)grow(ctx->work_pending,&ctx->work_serial_max,ctx->serial_num,1);
+  max=ctx->work_max;
+  count=ctx->work_count=(int *)grow(ctx->work_count,&max,len+1,sizeof(int));
+  ctx->work_last=(line *)grow(ctx->work_last,&ctx->work_max,len+1,sizeof(line));
+  ctx->work_limit_par=(int *)grow(ctx->work_limit_par,&ctx->work_par_max,ctx->par_num,sizeof(int));
+
+  /* the lines that have changed, counted */
+
+  count[0]=0;
+  i=0;
+  while (i<len) {
+    p=&ctx->blkbuf[i];
+    s=p->serial;
+    k=ctx->work_where[s];
+    count[i+1]=count[i]+1;
+    if (k<0 || k>=ctx->work_len || ctx->work_last[k].serial!=s) {
+      ctx->work_pending[s]=1;
+      ctx->work_reach[s]=0; }
+    else if ( same_line(p,&ctx->work_last[k]) &&
+              (i==0)==(k==0) && (i==len-1)==(k==ctx->work_len-1) &&
+              (i==0 || ctx->blkbuf[i-1].serial==ctx->work_last[k-1].serial) &&
+              (i==len-1 || ctx->blkbuf[i+1].serial==ctx->work_last[k+1].serial) )
+      count[i+1]=count[i];
+    i++; }
+
+  /* the last line x of a possible new pair with a line of a tok or par,
+     if x or one of the lines x is moved over has changed */
+
+  for (i=0;i<tok_num;++i) ctx->work_limit_tok[i]=ctx->work_limit_pair[i]=-1;
+  for (i=0;i<ctx->par_num;++i) ctx->work_limit_par[i]=-1;
+  last=-1;
+  x=0;
+  while (x<len) {
+    if (count[x+1]>count[x]) last=x;
+    if (last<0 || !second_tok(&ctx->blkbuf[x])) { x++; continue; }
+    y=x-1;
+    while (y>last && changeable(ctx,y,x)) y--;
+    if (x==last || y==last) {
+      q=&ctx->blkbuf[x];
+      if (q->par==no_par) ctx->work_limit_tok[q->tok]=x;
+      for (k=0;k<pair_num;++k)
+        if (pair_tok[k][1]==q->tok && (q->passes & pair_tok[k][2])==0)
+          ctx->work_limit_pair[pair_tok[k][0]]=x;
+      if (q->par!=no_par) ctx->work_limit_par[q->par]=x; }
+    x++; }
+
+  /* the lines to try again */
+
+  i=0;
+  while (i<len) {
+    p=&ctx->blkbuf[i];
+    s=p->serial;
+    k=i+1+ctx->work_reach[s];
+    if (k>len) k=len;
+    if ( count[i+1]>count[i] || count[k]>count[i+1] ||
+         ((p->flags & dupl)==0 && ctx->work_limit_tok[p->tok]>i) ||
+         ctx->work_limit_pair[p->tok]>i ||
+         (p->par!=no_par && ctx->work_limit_par[p->par]>i) )
+      ctx->work_pending[s]=1;
+    i++; }
+
+  /* what the tries of this call see */
+
+  i=0;
+  while (i<len) {
+    line_copy(&ctx->work_last[i],&ctx->blkbuf[i]);
+    ctx->work_where[ctx->blkbuf[i].serial]=i;
+    i++; }
+  ctx->work_len=len;
+}
+
+/* the second commands for first command i: every line after j that
+   com_match2_* may take, the same par or tok or a pair of pair_tok */
+
+void pair_first(block *ctx, int i, int j)
+{
+  line *p;
+  int k,t,a,b,m;
+
+  p=&ctx->blkbuf[i];
+  ctx->work_cur_par=ctx->work_next_par[i];
+  ctx->work_cur_tok=ctx->blkbuf_len;
+  if (p->par==no_par && (p->flags & dupl)==0)
+    ctx->work_cur_tok=ctx->work_next_tok[i];
+
+  ctx->work_pairs=0;
+  for (k=0;k<pair_num;++k) {
+    if (pair_tok[k][0]!=p->tok) continue;
+    t=pair_tok[k][1];
+    a=ctx->work_tok_start[t];
+    b=ctx->work_tok_start[t+1];
+    ctx->work_end_pair[ctx->work_pairs]=b;
+    /* the first one after j */
+    while (a<b) {
+      m=(a+b)/2;
+      if (ctx->work_tok_pos[m]>j) b=m; else a=m+1; }
+    ctx->work_cur_pair[ctx->work_pairs++]=a; }
+}
+
+int pair_next(block *ctx, int x)
 {
-  static int i,j,x,y;
-  static int (*com_match2)();
-  static line *il,*jl,*tmp;
+  int k,m;
+
+  while (ctx->work_cur_par<=x) ctx->work_cur_par=ctx->work_next_par[ctx->work_cur_par];
+  while (ctx->work_cur_tok<=x) ctx->work_cur_tok=ctx->work_next_tok[ctx->work_cur_tok];
+  m=ctx->work_cur_par;
+  if (ctx->work_cur_tok<m) m=ctx->work_cur_tok;
+  for (k=0;k<ctx->work_pairs;++k) {
+    while (ctx->work_cur_pair[k]<ctx->work_end_pair[k] &&
+           ctx->work_tok_pos[ctx->work_cur_pair[k]]<=x) ctx->work_cur_pair[k]++;
+    if (ctx->work_cur_pair[k]<ctx->work_end_pair[k] &&
+        ctx->work_tok_pos[ctx->work_cur_pair[k]]<m) m=ctx->work_tok_pos[ctx->work_cur_pair[k]]; }
+  return m;
+}
+
+int opti3(block *ctx)
+{
+  int i,j,x,y;
+  int (*com_match2)(block *, int);
+  line *il,*jl,*tmp;
+
+  opti3_work(ctx);
+  line_index(ctx);
 
-  tmp=&blkbuf[blkbuf_len];
+  tmp=&ctx->blkbuf[ctx->blkbuf_len];
 
   i=0;
-  while (i<blkbuf_len-1) {
-    test_match=0;
-    com_match2=com_match1(i);
-    if (com_match2==NULL || (blkbuf[i].flags & fixed)!=0 ) { i++; continue; }
+  while (i<ctx->blkbuf_len-1) {
+    if (!ctx->work_pending[ctx->blkbuf[i].serial]) { i++; continue; }
+    ctx->test_match=0;
+    ctx->work_read=i;
+    com_match2=com_match1(ctx,i);
+    /* repeated commands are only merged by com_match2_default, if not dupl */
+    if (com_match2==NULL || (ctx->blkbuf[i].flags & fixed)!=0 ||
+        (com_match2==com_match2_default && (ctx->blkbuf[i].flags & dupl)!=0) ) {
+      ctx->work_pending[ctx->blkbuf[i].serial]=0;
+      ctx->work_reach[ctx->blkbuf[i].serial]=0;
+      i++; continue; }
     j=i+1;
-    while (j<blkbuf_len) {
-      if (blkbuf[j].flags & fixed) break; /* don't move through fixed items */
+    while (j<ctx->blkbuf_len) {
+      if (ctx->blkbuf[j].flags & fixed) break; /* don't move through fixed items */
 #     ifdef debug
-      printf("o+: %i,%i ?\n",i,j);
+      bprintf(ctx,"o+: %i,%i ?\n",i,j);
 #     endif
-      if (com_match2(j)) return 1;
-      if (!changeable(i,j)) break;
+      if (com_match2(ctx,j)) return 1;
+      if (!changeable(ctx,i,j)) break;
       j++; }
-    x=j+1;
-    test_match=1;
-    while (x<blkbuf_len) {
-      if (blkbuf[j].flags & fixed) break; /* don't move through fixed items */
+    /* lines other than second commands are not tried */
+    x=ctx->blkbuf_len;
+    if (j<x) {
+      pair_first(ctx,i,j);
+      x=pair_next(ctx,j); }
+    ctx->test_match=1;
+    while (x<ctx->blkbuf_len) {
+      if (ctx->blkbuf[j].flags & fixed) break; /* don't move through fixed items */
 #     ifdef debug
-      printf("o-: %i,%i\n",i,x);
+      bprintf(ctx,"o-: %i,%i\n",i,x);
 #     endif
-      if (!com_match2(x)) { x++; continue; }
+      if (!com_match2(ctx,x)) { x=pair_next(ctx,x); continue; }
       y=x-1;
-      while (y>j && changeable(y,x)) y--;
-      if (y==j && changeable(y,x)) {
+      while (y>j && changeable(ctx,y,x)) y--;
+      if (y==j && changeable(ctx,y,x)) {
         /* move x upwards to position j */
         y=x-1;
         while (y>=j) {
-          il=&blkbuf[y];
-          jl=&blkbuf[y+1];
+          il=&ctx->blkbuf[y];
+          jl=&ctx->blkbuf[y+1];
           line_copy(tmp,il);
           line_copy(il,jl);
           line_copy(jl,tmp);
           y--; }
-        test_match=0;
-        com_match2(j);
+        ctx->test_match=0;
+        com_match2(ctx,j);
         return 1; }
-      x++; }
+      x=pair_next(ctx,x); }
+    /* nothing to change, as long as the lines read stay the same */
+    if (j>ctx->work_read) ctx->work_read=j;
+    if (ctx->work_read>=ctx->blkbuf_len) ctx->work_read=ctx->blkbuf_len-1;
+    ctx->work_pending[ctx->blkbuf[i].serial]=0;
+    ctx->work_reach[ctx->blkbuf[i].serial]=ctx->work_read-i;
     i++; }
 
   return 0;
@@ -2133,157 +2620,591 @@ int opti3()
 
 /*********************************************************************/
 
-void add_line(line *p)
+#ifdef USE_RULE_DATABASE
+
+static rule_rewriter *rewriter; /* only read, by all threads */
+
+#define mode_imp 0
+#define mode_imm 1
+#define mode_abs 2
+
+/* opcodes of the commands the superoptimizer knows:
+   implied or accumulator, immediate, absolute (-1 if none) */
+
+static short tok_opcode[tok_num][3]={
+
+  /* cmp */ { -1  , 0xc9, 0xcd },
+  /* cpx */ { -1  , 0xe0, 0xec },
+  /* cpy */ { -1  , 0xc0, 0xcc },
+  /* bit */ { -1  , -1  , -1   },
+  /* bcc..bvs */
+            { -1  , -1  , -1   }, { -1  , -1  , -1   }, { -1  , -1  , -1   }, { -1  , -1  , -1   },
+            { -1  , -1  , -1   }, { -1  , -1  , -1   }, { -1  , -1  , -1   }, { -1  , -1  , -1   },
+  /* jmp */ { -1  , -1  , -1   },
+  /* jsr */ { -1  , -1  , -1   },
+  /* asl */ { 0x0a, -1  , 0x0e },
+  /* lsr */ { 0x4a, -1  , 0x4e },
+  /* rol */ { 0x2a, -1  , 0x2e },
+  /* ror */ { 0x6a, -1  , 0x6e },
+  /* clc */ { 0x18, -1  , -1   },
+  /* cld */ { 0xd8, -1  , -1   },
+  /* cli */ { -1  , -1  , -1   },
+  /* clv */ { 0xb8, -1  , -1   },
+  /* sec */ { 0x38, -1  , -1   },
+  /* sed */ { -1  , -1  , -1   }, /* rules are for binary mode only */
+  /* sei */ { -1  , -1  , -1   },
+  /* nop */ { -1  , -1  , -1   },
+  /* rts */ { -1  , -1  , -1   },
+  /* rti */ { -1  , -1  , -1   },
+  /* brk */ { -1  , -1  , -1   },
+  /* lda */ { -1  , 0xa9, 0xad },
+  /* ldx */ { -1  , 0xa2, 0xae },
+  /* ldy */ { -1  , 0xa0, 0xac },
+  /* sta */ { -1  , -1  , 0x8d },
+  /* stx */ { -1  , -1  , 0x8e },
+  /* sty */ { -1  , -1  , 0x8c },
+  /* tax */ { 0xaa, -1  , -1   },
+  /* tay */ { 0xa8, -1  , -1   },
+  /* txa */ { 0x8a, -1  , -1   },
+  /* tya */ { 0x98, -1  , -1   },
+  /* txs */ { 0x9a, -1  , -1   },
+  /* tsx */ { 0xba, -1  , -1   },
+  /* pla */ { 0x68, -1  , -1   },
+  /* plp */ { 0x28, -1  , -1   },
+  /* pha */ { 0x48, -1  , -1   },
+  /* php */ { 0x08, -1  , -1   },
+  /* adc */ { -1  , 0x69, 0x6d },
+  /* sbc */ { -1  , 0xe9, 0xed },
+  /* inc */ { -1  , -1  , 0xee },
+  /* dec */ { -1  , -1  , 0xce },
+  /* inx */ { 0xe8, -1  , -1   },
+  /* dex */ { 0xca, -1  , -1   },
+  /* iny */ { 0xc8, -1  , -1   },
+  /* dey */ { 0x88, -1  , -1   },
+  /* and */ { -1  , 0x29, 0x2d },
+  /* ora */ { -1  , 0x09, 0x0d },
+  /* eor */ { -1  , 0x49, 0x4d },
+  /* jcc..jvs */
+            { -1  , -1  , -1   }, { -1  , -1  , -1   }, { -1  , -1  , -1   }, { -1  , -1  , -1   },
+            { -1  , -1  , -1   }, { -1  , -1  , -1   }, { -1  , -1  , -1   }, { -1  , -1  , -1   }
+
+  };
+
+/* addressing mode of a line for the rewriter, -1 if no rule can contain
+   the line */
+
+int rule_mode(block *ctx, line *p)
 {
-  if (blkbuf_len+1==blkbuf_max) {
-    printf("error: block-buffer overrun\n");
-    exit(1); }
-  if (blkbuf_len==0) was_line=inp_line;
-  line_copy(&blkbuf[blkbuf_len],p);
-  blkbuf_len++;
+  if (p->flags & (fixed|isjmp)) return -1;
+  if (p->par>0xffff-0x100) return -1; /* no id left */
+
+  if (p->par==no_par) return mode_imp;
+  if (p->depind & mem) {
+    if (p->depind & (imem|reg_x|reg_y)) return -1;
+    return mode_abs; }
+  if (ctx->parbuf[ctx->par_pos[p->par]]=='#') return mode_imm;
+  return mode_imp; /* accumulator */
+}
+
+/* opcode of a line and its operand for the rewriter, -1 if no rule can
+   contain the line */
+
+int rule_opcode(block *ctx, line *p, unsigned short *operand)
+{
+  int mode;
+
+  mode=rule_mode(ctx,p);
+  if (mode<0) return -1;
+
+  *operand=0;
+  if (mode==mode_imm) {
+    if (p->depind & absolute) *operand=p->mpar;
+    else *operand=0x100+p->par; }
+  if (mode==mode_abs) *operand=0x100+p->par;
+
+  return tok_opcode[p->tok][mode];
+}
+
+/* outputs live after a line as the rewriter's D_A..D_P */
+
+int rule_live(line *p)
+{
+  int map,live;
+
+  map=(p->feeds|p->passes) & valid_map;
+  live=0;
+  if (map & reg_a ) live|=0x01;
+  if (map & reg_x ) live|=0x02;
+  if (map & reg_y ) live|=0x04;
+  if (map & reg_s ) live|=0x08;
+  if (map & reg_sr) live|=0x10;
+  return live;
+}
+
+/* line for an instruction of the rewriter, the operand taken from a line
+   of the same mode among the lines [from,to) it replaces; the operand of
+   an accumulator line is no operand of any other mode */
+
+int rule_line(block *ctx, line *p, rule_rewriter_instruction *r, int from, int to)
+{
+  int t,mode,i;
+  unsigned short operand;
+
+  t=0; mode=0;
+  while (t<tok_num) {
+    mode=0;
+    while (mode<3 && tok_opcode[t][mode]!=r->opcode) mode++;
+    if (mode<3) break;
+    t++; }
+  if (t==tok_num) return 0;
+
+  p->tok=t;
+  p->dep=tok[t].dep;
+  p->mod=tok[t].mod;
+  p->flags=tok[t].flags;
+  p->feeds=0;
+  p->passes=0;
+  p->depind=0;
+  p->par=no_par;
+  p->mpar=0;
+  p->mparhi=0;
+  if (mode==mode_imp) return 1;
+
+  i=from;
+  while (i<to) {
+    if (rule_mode(ctx,&ctx->blkbuf[i])==mode
+        && rule_opcode(ctx,&ctx->blkbuf[i],&operand)>=0 && operand==r->operand) {
+      p->dep|=ctx->blkbuf[i].depind & valid_map;
+      p->depind=ctx->blkbuf[i].depind;
+      p->par=ctx->blkbuf[i].par;
+      p->mpar=ctx->blkbuf[i].mpar;
+      p->mparhi=ctx->blkbuf[i].mparhi;
+      return 1; }
+    i++; }
+
+  /* a constant of the rule */
+  if (mode!=mode_imm || r->operand>0xff) return 0;
+  set_absval(ctx,p,r->operand);
+  p->mpar=r->operand;
+  return 1;
+}
+
+/* replace the len lines at pos with count new ones */
+
+void rule_splice(block *ctx, int pos, int len, line *lines, int count)
+{
+  int x;
+
+  blk_reserve(ctx,ctx->blkbuf_len+count-len);
+  if (count<len) {
+    x=pos+len;
+    while (x<ctx->blkbuf_len) { iline_copy(x-len+count,x); x++; } }
+  if (count>len) {
+    x=ctx->blkbuf_len-1;
+    while (x>=pos+len) { iline_copy(x-len+count,x); x--; } }
+  ctx->blkbuf_len+=count-len;
+  x=0;
+  while (x<count) {
+    line_copy(&ctx->blkbuf[pos+x],&lines[x]);
+    ctx->blkbuf[pos+x].serial=ctx->serial_num++;
+    x++; }
+}
+
+int opti_rules(block *ctx)
+{
+  rule_rewriter_instruction *program,*rewritten;
+  rule_rewriter_span *spans,*sp;
+  unsigned char *live;
+  line *lines;
+  int i,j,start,count,spans_num,x,max;
+
+  /* query the rule database with every run of lines it knows,
+     a replacement may be up to twice as long as its run */
+
+  if (rewriter==NULL) return 0;
+
+  make_feedlist(ctx);
+
+  max=ctx->rules_program_max;
+  program=ctx->rules_program=(rule_rewriter_instruction *)grow(ctx->rules_program,&max,ctx->blkbuf_len,sizeof(rule_rewriter_instruction));
+  max=ctx->rules_program_max;
+  spans=ctx->rules_spans=(rule_rewriter_span *)grow(ctx->rules_spans,&max,ctx->blkbuf_len,sizeof(rule_rewriter_span));
+  live=ctx->rules_live=(unsigned char *)grow(ctx->rules_live,&ctx->rules_program_max,ctx->blkbuf_len,1);
+  max=ctx->rules_rewritten_max;
+  rewritten=ctx->rules_rewritten=(rule_rewriter_instruction *)grow(ctx->rules_rewritten,&max,2*ctx->blkbuf_len,sizeof(rule_rewriter_instruction));
+  lines=ctx->rules_lines=(line *)grow(ctx->rules_lines,&ctx->rules_rewritten_max,2*ctx->blkbuf_len,sizeof(line));
+
+  i=0;
+  while (i<ctx->blkbuf_len) {
+    start=i;
+    while (i<ctx->blkbuf_len && rule_opcode(ctx,&ctx->blkbuf[i],&program[i-start].operand)>=0) {
+      program[i-start].opcode=rule_opcode(ctx,&ctx->blkbuf[i],&program[i-start].operand);
+      live[i-start]=rule_live(&ctx->blkbuf[i]);
+      i++; }
+    if (i==start) { i++; continue; }
+
+    count=rule_rewriter_apply(rewriter,program,live,i-start,rewritten,2*(i-start),spans,&spans_num);
+    if (count<0) continue;
+
+    /* new lines only for the spans replaced, each with the operands of
+       its own lines; the rest of the run is left as it is */
+
+    x=0;
+    while (x<spans_num) {
+      sp=&spans[x];
+      j=0;
+      while (j<sp->count && rule_line(ctx,&lines[sp->at+j],&rewritten[sp->at+j],start+sp->start,start+sp->start+sp->length)) j++;
+      if (j<sp->count) break;
+      x++; }
+    if (x<spans_num) continue;
+
+#   ifdef VERBOSE
+    bprintf(ctx,";; RULES: %i lines -> %i\n",i-start,count);
+#   endif
+
+    /* from the last span, so that the earlier ones stay where they are */
+
+    x=spans_num;
+    while (x-->0)
+      rule_splice(ctx,start+spans[x].start,spans[x].length,&lines[spans[x].at],spans[x].count);
+
+    ctx->opt++;
+    return 1; }
+
+  return 0;
+}
+
+#endif
+
+/*********************************************************************/
+
+void add_line(block *ctx, line *p)
+{
+  blk_reserve(ctx,ctx->blkbuf_len+1);
+  if (ctx->blkbuf_len==0) ctx->was_line=inp_line;
+  /* the original is kept as it is read, for the listing of changes */
+  line_copy(&ctx->blkbuf[ctx->blkbuf_len],p);
+  line_copy(&ctx->blkbuf_org[ctx->blkbuf_len],p);
+  ctx->blkbuf_len++;
+  ctx->blkbuf_org_len=ctx->blkbuf_len;
 
 # ifdef debug_parse
-  printf("line %i added tok=%i\n",blkbuf_len-1,blkbuf[blkbuf_len-1]);
+  bprintf(ctx,"line %i added tok=%i\n",ctx->blkbuf_len-1,ctx->blkbuf[ctx->blkbuf_len-1]);
 # endif
 }
 
-void optimize_block(void)
+void optimize_block(block *ctx)
 {
 int i,len;
 
-  if (blkbuf_len<1) return;
-
-  memcpy(blkbuf_org,blkbuf,sizeof(line)*blkbuf_len);
-  blkbuf_org_len=blkbuf_len;
+  if (ctx->blkbuf_len<1) return;
 
   dbmsg("<BLOCK>\n");
 
-  opt=0;
+  ctx->opt=0;
+
+  for (i=0;i<ctx->blkbuf_len;++i) ctx->blkbuf[i].serial=i;
+  ctx->serial_num=ctx->blkbuf_len;
+  ctx->work_len=0;
 
  while (1) {
-  make_feedlist();
+  make_feedlist(ctx);
 
 # ifdef debug
 {
   int i;
   i=0;
-  while (i<blkbuf_len)
+  while (i<ctx->blkbuf_len)
   {
-    printf("%3i:",i);
-    lineout(&blkbuf[i]);
+    bprintf(ctx,"%3i:",i);
+    lineout(ctx,&ctx->blkbuf[i]);
     i++;
   }
 }
 # endif
 
   dbmsg("simple...\n");
-  if (simple_erase()) continue;
+  if (simple_erase(ctx)) continue;
 
   dbmsg("opti1...\n");
-  if (opti1()) continue;
+  if (opti1(ctx)) continue;
 
   dbmsg("opti2...\n");
-  if (opti2()) continue;
+  if (opti2(ctx)) continue;
 
   dbmsg("opti3...\n");
-  if (opti3()) continue;
+  if (opti3(ctx)) continue;
+
+# ifdef USE_RULE_DATABASE
+  dbmsg("rules...\n");
+  if (opti_rules(ctx)) continue;
+# endif
 
   break;
   }
 
 # ifdef debug
-  printf("<result>\n");
+  bprintf(ctx,"<result>\n");
   i=0;
-  while (i<blkbuf_len)
+  while (i<ctx->blkbuf_len)
   {
-    printf("%3i ",i);
-    lineout(&blkbuf[i]);
+    bprintf(ctx,"%3i ",i);
+    lineout(ctx,&ctx->blkbuf[i]);
     i++;
   }
 # endif
 
-  printf("\n");
-  if (opt!=0)
+  bprintf(ctx,"\n");
+  if (ctx->opt!=0)
   {
-  	//printf(";; REMOVED %i was line %i\n",opt,was_line);
-	//remove_count+=opt;
+  	//bprintf(ctx,";; REMOVED %i was line %i\n",ctx->opt,ctx->was_line);
+	//ctx->remove_count+=ctx->opt;
 
-	if(blkbuf_org_len>blkbuf_len)
+	if(ctx->blkbuf_org_len>ctx->blkbuf_len)
 	{
-		len=blkbuf_org_len;
+		len=ctx->blkbuf_org_len;
 	}
 	else
 	{
-		len=blkbuf_len;
+		len=ctx->blkbuf_len;
 	}
-	remove_count+=(blkbuf_org_len-blkbuf_len);
-	hit_count++;
+	ctx->remove_count+=(ctx->blkbuf_org_len-ctx->blkbuf_len);
+	ctx->hit_count++;
 
-    printf(";;line %19s  %19s\n","optimized","original");
+    bprintf(ctx,";;line %19s  %19s\n","optimized","original");
 
   for (i=0;i<len;++i)
   {
-    printf(";; %3d ",i);
-    if(i<blkbuf_len)
+    bprintf(ctx,";; %3d ",i);
+    if(i<ctx->blkbuf_len)
 	{
-		blk_lineout(&blkbuf[i]);
+		blk_lineout(ctx,&ctx->blkbuf[i]);
 	}
 	else
 	{
-		printf("%19s","");
+		bprintf(ctx,"%19s","");
 	}
 
-    printf(" | ");
+    bprintf(ctx," | ");
 
-    if(i<blkbuf_org_len)
+    if(i<ctx->blkbuf_org_len)
 	{
-		blk_lineout(&blkbuf_org[i]);
-		blk_infoout(&blkbuf_org[i]);
+		blk_lineout(ctx,&ctx->blkbuf_org[i]);
+		blk_infoout(ctx,&ctx->blkbuf_org[i]);
 	}
 	else
 	{
-		//printf("%19s","");
+		//bprintf(ctx,"%19s","");
 	}
 
-    printf("\n");
+    bprintf(ctx,"\n");
   }
-  printf(";; %d instructions saved.\n",(blkbuf_org_len-blkbuf_len));
+  bprintf(ctx,";; %d instructions saved.\n",(ctx->blkbuf_org_len-ctx->blkbuf_len));
 
 
   }
 
   /* output optimized lines */
-  bufout();
-  printf("\n");
+  bufout(ctx);
+  bprintf(ctx,"\n");
 
-  blkbuf_len=0;  /* erase block-buffer */
+  ctx->blkbuf_len=0;  /* erase block-buffer */
 
 }
 
 /*********************************************************************/
 
-int main(int argc, char **argv)
+block *new_block(void)
+{
+  block *ctx;
+
+  ctx=(block *)calloc(1,sizeof(block));
+  if (ctx==NULL) {
+    printf("error: out of memory\n");
+    exit(1); }
+  return ctx;
+}
+
+/* free the buffers used to optimize a block, its output is kept */
+
+void free_buffers(block *ctx)
+{
+  free(ctx->blkbuf);
+  free(ctx->blkbuf_org);
+  free(ctx->par_pos);
+  free(ctx->parbuf);
+  free(ctx->mparbuf);
+  free(ctx->mpar_pos);
+  free(ctx->mpar_flag);
+  index_free(&ctx->par_index);
+  index_free(&ctx->mpar_index);
+  free(ctx->work_last);
+  free(ctx->work_where);
+  free(ctx->work_reach);
+  free(ctx->work_pending);
+  free(ctx->work_count);
+  free(ctx->work_limit_par);
+  free(ctx->work_next_par);
+  free(ctx->work_next_tok);
+  free(ctx->work_tok_pos);
+  ctx->work_last=NULL;
+  ctx->work_where=ctx->work_reach=ctx->work_count=ctx->work_limit_par=NULL;
+  ctx->work_next_par=ctx->work_next_tok=ctx->work_tok_pos=NULL;
+  ctx->work_index_max=0;
+  ctx->work_pending=NULL;
+  ctx->work_len=ctx->work_max=ctx->work_serial_max=ctx->work_par_max=0;
+#ifdef USE_RULE_DATABASE
+  free(ctx->rules_program);
+  free(ctx->rules_rewritten);
+  free(ctx->rules_live);
+  free(ctx->rules_spans);
+  free(ctx->rules_lines);
+  ctx->rules_program=ctx->rules_rewritten=NULL;
+  ctx->rules_live=NULL;
+  ctx->rules_spans=NULL;
+  ctx->rules_lines=NULL;
+  ctx->rules_program_max=ctx->rules_rewritten_max=0;
+#endif
+  ctx->blkbuf=ctx->blkbuf_org=NULL;
+  ctx->blkbuf_len=ctx->blkbuf_org_len=ctx->blkbuf_max=0;
+  ctx->par_pos=NULL;
+  ctx->parbuf=NULL;
+  ctx->par_num=ctx->par_max=ctx->par_used=ctx->parbuf_max=0;
+  ctx->mparbuf=NULL;
+  ctx->mpar_pos=ctx->mpar_flag=NULL;
+  ctx->mpar_num=ctx->mpar_max=ctx->mpar_used=ctx->mparbuf_max=0;
+}
+
+void free_block(block *ctx)
+{
+  free_buffers(ctx);
+  free(ctx->out);
+  free(ctx);
+}
+
+/* the parameters of line p of block from, interned in block to */
+
+void move_line(block *to, block *from, line *p)
+{
+  char *a;
+
+  if (p->par!=no_par) {
+    a=&from->parbuf[from->par_pos[p->par]];
+    p->par=get_parid(to,a,strlen(a)); }
+  if (p->depind & mem) {
+    a=&from->mparbuf[from->mpar_pos[p->mpar]];
+    p->mpar=get_mparid(to,a,strlen(a)); }
+  if (p->depind & imem) {
+    a=&from->mparbuf[from->mpar_pos[p->mparhi]];
+    p->mparhi=get_mparid(to,a,strlen(a)); }
+}
+
+/* take the lines of the block read so far, with the parameters they
+   refer to and the output printed before them, into a block of its own */
+
+block *take_block(block *ctx)
+{
+  block *b;
+  int i;
+
+  b=new_block();
+  b->out=ctx->out;
+  b->out_len=ctx->out_len;
+  b->out_max=ctx->out_max;
+  ctx->out=NULL;
+  ctx->out_len=ctx->out_max=0;
+
+  blk_reserve(b,ctx->blkbuf_len);
+  for (i=0;i<ctx->blkbuf_len;++i) {
+    line_copy(&b->blkbuf[i],&ctx->blkbuf[i]);
+    move_line(b,ctx,&b->blkbuf[i]); }
+  for (i=0;i<ctx->blkbuf_org_len;++i) {
+    line_copy(&b->blkbuf_org[i],&ctx->blkbuf_org[i]);
+    move_line(b,ctx,&b->blkbuf_org[i]); }
+  b->blkbuf_len=ctx->blkbuf_len;
+  b->blkbuf_org_len=ctx->blkbuf_org_len;
+
+  b->blk_mod=ctx->blk_mod;
+  b->was_line=ctx->was_line;
+
+  ctx->blkbuf_len=0;
+  ctx->blkbuf_org_len=0;
+  return b;
+}
+
+void add_block(block_list *list, block *b)
+{
+  list->blk=(block **)grow(list->blk,&list->max,list->num+1,sizeof(block *));
+  list->blk[list->num++]=b;
+}
+
+/* print what was printed to a block so far and count its hits */
+
+void put_block(block_list *list, block *b)
+{
+  fwrite(b->out,1,b->out_len,list->fout);
+  list->remove_count+=b->remove_count;
+  list->hit_count+=b->hit_count;
+  b->out_len=0;
+  b->remove_count=b->hit_count=0;
+}
+
+/* optimize the blocks kept so far, then print them in order */
+
+void flush_blocks(block_list *list)
+{
+  int i;
+
+#ifdef _OPENMP
+# pragma omp parallel for schedule(dynamic)
+#endif
+  for (i=0;i<list->num;++i)
+  {
+    optimize_block(list->blk[i]);
+    free_buffers(list->blk[i]);
+  }
+  for (i=0;i<list->num;++i)
+  {
+    put_block(list,list->blk[i]);
+    free_block(list->blk[i]);
+  }
+  list->num=0;
+}
+
+/* the end of a block: with one thread it is optimized and printed right
+   away and its parameters are cleared, else it is kept to be optimized with the next ones, and the
+   output that follows it goes to the next block */
+
+void end_block(block *ctx, block_list *list)
+{
+  if (ctx->blkbuf_len<1) return;
+  if (list->threads<2) {
+    optimize_block(ctx);
+    put_block(list,ctx);
+    clear_buf(ctx);
+    return; }
+  add_block(list,take_block(ctx));
+  if (list->num>=batch_blocks) flush_blocks(list);
+}
+
+/*********************************************************************/
+
+/* split a file into blocks and print it optimized, everything that is
+   not optimized is printed to the block that follows it */
+
+void read_file(FILE *fin, block_list *list)
 {
   char linebuf[line_len];
   line tmp;
   int  ret;
-  FILE *fin;
   int  i;
   int  wall_flag;
+  block *ctx;
 
-  if (argc<2) how_to();
-  fin=fopen(argv[1],"r");
-  if (fin==NULL) { printf("can't open file\n"); exit(1); }
-
-  par_used=0;
-  par_num=0;
-  blkbuf_len=0;
+  ctx=new_block();
   wall_flag=0;
   inp_line=0;
 
-  remove_count=0;
-  hit_count=0;
-
   while(readline(linebuf,fin)!=EOF)
   {
 
@@ -2293,7 +3214,7 @@ int main(int argc, char **argv)
 
       /* read blk_mod from input-line */
       i=nextchar(linebuf,i+3);
-      blk_mod=0;
+      ctx->blk_mod=0;
       while (linebuf[i]!='\0')
 	  {
         switch (linebuf[i])
@@ -2310,7 +3231,7 @@ int main(int argc, char **argv)
           default :  {
             printf("  error: unknown flag/register \"%c\"\n",linebuf[i]); exit(1); }
 		}
-        blk_mod|=wall_flag;
+        ctx->blk_mod|=wall_flag;
         i=nextchar(linebuf,i+1);
 	  }
 
@@ -2318,32 +3239,34 @@ int main(int argc, char **argv)
       continue;
 	}
 
-    ret=parse_line(linebuf, &tmp);
+    ret=parse_line(ctx,linebuf, &tmp);
 
     if (ret!=0)
 	{
       if (!wall_flag)
 	  {
-	  	blk_mod=valid_map;
+	  	ctx->blk_mod=valid_map;
 	  }
-      optimize_block();
+      end_block(ctx,list);
       wall_flag=0;
       if ( tmp.tok==no_tok  || ret>1 || (tmp.flags & isjmp)!=0 )
 	  {
-	  	clear_buf();
-		puts(linebuf);
+	  	clear_buf(ctx);
+		bprintf(ctx,"%s\n",linebuf);
 	  }
       else
 	  { /* only print label */
         i=nextchar(linebuf,0);
         while ( linebuf[i]!='\0' && linebuf[i]!=' ' && linebuf[i]!='\t' )
 		{
-          putc(linebuf[i++],stdout);
+          bprintf(ctx,"%c",linebuf[i++]);
 		}
-        printf("\n");
+        bprintf(ctx,"\n");
         if (tmp.tok!=null_tok)
 		{
-			add_line(&tmp);
+			/* its parameters were cleared with the block it ended */
+			if (list->threads<2) parse_line(ctx,linebuf,&tmp);
+			add_line(ctx,&tmp);
 		}
 	  }
       continue;
@@ -2351,7 +3274,7 @@ int main(int argc, char **argv)
 
     if (tmp.tok==null_tok) {
 #     ifdef debug_parse
-      puts(linebuf);
+      bprintf(ctx,"%s\n",linebuf);
 #     endif
       continue; }
 
@@ -2359,25 +3282,94 @@ int main(int argc, char **argv)
 	{
       if (!wall_flag)
 	  {
-	  	blk_mod=valid_map;
+	  	ctx->blk_mod=valid_map;
 	  }
-      optimize_block();
-      puts(linebuf);
-      clear_buf();
+      end_block(ctx,list);
+      bprintf(ctx,"%s\n",linebuf);
+      clear_buf(ctx);
 	}
     else
 	{
-	   if (tmp.tok==as_jsr) printf("argh!");
-           add_line(&tmp);
+	   if (tmp.tok==as_jsr) bprintf(ctx,"argh!");
+           add_line(ctx,&tmp);
 	}
 
   wall_flag=0;
   }
 
-  fclose(fin);
+  /* lines after the last block end are not printed */
+  flush_blocks(list);
+  put_block(list,ctx);
+  free_block(ctx);
+}
+
+/*********************************************************************/
+
+int main(int argc, char **argv)
+{
+  FILE *fin,*fout;
+  block_list list;
+  char *name;
+  int  files,first,threads;
+  int  f;
+
+  threads=0;
+  first=1;
+  while (first<argc && argv[first][0]=='-' && first+1<argc) {
+    if (strcmp(argv[first],"-j")==0) {
+      threads=atoi(argv[first+1]);
+      if (threads<1) how_to(); }
+#ifdef USE_RULE_DATABASE
+    else if (strcmp(argv[first],"-r")==0) {
+      rewriter=rule_rewriter_open(argv[first+1],REWRITER_CYCLES);
+      if (rewriter==NULL) { printf("can't open rules\n"); exit(1); } }
+#endif
+    else how_to();
+    first+=2; }
+  files=argc-first;
+  if (files<1) how_to();
+
+  init_tok_index();
+
+  list.blk=NULL;
+  list.num=0;
+  list.max=0;
+  list.threads=1;
+  list.remove_count=0;
+  list.hit_count=0;
+
+#ifdef _OPENMP
+  if (threads>0) omp_set_num_threads(threads);
+  list.threads=omp_get_max_threads();
+#endif
+
+  /* each file is optimized while it is read */
+
+  for (f=0;f<files;++f)
+  {
+    fin=fopen(argv[first+f],"r");
+    if (fin==NULL) { printf("can't open file\n"); exit(1); }
+    fout=stdout;
+    if (files>1) {
+      name=(char *)malloc(strlen(argv[first+f])+5);
+      if (name==NULL) { printf("error: out of memory\n"); exit(1); }
+      sprintf(name,"%s.opt",argv[first+f]);
+      fout=fopen(name,"w");
+      if (fout==NULL) { printf("can't write %s\n",name); exit(1); }
+      free(name); }
+    list.fout=fout;
+    read_file(fin,&list);
+    fclose(fin);
+    if (fout!=stdout) fclose(fout);
+  }
+  free(list.blk);
+
+#ifdef USE_RULE_DATABASE
+  rule_rewriter_close(rewriter);
+#endif
 
-  fprintf(stderr,"%d hit(s), ",hit_count);
-  fprintf(stderr,"%d instructions(s) removed.\n",remove_count);
+  fprintf(stderr,"%d hit(s), ",list.hit_count);
+  fprintf(stderr,"%d instructions(s) removed.\n",list.remove_count);
 
   return 0;
 }